@@ -101,7 +101,10 @@ struct ploop_functions {
 	void (*release_bitmap)(struct ploop_bitmap *bmap);
 	struct ploop_bitmap *(*get_tracking_bitmap_from_image)(struct ploop_disk_images_data *di, const char *guid);
 	int (*get_fs_info)(const char *descr, struct ploop_fs_info *info, int size);
-	void *padding[61];
+	int (*set_io_limit)(unsigned long long bps, unsigned int iops);
+	int (*merge_estimate)(struct ploop_disk_images_data *di, struct ploop_merge_param *param, struct ploop_merge_estimate *est);
+	void (*free_merge_estimate)(struct ploop_merge_estimate *est);
+	void *padding[58];
 }; /* struct ploop_functions */
 
 __attribute__ ((visibility("default")))
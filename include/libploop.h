@@ -180,6 +180,29 @@ struct ploop_merge_param {
 	const char *guid;
 	const char *unused2;
 	const char *new_delta;
+	int queue_depth;	/* number of clusters copied in parallel */
+	unsigned int max_io_size; /* max I/O size on contiguous clusters, bytes */
+	__u64 io_limit_bps;	/* I/O limits, see ploop_set_io_limit() */
+	unsigned int io_limit_iops;
+	char dummy[12];
+};
+
+/* Merge estimation: a delta merged to its parent */
+struct ploop_merge_level_estimate {
+	char *image;		/* delta to be merged */
+	__u64 copy_clusters;	/* clusters to be copied */
+	__u64 new_clusters;	/* clusters to be allocated in the destination */
+};
+
+struct ploop_merge_estimate {
+	__u32 cluster;		/* cluster size, bytes */
+	int nlevels;
+	struct ploop_merge_level_estimate *levels; /* in merge order */
+	__u64 copy_bytes;	/* total data to be copied */
+	__u64 alloc_bytes;	/* total space to be allocated */
+	__u64 peak_bytes;	/* peak space used by the images */
+	__u64 throughput;	/* measured throughput, bytes/s */
+	__u64 duration;		/* projected duration, seconds */
 	char dummy[32];
 };
 
@@ -237,13 +260,44 @@ struct ploop_copy_receive_param {
 	int feedback_fd;	/* File descriptor to send feedback
 				 * to ploop_copy_send()
 				 */
-	char dummy[32];
+	int *ifds;		/* Additional streams to read from */
+	int nifds;
+	int resume;		/* Keep the existing file, only the clusters
+				 * that differ are received
+				 */
+	int direct;		/* Write the file with O_DIRECT */
+	int compact;		/* Lay the ploop1 image out anew: data clusters
+				 * in the order of the index, no holes
+				 */
+	/* sized to keep the struct size with 4 byte pointers too */
+	char dummy[16 - sizeof(int *)];
+};
+
+enum {
+	PLOOP_COPY_COMPRESS_NONE	= 0,
+	PLOOP_COPY_COMPRESS_ZLIB	= 1,
+};
+
+/* ploop_copy_image() flags */
+enum {
+	PLOOP_COPY_FLATTEN		= 0x01,	/* merge the chain into one image */
 };
 
 struct ploop_copy_param {
 	int ofd;
 	int async;
-	char dummy[32];
+	int compress;		/* PLOOP_COPY_COMPRESS_* */
+	int compress_level;	/* 0 - codec default */
+	int *ofds;		/* Additional streams, data is striped
+				 * over ofd and ofds by cluster
+				 */
+	int nofds;
+	int resume;		/* Skip clusters the receiver already has */
+	int zerocopy;		/* Send data right from the image, with no
+				 * compression and no zero data detection
+				 */
+	/* sized to keep the struct size with 4 byte pointers too */
+	char dummy[12 - sizeof(int *)];
 };
 
 struct ploop_copy_stat {
@@ -251,6 +305,33 @@ struct ploop_copy_stat {
 	__u64 xferred;
 };
 
+#define PLOOP_COPY_PASS_STAT_V1	1
+
+/*
+ * Statistics of the last ploop_copy_start(), ploop_copy_next_iteration()
+ * or ploop_copy_stop(), see ploop_copy_get_stat(). The caller sets the
+ * version; fields are only added to the end by the later versions.
+ */
+struct ploop_copy_pass_stat {
+	int version;		/* PLOOP_COPY_PASS_STAT_V1 */
+	int pass;		/* 0 - ploop_copy_start() */
+	__u64 wall_us;		/* duration of the call */
+	__u64 xferred;		/* image data sent */
+	__u64 read_bytes;	/* image data read */
+	__u64 read_us;		/* time spent in reads */
+	__u64 read_rate;	/* bytes/s while reading */
+	__u64 send_bytes;	/* written to the output, compressed */
+	__u64 send_us;		/* time spent in writes, all the streams */
+	__u64 send_rate;	/* bytes/s while writing */
+	__u64 extents;		/* dirty extents reported by the tracker */
+	__u64 max_extent;	/* the largest of them, bytes */
+	__u64 blocked_us;	/* the reader waited for the senders */
+	__u64 acks;		/* packets acknowledged by the receiver */
+	__u64 ack_avg_us;	/* time from a packet sent to its ack */
+	__u64 ack_max_us;
+	__u64 freeze_us;	/* ploop_copy_stop(): the device was frozen */
+};
+
 enum {
 	PLOOP_ENC_REENCRYPT	= 0x01,
 	PLOOP_ENC_WIPE		= 0x02,
@@ -314,6 +395,9 @@ int ploop_get_fs_info(const char *descr, struct ploop_fs_info *info, int size);
 int ploop_create_temporary_snapshot(struct ploop_disk_images_data *di,
 		struct ploop_tsnapshot_param *param, int *holder_fd);
 int ploop_merge_snapshot(struct ploop_disk_images_data *di, struct ploop_merge_param *param);
+int ploop_merge_estimate(struct ploop_disk_images_data *di, struct ploop_merge_param *param,
+		struct ploop_merge_estimate *est);
+void ploop_free_merge_estimate(struct ploop_merge_estimate *est);
 int ploop_switch_snapshot_ex(struct ploop_disk_images_data *di, struct ploop_snapshot_switch_param *param);
 int ploop_switch_snapshot(struct ploop_disk_images_data *di, const char *uuid, int flags);
 int ploop_delete_snapshot(struct ploop_disk_images_data *di, const char *guid);
@@ -338,6 +422,8 @@ int ploop_set_log_file(const char *fname);
 void ploop_set_log_level(int level);
 /* set console logging level */
 void ploop_set_verbose_level(int level);
+/* limit I/O rate of merge, copy and convert; 0 - only while latency is high */
+int ploop_set_io_limit(unsigned long long bps, unsigned int iops);
 
 /* Cancelation API */
 void ploop_cancel_operation(void);
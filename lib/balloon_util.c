@@ -509,49 +509,41 @@ int range_build_rmap(__u32 iblk_start, __u32 iblk_end,
 		return SYSEXIT_ABORT;
 	}
 
+	if (delta->l2_size + PLOOP_MAP_OFFSET >
+			(__u64)delta->l1_size * (cluster / sizeof(__u32))) {
+		ploop_err(0, "range_build_rmap: l2_cluster >= delta->l1_size");
+		return SYSEXIT_ABORT;
+	}
+
 	memset(rmap, 0xff, rlen * sizeof(__u32));
 	delta->l2_cache = -1;
 
 	for (clu = 0; clu < delta->l2_size; clu++) {
-		int   l2_cluster;
-		__u32 l2_slot;
+		__u32 iblk;
 		__u32 ridx;
 
-		l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
-		l2_slot	   = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
-
-		if (l2_cluster >= delta->l1_size) {
-			ploop_err(0, "range_build_rmap: l2_cluster >= delta->l1_size");
-			return SYSEXIT_ABORT;
-		}
-
+		if (get_idx_entry(delta, clu, &iblk))
+			return SYSEXIT_READ;
 
-		if (delta->l2_cache != l2_cluster) {
-			if (PREAD(delta, delta->l2, cluster,
-			      (off_t)l2_cluster * cluster))
-				return SYSEXIT_READ;
-			delta->l2_cache = l2_cluster;
-		}
-		ridx = delta->l2[l2_slot] / ploop_sec_to_ioff(delta->blocksize,
+		ridx = iblk / ploop_sec_to_ioff(delta->blocksize,
 				delta->blocksize, delta->version);
 		if (ridx >= rlen) {
 			ploop_err(0,
 				"Image corrupted: L2[%u] == %u (max=%" PRIu64 ") (2)",
-				clu, delta->l2[l2_slot],
+				clu, iblk,
 				(uint64_t)((rlen - 1) * B2S(cluster)));
 			return SYSEXIT_PLOOPFMT;
 		}
 		if (ridx && ridx < delta->l1_size) {
 			ploop_err(0,
 				"Image corrupted: L2[%u] == %u (min=%" PRIu64 ") (2)",
-				clu, delta->l2[l2_slot],
+				clu, iblk,
 				(uint64_t)(delta->l1_size * B2S(cluster)));
 			return SYSEXIT_PLOOPFMT;
 		}
 
 		if (iblk_start <= ridx && ridx < iblk_end) {
-			rmap[ridx] = l2_cluster * (cluster / sizeof(__u32)) +
-				     l2_slot - PLOOP_MAP_OFFSET;
+			rmap[ridx] = clu;
 			n_found++;
 			if (n_found >= n_requested)
 				break;
@@ -1573,7 +1573,7 @@ void ploop_release_bitmap(struct ploop_bitmap *bmap)
 struct ploop_bitmap *ploop_get_used_bitmap_from_image(
 		struct ploop_disk_images_data *di, const char *guid)
 {
-	__u32 n, clu, cluster, pid = 0;
+	__u32 clu, iblk, cluster, pid = 0;
 	char *img;
 	struct delta d = {};
 	struct ploop_bitmap *bmap = NULL;
@@ -1588,7 +1588,7 @@ struct ploop_bitmap *ploop_get_used_bitmap_from_image(
 		return NULL;
 	}
 
-	if (open_delta(&d, img, O_RDONLY, OD_ALLOW_DIRTY))
+	if (open_delta(&d, img, O_RDONLY, OD_ALLOW_DIRTY | OD_LOAD_BAT))
 		return NULL;
 
 	cluster = d.blocksize;
@@ -1596,22 +1596,11 @@ struct ploop_bitmap *ploop_get_used_bitmap_from_image(
 	if (bmap == NULL)
 		goto err;
 
-	n = cluster / sizeof(__u32);
-
 	__u64 clu_per_block = S2B(bmap->cluster_sec) * 8;
 
-	for (clu = 0; clu < d.l1_size * n - PLOOP_MAP_OFFSET && clu < d.l2_size; clu++) {
-		__u32 l2_cluster = (clu + PLOOP_MAP_OFFSET) / n;
-		__u32 l2_slot = (clu + PLOOP_MAP_OFFSET) % n;
-
-		if (d.l2_cache != l2_cluster) {
-			if (read_safe(d.fd, d.l2, cluster,
-						(off_t)l2_cluster * cluster, "read")) {
-				goto err;
-			}
-
-			d.l2_cache = l2_cluster;
-		}
+	for (clu = 0; clu < d.l2_size; clu++) {
+		if (get_idx_entry(&d, clu, &iblk))
+			goto err;
 
 		if (!((__u64)clu % clu_per_block)) {
 			block = calloc(1, clu_per_block / 8);
@@ -1625,10 +1614,10 @@ struct ploop_bitmap *ploop_get_used_bitmap_from_image(
 			block = NULL;
 		}
 
-		if (d.l2[l2_slot] == 0)
+		if (iblk == 0)
 			continue;
 
-		__u32 x = clu % clu_per_block; 
+		__u32 x = clu % clu_per_block;
 		BMAP_SET((void *)bmap->map[pid], x);
 	}
 
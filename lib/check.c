@@ -417,6 +417,13 @@ int ploop_check(const char *img, int flags, __u32 *blocksize_p, int *cbt_allowed
 	int version;
 	int disk_in_use;
 
+	/* finish index updates of an interrupted merge */
+	if (!(flags & CHECK_RAW)) {
+		ret = merge_journal_replay(img, ro);
+		if (ret)
+			return ret;
+	}
+
 	fd = open(img, O_RDONLY);
 	if (fd < 0) {
 		ploop_err(errno, "ploop_check: can't open %s", img);
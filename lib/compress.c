@@ -0,0 +1,429 @@
+/*
+ *  Copyright (c) 2008-2017 Parallels International GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Block compression for ploop copy.
+ *
+ * A block is split into chunks which are compressed in parallel by a
+ * pool of threads. The result is a self-describing compressed block:
+ * a header, the compressed length of every chunk and the chunk data.
+ * A chunk that does not compress is stored as is. If the block as a
+ * whole does not compress well, the caller sends it uncompressed; after
+ * a number of such blocks in a row the pool stops trying for a while,
+ * so incompressible data costs next to no CPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "ploop.h"
+
+#define ZBLOCK_MAGIC		0x5a4c4243
+#define ZCHUNK_SIZE		(64 * 1024)
+#define ZCHUNK_STORED		0x80000000
+#define ZPOOL_MAX_THREADS	8
+/* Block is sent compressed if it takes less than 7/8 of its size */
+#define ZBLOCK_MIN_GAIN		8
+/* Stop trying after that many incompressible blocks in a row... */
+#define ZPOOL_MAX_MISSES	8
+/* ...for that many blocks */
+#define ZPOOL_SKIP_BLOCKS	64
+
+struct zblock_hdr {
+	__u32 magic;
+	__u32 codec;
+	__u32 len;		/* uncompressed length */
+	__u32 chunk;		/* uncompressed chunk size */
+	__u32 nchunks;
+	__u32 reserved;
+	/* __u32 clen[nchunks], then chunks data */
+};
+
+struct codec {
+	int id;
+	const char *name;
+	int def_level;
+	__u32 (*bound)(__u32 len);
+	int (*compress)(const void *src, __u32 len, void *dst, __u32 *dlen,
+			int level);
+	int (*decompress)(const void *src, __u32 len, void *dst, __u32 dlen);
+};
+
+static __u32 zlib_bound(__u32 len)
+{
+	return compressBound(len);
+}
+
+static int zlib_compress(const void *src, __u32 len, void *dst, __u32 *dlen,
+		int level)
+{
+	uLongf n = *dlen;
+
+	if (compress2(dst, &n, src, len, level) != Z_OK)
+		return -1;
+	*dlen = n;
+
+	return 0;
+}
+
+static int zlib_decompress(const void *src, __u32 len, void *dst, __u32 dlen)
+{
+	uLongf n = dlen;
+
+	if (uncompress(dst, &n, src, len) != Z_OK || n != dlen)
+		return -1;
+
+	return 0;
+}
+
+static const struct codec codecs[] = {
+	{
+		.id = PLOOP_COPY_COMPRESS_ZLIB,
+		.name = "zlib",
+		.def_level = 1,
+		.bound = zlib_bound,
+		.compress = zlib_compress,
+		.decompress = zlib_decompress,
+	},
+};
+
+static const struct codec *get_codec(int id)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+		if (codecs[i].id == id)
+			return &codecs[i];
+
+	return NULL;
+}
+
+int codec_supported(int id)
+{
+	return get_codec(id) != NULL;
+}
+
+struct zpool {
+	const struct codec *c;
+	int level;
+	__u32 maxlen;
+	__u32 slot;		/* per chunk output space */
+	void *chunks;		/* compressed chunks */
+	__u32 *clen;
+	void *out;		/* compressed block */
+	pthread_t *threads;
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	const void *src;	/* the block being compressed */
+	__u32 len;
+	__u32 nchunks;
+	__u32 next;		/* next chunk to take */
+	__u32 done;
+	int err;
+	int stop;
+	int misses;
+	int skip;
+	__u64 in_bytes;
+	__u64 out_bytes;
+};
+
+static void compress_chunk(struct zpool *p, __u32 i)
+{
+	const void *src = p->src + (__u64)i * ZCHUNK_SIZE;
+	void *dst = p->chunks + (__u64)i * p->slot;
+	__u32 len, dlen = p->slot;
+
+	len = p->len - i * ZCHUNK_SIZE;
+	if (len > ZCHUNK_SIZE)
+		len = ZCHUNK_SIZE;
+
+	if (p->c->compress(src, len, dst, &dlen, p->level) || dlen >= len) {
+		memcpy(dst, src, len);
+		dlen = len | ZCHUNK_STORED;
+	}
+	p->clen[i] = dlen;
+}
+
+static void *zpool_worker(void *data)
+{
+	struct zpool *p = data;
+	__u32 i;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->next >= p->nchunks && !p->stop)
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (p->stop)
+			break;
+
+		i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+
+		compress_chunk(p, i);
+
+		pthread_mutex_lock(&p->lock);
+		if (++p->done == p->nchunks)
+			pthread_cond_signal(&p->done_cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+/*
+ * codec: PLOOP_COPY_COMPRESS_*
+ * level: compression level, 0 means the codec default
+ * maxlen: max size of a block
+ * nthreads: max number of threads, 0 means one per CPU
+ */
+struct zpool *zpool_create(int codec, int level, __u32 maxlen,
+		int nthreads)
+{
+	struct zpool *p;
+	__u32 n;
+	long cpus;
+	int i, ret;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		ploop_err(ENOMEM, "zpool_create");
+		return NULL;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	pthread_cond_init(&p->done_cond, NULL);
+
+	p->c = get_codec(codec);
+	if (p->c == NULL) {
+		ploop_err(0, "Unsupported compression codec %d", codec);
+		goto err;
+	}
+	p->level = level ? level : p->c->def_level;
+	p->maxlen = maxlen;
+	p->slot = p->c->bound(ZCHUNK_SIZE);
+
+	n = (maxlen + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE;
+	p->chunks = malloc((size_t)n * p->slot);
+	p->clen = malloc(n * sizeof(__u32));
+	p->out = malloc(sizeof(struct zblock_hdr) + n * sizeof(__u32) +
+			maxlen);
+	p->threads = calloc(ZPOOL_MAX_THREADS, sizeof(pthread_t));
+	if (p->chunks == NULL || p->clen == NULL || p->out == NULL ||
+			p->threads == NULL) {
+		ploop_err(ENOMEM, "zpool_create");
+		goto err;
+	}
+
+	cpus = nthreads ? nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > ZPOOL_MAX_THREADS)
+		cpus = ZPOOL_MAX_THREADS;
+	if (cpus > n)
+		cpus = n;
+	for (i = 0; i < cpus; i++) {
+		ret = pthread_create(&p->threads[i], NULL, zpool_worker, p);
+		if (ret) {
+			ploop_err(ret, "Can't create compression thread");
+			goto err;
+		}
+		p->nthreads++;
+	}
+
+	ploop_log(1, "Compression %s level %d, %d threads",
+			p->c->name, p->level, p->nthreads);
+
+	return p;
+
+err:
+	zpool_destroy(p);
+	return NULL;
+}
+
+void zpool_destroy(struct zpool *p)
+{
+	int i;
+
+	if (p == NULL)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->nthreads; i++)
+		pthread_join(p->threads[i], NULL);
+
+	if (p->in_bytes)
+		ploop_log(1, "Compressed %llu bytes to %llu",
+				p->in_bytes, p->out_bytes);
+
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	pthread_cond_destroy(&p->done_cond);
+	free(p->threads);
+	free(p->chunks);
+	free(p->clen);
+	free(p->out);
+	free(p);
+}
+
+/*
+ * Compress a block of len bytes. On success *out points to the
+ * compressed block (valid till the next call) and its size is returned.
+ * Returns 0 if the block is not worth compressing.
+ */
+__u32 zpool_compress(struct zpool *p, const void *src, __u32 len,
+		void **out)
+{
+	struct zblock_hdr *hdr = p->out;
+	__u32 i, size, n;
+	void *d;
+
+	if (len == 0 || len > p->maxlen)
+		return 0;
+
+	if (p->skip) {
+		p->skip--;
+		return 0;
+	}
+
+	n = (len + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE;
+
+	pthread_mutex_lock(&p->lock);
+	p->src = src;
+	p->len = len;
+	p->next = p->done = 0;
+	p->nchunks = n;
+	pthread_cond_broadcast(&p->cond);
+	while (p->done < n)
+		pthread_cond_wait(&p->done_cond, &p->lock);
+	p->nchunks = 0;
+	pthread_mutex_unlock(&p->lock);
+
+	size = sizeof(*hdr) + n * sizeof(__u32);
+	for (i = 0; i < n; i++)
+		size += p->clen[i] & ~ZCHUNK_STORED;
+
+	if (size > len - len / ZBLOCK_MIN_GAIN) {
+		if (++p->misses >= ZPOOL_MAX_MISSES) {
+			ploop_log(3, "Data does not compress, skip %d blocks",
+					ZPOOL_SKIP_BLOCKS);
+			p->skip = ZPOOL_SKIP_BLOCKS;
+			p->misses = 0;
+		}
+		return 0;
+	}
+	p->misses = 0;
+
+	hdr->magic = ZBLOCK_MAGIC;
+	hdr->codec = p->c->id;
+	hdr->len = len;
+	hdr->chunk = ZCHUNK_SIZE;
+	hdr->nchunks = n;
+	hdr->reserved = 0;
+	memcpy(hdr + 1, p->clen, n * sizeof(__u32));
+
+	d = (void *)(hdr + 1) + n * sizeof(__u32);
+	for (i = 0; i < n; i++) {
+		__u32 clen = p->clen[i] & ~ZCHUNK_STORED;
+
+		memcpy(d, p->chunks + (__u64)i * p->slot, clen);
+		d += clen;
+	}
+
+	p->in_bytes += len;
+	p->out_bytes += size;
+	*out = p->out;
+
+	return size;
+}
+
+/* Get the uncompressed size of a compressed block, 0 if it is invalid */
+__u32 zblock_get_size(const void *src, __u32 len)
+{
+	const struct zblock_hdr *hdr = src;
+
+	if (len < sizeof(*hdr) || hdr->magic != ZBLOCK_MAGIC)
+		return 0;
+
+	return hdr->len;
+}
+
+/* Decompress a block into dst of dlen bytes */
+int zblock_decompress(const void *src, __u32 len, void *dst, __u32 dlen)
+{
+	const struct zblock_hdr *hdr = src;
+	const struct codec *c;
+	const __u32 *clen;
+	const void *s, *end = src + len;
+	__u32 i, n, size;
+
+	if (zblock_get_size(src, len) != dlen || hdr->chunk == 0) {
+		ploop_err(0, "Invalid compressed block");
+		return SYSEXIT_PROTOCOL;
+	}
+
+	c = get_codec(hdr->codec);
+	if (c == NULL) {
+		ploop_err(0, "Unsupported compression codec %d", hdr->codec);
+		return SYSEXIT_PROTOCOL;
+	}
+
+	n = hdr->nchunks;
+	clen = (const __u32 *)(hdr + 1);
+	s = clen + n;
+	if (s > end || n != (dlen + hdr->chunk - 1) / hdr->chunk) {
+		ploop_err(0, "Invalid compressed block");
+		return SYSEXIT_PROTOCOL;
+	}
+
+	for (i = 0; i < n; i++, dst += size) {
+		__u32 l = clen[i] & ~ZCHUNK_STORED;
+
+		size = dlen - i * hdr->chunk;
+		if (size > hdr->chunk)
+			size = hdr->chunk;
+
+		if (s + l > end) {
+			ploop_err(0, "Invalid compressed block");
+			return SYSEXIT_PROTOCOL;
+		}
+
+		if (clen[i] & ZCHUNK_STORED) {
+			if (l != size) {
+				ploop_err(0, "Invalid compressed block");
+				return SYSEXIT_PROTOCOL;
+			}
+			memcpy(dst, s, l);
+		} else if (c->decompress(s, l, dst, size)) {
+			ploop_err(0, "Can't decompress %s data", c->name);
+			return SYSEXIT_PROTOCOL;
+		}
+		s += l;
+	}
+
+	return 0;
+}
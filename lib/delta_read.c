@@ -25,9 +25,15 @@
 #include <malloc.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/param.h>
 
 #include "ploop.h"
 
+/* The whole index table is read/written in chunks of up to this size */
+#define IDX_IO_CHUNK	(16 << 20)
+/* Number of blocks grow_delta() relocates between two fsyncs */
+#define RELOC_BATCH	256
+
 void init_delta_array(struct delta_array * p)
 {
 	p->delta_max = 0;
@@ -74,6 +80,8 @@ void close_delta(struct delta *delta)
 	delta->hdr0 = NULL;
 	free(delta->l2);
 	delta->l2 = NULL;
+	free(delta->bat);
+	delta->bat = NULL;
 	if (delta->fd != -1)
 		close(delta->fd);
 	delta->fd = -1;
@@ -84,6 +92,7 @@ int open_delta_simple(struct delta * delta, const char * path, int rw, int od_fl
 {
 	delta->hdr0 = NULL;
 	delta->l2 = NULL;
+	delta->bat = NULL;
 
 	ploop_log(0, "Opening delta %s", path);
 	delta->fd = open(path, rw, 0600);
@@ -169,6 +178,17 @@ int open_delta(struct delta * delta, const char * path, int rw, int od_flags)
 		goto error;
 	}
 
+	if (od_flags & OD_LOAD_BAT) {
+		rc = load_idx_table(delta);
+		if (rc == SYSEXIT_MALLOC) {
+			ploop_log(0, "Not enough memory to load index table"
+					" of %s, falling back to L2 cache", path);
+		} else if (rc) {
+			err = EIO;
+			goto error;
+		}
+	}
+
 	return 0;
 
 error:
@@ -177,6 +197,165 @@ error:
 	return -1;
 }
 
+static __u32 idx_io_chunk(struct delta *delta)
+{
+	__u32 cluster = S2B(delta->blocksize);
+
+	return MAX(IDX_IO_CHUNK / cluster, 1) * cluster;
+}
+
+/*
+ * Read the whole index table into delta->bat using a few large
+ * sequential reads. Walkers then look up any cluster without touching
+ * the disk, instead of reloading delta->l2 each time they cross an
+ * L2 cluster boundary or switch between deltas.
+ */
+int load_idx_table(struct delta *delta)
+{
+	__u64 size = (__u64)delta->l1_size * S2B(delta->blocksize);
+	__u64 chunk = idx_io_chunk(delta);
+	__u64 off;
+	void *p;
+
+	if (p_memalign(&p, 4096, size))
+		return SYSEXIT_MALLOC;
+
+	for (off = 0; off < size; off += chunk) {
+		if (PREAD(delta, (__u8 *)p + off, MIN(chunk, size - off), off)) {
+			free(p);
+			return SYSEXIT_READ;
+		}
+	}
+
+	free(delta->bat);
+	delta->bat = p;
+	delta->bat_dirty_start = delta->l1_size;
+	delta->bat_dirty_end = 0;
+
+	return 0;
+}
+
+/*
+ * Get index entry for the logical cluster clu. Works either from
+ * the in-memory index table (OD_LOAD_BAT) or via delta->l2 cache.
+ * Clusters beyond the index table are reported as not allocated.
+ */
+int get_idx_entry(struct delta *delta, __u32 clu, __u32 *iblk)
+{
+	__u64 cluster = S2B(delta->blocksize);
+	__u32 n = cluster / sizeof(__u32);
+	__u32 l2_cluster = ((__u64)clu + PLOOP_MAP_OFFSET) / n;
+	__u32 l2_slot = ((__u64)clu + PLOOP_MAP_OFFSET) % n;
+	int ret;
+
+	if (l2_cluster >= delta->l1_size) {
+		*iblk = 0;
+		return 0;
+	}
+
+	if (delta->bat) {
+		*iblk = delta->bat[(__u64)clu + PLOOP_MAP_OFFSET];
+		return 0;
+	}
+
+	if (delta->l2_cache != l2_cluster) {
+		if (delta->l2_dirty && (ret = write_idx_table(delta)))
+			return ret;
+
+		if (PREAD(delta, delta->l2, cluster, (off_t)l2_cluster * cluster))
+			return SYSEXIT_READ;
+		delta->l2_cache = l2_cluster;
+	}
+	*iblk = delta->l2[l2_slot];
+
+	return 0;
+}
+
+/*
+ * Update index entry for the logical cluster clu in memory.
+ * The change reaches the disk on write_idx_table().
+ */
+int set_idx_entry(struct delta *delta, __u32 clu, __u32 iblk)
+{
+	__u32 n = S2B(delta->blocksize) / sizeof(__u32);
+	__u32 l2_cluster = ((__u64)clu + PLOOP_MAP_OFFSET) / n;
+	__u32 tmp;
+	int ret;
+
+	if (l2_cluster >= delta->l1_size) {
+		ploop_err(0, "abort: set_idx_entry l2_cluster >= delta->l1_size");
+		return SYSEXIT_ABORT;
+	}
+
+	if (delta->bat) {
+		delta->bat[(__u64)clu + PLOOP_MAP_OFFSET] = iblk;
+		delta->bat_dirty_start = MIN(delta->bat_dirty_start, l2_cluster);
+		delta->bat_dirty_end = MAX(delta->bat_dirty_end, l2_cluster + 1);
+		return 0;
+	}
+
+	/* load proper L2 cluster to the cache */
+	ret = get_idx_entry(delta, clu, &tmp);
+	if (ret)
+		return ret;
+
+	delta->l2[((__u64)clu + PLOOP_MAP_OFFSET) % n] = iblk;
+	delta->l2_dirty = 1;
+
+	return 0;
+}
+
+/*
+ * Write out index clusters modified by set_idx_entry() with a single
+ * pass. The image header shares the first cluster with the index, so
+ * it is re-read before writing to not overwrite on-disk header changes.
+ */
+int write_idx_table(struct delta *delta)
+{
+	__u64 cluster = S2B(delta->blocksize);
+	__u64 chunk = idx_io_chunk(delta);
+	__u8 *buf;
+	__u64 off, end;
+
+	if (!delta->bat) {
+		if (!delta->l2_dirty)
+			return 0;
+		if (delta->l2_cache < 0 || delta->l2_cache >= delta->l1_size) {
+			ploop_err(0, "abort: write_idx_table bad l2_cache %d",
+					delta->l2_cache);
+			return SYSEXIT_ABORT;
+		}
+		if (delta->l2_cache == 0 && PREAD(delta, delta->l2,
+					sizeof(struct ploop_pvd_header), 0))
+			return SYSEXIT_READ;
+		if (PWRITE(delta, delta->l2, cluster,
+					(off_t)delta->l2_cache * cluster))
+			return SYSEXIT_WRITE;
+		delta->l2_dirty = 0;
+		return 0;
+	}
+
+	if (delta->bat_dirty_start >= delta->bat_dirty_end)
+		return 0;
+	buf = (__u8 *)delta->bat;
+	off = (__u64)delta->bat_dirty_start * cluster;
+	end = (__u64)delta->bat_dirty_end * cluster;
+
+	if (off == 0 && PREAD(delta, buf, sizeof(struct ploop_pvd_header), 0))
+		return SYSEXIT_READ;
+
+	for (; off < end; off += chunk) {
+		if (PWRITE(delta, buf + off, MIN(chunk, end - off), off))
+			return SYSEXIT_WRITE;
+	}
+
+	delta->bat_dirty_start = delta->l1_size;
+	delta->bat_dirty_end = 0;
+	delta->l2_dirty = 0;
+
+	return 0;
+}
+
 int change_delta_version(struct delta *delta, int version)
 {
 	if (PWRITE(delta, ploop1_signature(version),
@@ -296,88 +475,85 @@ int read_size_from_image(const char *img_name, int raw, off_t * res)
 
 /*
  * delta: output delta
- * iblk: iblock number of block to relocate
+ * rmap: reverse map built by range_build_rmap() for [start, end)
  * buf: a buffer of S2B(blocksize) bytes
  * map: if not NULL, will be filled with <req_cluster, iblk> of
- *	relocated block
+ *	relocated blocks
+ * n: number of blocks put to map
+ *
+ * Copies every block of [start, end) referenced by the index to the
+ * end of image, syncs the copies once and then points the index
+ * entries to them.
  *
- * Returns 0 if requested block not found in L2 table, otherwise 1.
- *	   -1 on error
+ * Returns 0 on success, -1 on error
  */
-static int relocate_block(struct delta *delta, __u32 iblk, void *buf,
-			  struct reloc_map *map)
+static int relocate_blocks(struct delta *delta, __u32 *rmap,
+		__u32 start, __u32 end, void *buf,
+		struct reloc_map *map, int *n)
 {
-	int   l2_cluster = 0;
-	__u32 l2_slot = 0;
-	__u32 clu = 0;
+	__u32 iblk, idx;
 	__u64 cluster = S2B(delta->blocksize);
+	__u32 head = delta->alloc_head;
 
 	assert(cluster);
 
-	for (clu = 0; clu < delta->l2_size; clu++) {
-		int n = cluster / sizeof(__u32);
+	*n = 0;
+	for (iblk = start; iblk < end; iblk++) {
+		if (rmap[iblk] == PLOOP_ZERO_INDEX)
+			continue;
 
-		l2_cluster = (clu + PLOOP_MAP_OFFSET) / n;
-		l2_slot	   = (clu + PLOOP_MAP_OFFSET) % n;
-
-		if (l2_cluster >= delta->l1_size) {
-			ploop_err(0, "abort: relocate_block l2_cluster >= delta->l1_size");
+		if (READ(delta, buf, cluster, (off_t)iblk * cluster)) {
+			ploop_err(errno, "Can't read block to relocate");
 			return -1;
 		}
 
-		if (delta->l2_cache != l2_cluster) {
-			if (READ(delta, delta->l2, cluster,
-				 (off_t)l2_cluster * cluster)) {
-				ploop_err(errno, "Can't read L2 table");
-				return -1;
-			}
-			delta->l2_cache = l2_cluster;
+		if (WRITE(delta, buf, cluster, (off_t)delta->alloc_head++ * cluster)) {
+			ploop_err(errno, "Can't write relocate block");
+			return -1;
 		}
-
-		if (delta->l2[l2_slot] == ploop_sec_to_ioff((off_t)iblk * delta->blocksize,
-					delta->blocksize, delta->version))
-			break;
 	}
 
-	if (clu >= delta->l2_size)
-		return 0; /* found nothing */
+	if (delta->alloc_head == head)
+		return 0;
 
-	if (READ(delta, buf, cluster, S2B(ploop_ioff_to_sec(delta->l2[l2_slot],
-						delta->blocksize, delta->version)))) {
-		ploop_err(errno, "Can't read block to relocate");
+	if (fsync(delta->fd)) {
+		ploop_err(errno, "fsync");
 		return -1;
 	}
 
-	delta->l2[l2_slot] = ploop_sec_to_ioff((off_t)delta->alloc_head++ * delta->blocksize,
-			delta->blocksize, delta->version);
-	if (delta->l2[l2_slot] == 0) {
-		ploop_err(0, "relocate_block: delta->l2[l2_slot] == 0");
-		return -1;
-	}
+	for (iblk = start; iblk < end; iblk++) {
+		__u32 clu = rmap[iblk];
 
-	if (WRITE(delta, buf, cluster, S2B(ploop_ioff_to_sec(delta->l2[l2_slot],
-						delta->blocksize, delta->version)))) {
-		ploop_err(errno, "Can't write relocate block");
-		return -1;
-	}
+		if (clu == PLOOP_ZERO_INDEX)
+			continue;
 
-	if (fsync(delta->fd)) {
-		ploop_err(errno, "fsync");
-		return -1;
-	}
+		idx = ploop_sec_to_ioff((off_t)head * delta->blocksize,
+				delta->blocksize, delta->version);
+		if (idx == 0) {
+			ploop_err(0, "relocate_blocks: new index entry is 0");
+			return -1;
+		}
 
-	if (WRITE(delta, &delta->l2[l2_slot], sizeof(__u32),
-		  (off_t)l2_cluster * cluster + l2_slot * sizeof(__u32))) {
-		ploop_err(errno, "Can't update L2 table");
-		return -1;
-	}
+		if (set_idx_entry(delta, clu, idx))
+			return -1;
+
+		/* the old block is reused right after, so update the entry now */
+		if (WRITE(delta, &idx, sizeof(__u32),
+			  ((off_t)clu + PLOOP_MAP_OFFSET) * sizeof(__u32))) {
+			ploop_err(errno, "Can't update L2 table");
+			return -1;
+		}
 
-	if (map) {
-		map->req_cluster = l2_slot - PLOOP_MAP_OFFSET;
-		map->iblk = delta->alloc_head - 1;
+		if (map) {
+			map[*n].req_cluster = clu;
+			map[*n].iblk = head;
+		}
+		head++;
+		(*n)++;
 	}
+	delta->l2_dirty = 0;
 
-	return 1;
+	return 0;
 }
 
 /*
@@ -396,6 +572,8 @@ int grow_delta(struct delta *odelta, off_t bdsize, void *buf,
 	int i_l1_size_sync_alloc = 0;
 	off_t i_l2_size;
 	int map_idx = 0;
+	int reloc_end;
+	__u32 *rmap = NULL;
 	__u64 cluster = S2B(odelta->blocksize);
 
 	assert(cluster);
@@ -445,30 +623,56 @@ int grow_delta(struct delta *odelta, off_t bdsize, void *buf,
 		}
 	}
 
-	for (i = odelta->l1_size; i < i_l1_size - i_l1_size_sync_alloc; i++) {
-		rc = relocate_block(odelta, i, buf,
-				    gm ? &gm->ctl->rmap[map_idx] : NULL);
-		if (rc == -1)
-			return SYSEXIT_RELOC;
+	reloc_end = i_l1_size - i_l1_size_sync_alloc;
+	if (odelta->l1_size < reloc_end) {
+		rmap = alloc_reverse_map(odelta->alloc_head);
+		if (rmap == NULL)
+			return SYSEXIT_MALLOC;
 
-		if (rc && gm) {
-			gm->zblks[map_idx] = i;
-			map_idx++;
-		} else {
-			memset(buf, 0, cluster);
+		rc = range_build_rmap(odelta->l1_size, reloc_end, rmap,
+				odelta->alloc_head, odelta, NULL);
+		if (rc)
+			goto err;
+	}
 
-			if (fsync(odelta->fd)) {
-				ploop_err(errno, "fsync");
-				return SYSEXIT_FSYNC;
-			}
+	for (i = odelta->l1_size; i < reloc_end; i += RELOC_BATCH) {
+		int end = MIN(i + RELOC_BATCH, reloc_end);
+		int j, n;
+
+		if (relocate_blocks(odelta, rmap, i, end, buf,
+				    gm ? &gm->ctl->rmap[map_idx] : NULL, &n)) {
+			rc = SYSEXIT_RELOC;
+			goto err;
+		}
+
+		if (gm) {
+			for (j = i; j < end; j++)
+				if (rmap[j] != PLOOP_ZERO_INDEX)
+					gm->zblks[map_idx++] = j;
+		}
+
+		if (fsync(odelta->fd)) {
+			ploop_err(errno, "fsync");
+			rc = SYSEXIT_FSYNC;
+			goto err;
+		}
+
+		/* Blocks relocated online are nullified by the caller */
+		memset(buf, 0, cluster);
+		for (j = i; j < end; j++) {
+			if (gm && rmap[j] != PLOOP_ZERO_INDEX)
+				continue;
 
 			if (WRITE(odelta, buf, cluster,
-				  (off_t)i * cluster)) {
+				  (off_t)j * cluster)) {
 				ploop_err(errno, "Can't nullify L2 table");
-				return SYSEXIT_WRITE;
+				rc = SYSEXIT_WRITE;
+				goto err;
 			}
 		}
 	}
+	free(rmap);
+	rmap = NULL;
 
 	/* all requested blocks are relocated; time to update header */
 	if (!gm) {
@@ -495,10 +699,28 @@ int grow_delta(struct delta *odelta, off_t bdsize, void *buf,
 		gm->ctl->n_maps = map_idx;
 	}
 
+	if (odelta->bat) {
+		void *p;
+
+		if (p_memalign(&p, 4096, (__u64)i_l1_size * cluster))
+			return SYSEXIT_MALLOC;
+		memcpy(p, odelta->bat, (__u64)odelta->l1_size * cluster);
+		memset((__u8 *)p + (__u64)odelta->l1_size * cluster, 0,
+				(__u64)(i_l1_size - odelta->l1_size) * cluster);
+		free(odelta->bat);
+		odelta->bat = p;
+		odelta->bat_dirty_start = i_l1_size;
+		odelta->bat_dirty_end = 0;
+	}
+
 	odelta->l1_size = i_l1_size;
 	odelta->l2_size = i_l2_size;
 
 	return 0;
+
+err:
+	free(rmap);
+	return rc;
 }
 
 int grow_raw_delta(const char *image, off_t append_size, int sparse)
@@ -508,6 +730,8 @@ int grow_raw_delta(const char *image, off_t append_size, int sparse)
 	off_t pos;
 	int ret;
 	void *buf;
+	struct io_throttle *throttle = io_throttle_get(0, 0);
+	double start;
 	unsigned long i = 0;
 
 	if (p_memalign(&buf, 4096, DEF_CLUSTER))
@@ -540,13 +764,16 @@ int grow_raw_delta(const char *image, off_t append_size, int sparse)
 	while (append_size > 0) {
 		size_t size = (append_size > DEF_CLUSTER) ? DEF_CLUSTER : append_size;
 
+		start = io_throttle_wait(throttle, size, 1);
 		if (PWRITE(&delta, buf, size, pos))
 			goto err;
+		io_throttle_done(throttle, start, size);
 
 		append_size -= size;
 		pos         += size;
 
-		if ((++i & 0xffUL) == 0)
+		/* let the device breathe if no limit is set */
+		if (io_throttle_bps(throttle) == 0 && (++i & 0xffUL) == 0)
 			usleep(1000);
 	}
 
@@ -602,7 +829,8 @@ int ploop_grow_delta_offline(const char *image, off_t new_size)
 	void *buf = NULL;
 	int ret = 0;
 
-	if (open_delta(&delta, image, new_size ? O_RDWR : O_RDONLY, OD_OFFLINE))
+	if (open_delta(&delta, image, new_size ? O_RDWR : O_RDONLY,
+				OD_OFFLINE | OD_LOAD_BAT))
 		return SYSEXIT_OPEN;
 
 	vh = (struct ploop_pvd_header *)delta.hdr0;
@@ -0,0 +1,370 @@
+/*
+ *  Copyright (c) 2008-2017 Parallels International GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Queue of delta-to-delta block copies served by a pool of threads.
+ * It keeps up to 'depth' copies in flight, so reads from the source
+ * overlap with writes to the destination. Callers have to drain the
+ * queue before making the copied data reachable (i.e. before writing
+ * index entries pointing to it).
+ *
+ * If the source and the destination share a filesystem, blocks are
+ * cloned (FICLONERANGE) or copied in kernel (copy_file_range) instead
+ * of being bounced through the buffers; this is detected on the first
+ * copy, and buffered copy is used if neither is supported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "ploop.h"
+
+#ifndef FICLONERANGE
+struct file_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
+struct io_job {
+	struct delta *src;
+	off_t src_pos;
+	struct delta *dst;
+	off_t dst_pos;
+	__u32 len;
+};
+
+struct io_worker {
+	struct io_queue *q;
+	pthread_t thread;
+	void *buf;
+};
+
+struct io_queue {
+	int depth;
+	__u32 bufsize;
+	void *buf;		/* used if there are no threads, and by the probe */
+	struct io_worker *workers;
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct io_job *jobs;	/* ring of 'depth' jobs */
+	int head;
+	int count;		/* queued jobs */
+	int inflight;		/* queued + being processed */
+	int err;
+	int stop;
+	int zcopy;		/* ZCOPY_*, only set by the first copy */
+	struct io_throttle *throttle;
+};
+
+/* errno values meaning the method is not usable for these files */
+static int zcopy_unsupported(int err)
+{
+	return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV ||
+		err == EINVAL || err == ENOSYS || err == EBADF ||
+		err == ETXTBSY || err == EPERM;
+}
+
+/*
+ * Copy len bytes from sfd at spos to dfd at dpos without moving data
+ * through user space. *mode is ZCOPY_PROBE on first call and is updated
+ * with the method that works, or ZCOPY_NONE.
+ *
+ * Returns 0 on success, -1 if the caller has to copy the range itself,
+ * or SYSEXIT_* on I/O error.
+ */
+int copy_range(int sfd, off_t spos, int dfd, off_t dpos, off_t len,
+		int *mode)
+{
+	int m = *mode;
+
+	if (m == ZCOPY_PROBE || m == ZCOPY_CLONE) {
+		struct file_clone_range r = {
+			.src_fd = sfd,
+			.src_offset = spos,
+			.src_length = len,
+			.dest_offset = dpos,
+		};
+
+		if (ioctl(dfd, FICLONERANGE, &r) == 0) {
+			if (m == ZCOPY_PROBE)
+				ploop_log(1, "Using reflink to copy data");
+			*mode = ZCOPY_CLONE;
+			return 0;
+		}
+		if (!zcopy_unsupported(errno)) {
+			ploop_err(errno, "FICLONERANGE");
+			return SYSEXIT_WRITE;
+		}
+		m = ZCOPY_CFR;
+	}
+
+	if (m == ZCOPY_CFR) {
+		loff_t in = spos, out = dpos;
+		ssize_t n;
+
+		while (len > 0) {
+			n = sys_copy_file_range(sfd, &in, dfd, &out, len, 0);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1 && !zcopy_unsupported(errno)) {
+				ploop_err(errno, "copy_file_range");
+				return SYSEXIT_WRITE;
+			}
+			/* unsupported, or short source */
+			if (n <= 0)
+				break;
+			len -= n;
+		}
+		if (len == 0) {
+			if (*mode == ZCOPY_PROBE)
+				ploop_log(1, "Using copy_file_range to copy data");
+			*mode = ZCOPY_CFR;
+			return 0;
+		}
+		/* a partially copied range is copied again by the caller */
+	}
+
+	*mode = ZCOPY_NONE;
+
+	return -1;
+}
+
+static int copy_job(struct io_queue *q, struct io_job *job, void *buf)
+{
+	int mode = q->zcopy;
+
+	if (mode != ZCOPY_NONE) {
+		int ret = copy_range(job->src->fd, job->src_pos,
+				job->dst->fd, job->dst_pos, job->len, &mode);
+		/* a later failure falls back for this copy only */
+		if (q->zcopy == ZCOPY_PROBE)
+			q->zcopy = mode;
+		if (ret != -1)
+			return ret;
+	}
+
+	if (PREAD(job->src, buf, job->len, job->src_pos))
+		return SYSEXIT_READ;
+
+	if (PWRITE(job->dst, buf, job->len, job->dst_pos))
+		return SYSEXIT_WRITE;
+
+	return 0;
+}
+
+static int do_io_job(struct io_queue *q, struct io_job *job, void *buf)
+{
+	double start;
+	int ret;
+
+	start = io_throttle_wait(q->throttle, job->len, 2);
+	ret = copy_job(q, job, buf);
+	io_throttle_done(q->throttle, start, job->len);
+
+	return ret;
+}
+
+static void *io_queue_worker(void *data)
+{
+	struct io_worker *w = data;
+	struct io_queue *q = w->q;
+	struct io_job job;
+	int ret;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (q->count == 0 && !q->stop)
+			pthread_cond_wait(&q->cond, &q->lock);
+		if (q->count == 0)
+			break;
+
+		job = q->jobs[q->head];
+		q->head = (q->head + 1) % q->depth;
+		q->count--;
+		pthread_mutex_unlock(&q->lock);
+
+		/* do not waste time on the rest of jobs after an error */
+		ret = q->err ? 0 : do_io_job(q, &job, w->buf);
+
+		pthread_mutex_lock(&q->lock);
+		if (ret && !q->err)
+			q->err = ret;
+		q->inflight--;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+/*
+ * depth: max number of copies in flight, 1 means synchronous copy
+ * bufsize: max size of a single copy
+ * throttle: I/O limits shared by all copies, may be NULL
+ */
+struct io_queue *io_queue_create(int depth, __u32 bufsize,
+		struct io_throttle *throttle)
+{
+	struct io_queue *q;
+	int i;
+
+	q = calloc(1, sizeof(*q));
+	if (q == NULL) {
+		ploop_err(ENOMEM, "io_queue_create");
+		return NULL;
+	}
+
+	q->depth = depth > 0 ? depth : 1;
+	q->bufsize = bufsize;
+	q->throttle = throttle;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	if (p_memalign(&q->buf, 4096, bufsize))
+		goto err;
+	if (q->depth == 1)
+		return q;
+
+	q->jobs = calloc(q->depth, sizeof(struct io_job));
+	q->workers = calloc(q->depth, sizeof(struct io_worker));
+	if (q->jobs == NULL || q->workers == NULL) {
+		ploop_err(ENOMEM, "io_queue_create");
+		goto err;
+	}
+
+	for (i = 0; i < q->depth; i++) {
+		struct io_worker *w = &q->workers[i];
+		int ret;
+
+		w->q = q;
+		if (p_memalign(&w->buf, 4096, bufsize))
+			goto err;
+
+		ret = pthread_create(&w->thread, NULL, io_queue_worker, w);
+		if (ret) {
+			ploop_err(ret, "Can't create io thread");
+			goto err;
+		}
+		q->nthreads++;
+	}
+
+	return q;
+
+err:
+	io_queue_destroy(q);
+	return NULL;
+}
+
+/*
+ * Queue copy of len bytes from src at src_pos to dst at dst_pos.
+ * Blocks if the queue is full. Returns an error of any previously
+ * failed copy.
+ */
+int io_queue_submit(struct io_queue *q, struct delta *src, off_t src_pos,
+		struct delta *dst, off_t dst_pos, __u32 len)
+{
+	struct io_job job = {
+		.src = src,
+		.src_pos = src_pos,
+		.dst = dst,
+		.dst_pos = dst_pos,
+		.len = len,
+	};
+	int ret;
+
+	if (len > q->bufsize) {
+		ploop_err(0, "io_queue_submit: len %u > %u", len, q->bufsize);
+		return SYSEXIT_PARAM;
+	}
+
+	/*
+	 * The first copy probes the zero-copy method in the caller,
+	 * before any job is queued, so the workers only read q->zcopy
+	 */
+	if (q->nthreads == 0 || q->zcopy == ZCOPY_PROBE)
+		return do_io_job(q, &job, q->buf);
+
+	pthread_mutex_lock(&q->lock);
+	while (q->inflight >= q->depth && !q->err)
+		pthread_cond_wait(&q->cond, &q->lock);
+	ret = q->err;
+	if (!ret) {
+		q->jobs[(q->head + q->count) % q->depth] = job;
+		q->count++;
+		q->inflight++;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+/* Wait for all queued copies to complete */
+int io_queue_drain(struct io_queue *q)
+{
+	int ret;
+
+	if (q->nthreads == 0)
+		return 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->inflight > 0)
+		pthread_cond_wait(&q->cond, &q->lock);
+	ret = q->err;
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+void io_queue_destroy(struct io_queue *q)
+{
+	int i;
+
+	if (q == NULL)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	for (i = 0; i < q->nthreads; i++)
+		pthread_join(q->workers[i].thread, NULL);
+
+	if (q->workers != NULL)
+		for (i = 0; i < q->depth; i++)
+			free(q->workers[i].buf);
+
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q->workers);
+	free(q->jobs);
+	free(q->buf);
+	free(q);
+}
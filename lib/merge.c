@@ -25,76 +25,194 @@
 #include <malloc.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/param.h>
 #include <limits.h>
 #include <getopt.h>
 #include <linux/types.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "ploop.h"
 #include "cbt.h"
 
-static int sync_cache(struct delta * delta)
+/* Number of clusters merge_image() copies in parallel by default */
+#define DEF_MERGE_QUEUE_DEPTH	8
+/* Max size of a single merge I/O on contiguous clusters by default */
+#define DEF_MERGE_IO_SIZE	(4 << 20)
+/* Owner map: no delta has the cluster allocated */
+#define OWNER_NONE		0xff
+/* Max number of index tables read in parallel */
+#define OWNER_MAP_THREADS	8
+/* Number of index updates journaled per data sync */
+#define MERGE_JOURNAL_BATCH	16384
+/* Max amount of data merged between checkpoints */
+#define MERGE_CHECKPOINT_SIZE	(1ULL << 30)
+
+static void *load_idx_table_thread(void *data)
 {
-	int skip = 0;
+	struct delta *delta = data;
 
-	if (!delta->l2_dirty)
-		return 0;
+	/* fall back to the L2 cache if the table does not fit in memory */
+	if (load_idx_table(delta) == SYSEXIT_MALLOC)
+		ploop_log(0, "Not enough memory to load index table,"
+				" falling back to L2 cache");
 
-	/* Sync data before we write out new index table. */
-	if (fsync(delta->fd)) {
-		ploop_err(errno, "fsync");
-		return -1;
+	return NULL;
+}
+
+/*
+ * Build a map of logical cluster -> level of the topmost delta
+ * having the cluster allocated (OWNER_NONE if there is no such one).
+ * Index tables of the deltas are read in parallel.
+ */
+static int build_owner_map(struct delta_array *da, __u32 l2_size, __u8 **out)
+{
+	pthread_t th[OWNER_MAP_THREADS];
+	__u8 *owner;
+	__u32 clu, iblk;
+	int i, j, n, ret = 0;
+
+	if (da->delta_max >= OWNER_NONE) {
+		ploop_err(0, "Too many deltas to merge: %d", da->delta_max);
+		return SYSEXIT_PARAM;
+	}
+
+	owner = malloc(l2_size);
+	if (owner == NULL) {
+		ploop_err(ENOMEM, "Can't allocate owner map");
+		return SYSEXIT_MALLOC;
 	}
+	memset(owner, OWNER_NONE, l2_size);
 
-	if (delta->l2_cache < 0) {
-		ploop_err(0, "abort: delta->l2_cache < 0");
-		return -1;
+	for (i = 0; i < da->delta_max; i += n) {
+		n = MIN(da->delta_max - i, OWNER_MAP_THREADS);
+		for (j = 0; j < n; j++) {
+			ret = pthread_create(&th[j], NULL, load_idx_table_thread,
+					&da->delta_arr[i + j]);
+			if (ret) {
+				ploop_err(ret, "Can't create thread");
+				n = j;
+				break;
+			}
+		}
+		for (j = 0; j < n; j++)
+			pthread_join(th[j], NULL);
+		if (ret)
+			goto err;
 	}
-	if (delta->l2_cache >= delta->l1_size) {
-		ploop_err(0, "abort: delta->l2_cache >= delta->l1_size");
-		return -1;
+
+	/* from the bottom up, so the upper deltas override the lower ones */
+	for (i = da->delta_max - 1; i >= 0; i--) {
+		struct delta *d = &da->delta_arr[i];
+		__u32 end = MIN(l2_size, d->l2_size);
+
+		for (clu = 0; clu < end; clu++) {
+			if (get_idx_entry(d, clu, &iblk)) {
+				ret = SYSEXIT_READ;
+				goto err;
+			}
+			if (iblk)
+				owner[clu] = i;
+		}
 	}
 
-	if (delta->l2_cache == 0)
-		skip = sizeof(struct ploop_pvd_header);
+	*out = owner;
+	return 0;
 
-	/* Write index table */
-	if (PWRITE(delta, (__u8 *)delta->l2 + skip,
-				S2B(delta->blocksize) - skip,
-				(off_t)delta->l2_cache * S2B(delta->blocksize) + skip))
-		return SYSEXIT_WRITE;
+err:
+	free(owner);
+	return ret;
+}
 
-	/* Sync index table. We can delay this, but this does not
-	 * improve performance
-	 */
-	if (fsync(delta->fd)) {
+/* Physically contiguous clusters to be copied with a single I/O */
+struct merge_run {
+	struct delta *src;
+	off_t src_pos;
+	off_t dst_pos;
+	__u32 len;
+};
+
+static int flush_run(struct io_queue *q, struct merge_run *run,
+		struct delta *odelta);
+
+/*
+ * Make the data copied so far durable and then journal the index
+ * entries pointing to it, along with a checkpoint to resume from.
+ */
+static int merge_commit(struct io_queue *q, struct merge_run *run,
+		struct delta *odelta, struct merge_journal *j, __u32 next_clu)
+{
+	int ret;
+
+	ret = flush_run(q, run, odelta);
+	if (ret)
+		return ret;
+
+	ret = io_queue_drain(q);
+	if (ret)
+		return ret;
+
+	if (fsync(odelta->fd)) {
 		ploop_err(errno, "fsync");
-		return -1;
+		return SYSEXIT_FSYNC;
 	}
-	delta->l2_dirty = 0;
-	return 0;
+
+	return merge_journal_commit(j, next_clu, odelta->alloc_head);
 }
 
-static int locate_l2_entry(struct delta_array *p, int level, int i, __u32 k, int *out)
+/* Identity of the set of source deltas to check a resumed merge */
+static __u32 merge_src_id(char **names, int n)
 {
-	__u64 cluster;
-	for (level++; level < p->delta_max; level++) {
-		if (p->delta_arr[level].l2_cache == -1) {
-			if (i >= p->delta_arr[level].l1_size)
-				break; /* grow is monotonic! */
-			cluster = S2B(p->delta_arr[level].blocksize);
-			if (PREAD(&p->delta_arr[level], p->delta_arr[level].l2,
-						cluster, (off_t)i * cluster))
-				return SYSEXIT_READ;
-			p->delta_arr[level].l2_cache = i;
-		}
-		if (p->delta_arr[level].l2[k]) {
-			*out = level;
-			return 0;
-		}
-	}
-	*out = -1;
+	__u32 crc = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		crc = crc * 31 + ploop_crc32((unsigned char *)names[i],
+				strlen(names[i]));
+
+	return crc;
+}
+
+static int flush_run(struct io_queue *q, struct merge_run *run,
+		struct delta *odelta)
+{
+	int ret;
+
+	if (run->len == 0)
+		return 0;
+
+	ret = io_queue_submit(q, run->src, run->src_pos, odelta,
+			run->dst_pos, run->len);
+	run->len = 0;
+
+	return ret;
+}
+
+static int add_to_run(struct io_queue *q, struct merge_run *run,
+		struct delta *odelta, struct delta *src, off_t src_pos,
+		off_t dst_pos, __u32 len, __u32 max_len)
+{
+	int ret;
+
+	if (run->len != 0 && run->src == src &&
+			run->src_pos + run->len == src_pos &&
+			run->dst_pos + run->len == dst_pos &&
+			run->len + len <= max_len) {
+		run->len += len;
+		return 0;
+	}
+
+	ret = flush_run(q, run, odelta);
+	if (ret)
+		return ret;
+
+	run->src = src;
+	run->src_pos = src_pos;
+	run->dst_pos = dst_pos;
+	run->len = len;
+
 	return 0;
 }
 
@@ -143,7 +261,7 @@ static int grow_lower_delta(const char *device, int top,
 	}
 
 	/* Here we know for sure that destination delta is in ploop1 format */
-	if (open_delta(&odelta, dst_image, O_RDWR, OD_NOFLAGS)) {
+	if (open_delta(&odelta, dst_image, O_RDWR, OD_LOAD_BAT)) {
 		ploop_err(errno, "open_delta");
 		ret = SYSEXIT_OPEN;
 		goto done;
@@ -280,23 +398,37 @@ int get_delta_info(const char *device, struct merge_info *info)
 }
 
 int merge_image(const char *device, int start_level, int end_level, int raw,
-		int merge_top, char **images, const char *new_image)
+		int merge_top, char **images, const char *new_image,
+		struct ploop_merge_param *param)
 {
 	int last_delta = 0;
 	char **names = NULL;
 	struct delta_array da = {};
 	struct delta odelta = {};
-	int i, i_end, ret = 0;
+	int i, i_start, i_end, ret = 0;
 	__u32 k;
 	__u32 allocated = 0;
 	__u64 cluster;
 	void *data_cache = NULL;
+	struct io_queue *q = NULL;
+	struct io_throttle *throttle = NULL;
+	struct merge_run run = {};
+	__u8 *owner = NULL;
+	struct merge_journal *journal = NULL;
+	int commit = 0;
+	int resume = 0;
+	__u32 src_id = 0;
+	__u32 start_clu = 0;
+	__u64 merged = 0;
+	__u32 max_io;
 	__u32 blocksize = 0;
 	__u32 prev_blocksize = 0;
 	int version = PLOOP_FMT_UNDEFINED;
 	const char *merged_image;
 
-	if (new_image && access(new_image, F_OK) == 0) {
+	/* An interrupted offline merge to a new image is resumed */
+	if (new_image && access(new_image, F_OK) == 0 &&
+			(device || raw || !merge_journal_exists(new_image))) {
 		ploop_err(EEXIST, "Can't merge to new image %s", new_image);
 		return SYSEXIT_PARAM;
 	}
@@ -372,6 +504,12 @@ rm_delta:
 		merged_image = names[last_delta];
 	}
 
+	/* Offline merge leaving a journal behind can be resumed */
+	if (!device && !raw) {
+		src_id = merge_src_id(names, last_delta);
+		resume = merge_journal_exists(merged_image);
+	}
+
 	init_delta_array(&da);
 
 	for (i = 0; i < last_delta; i++) {
@@ -407,7 +545,7 @@ rm_delta:
 	}
 	cluster = S2B(blocksize);
 
-	if (new_image) { /* Create it */
+	if (new_image && !resume) { /* Create it */
 		struct ploop_pvd_header *vh;
 		off_t size;
 		int mode = (raw) ? PLOOP_RAW_MODE : PLOOP_EXPANDED_MODE;
@@ -422,7 +560,8 @@ rm_delta:
 
 	if (!raw) {
 		if (open_delta(&odelta, merged_image, O_RDWR,
-			       device ? OD_NOFLAGS : OD_OFFLINE)) {
+			       (device ? OD_NOFLAGS : OD_OFFLINE) | OD_LOAD_BAT |
+			       (resume ? OD_ALLOW_DIRTY : 0))) {
 			ploop_err(errno, "open_delta");
 			ret = SYSEXIT_OPEN;
 			goto merge_done2;
@@ -444,6 +583,19 @@ rm_delta:
 		goto merge_done2;
 	}
 
+	max_io = param && param->max_io_size ?
+			param->max_io_size : DEF_MERGE_IO_SIZE;
+	max_io = MAX(max_io / cluster, 1) * cluster;
+	throttle = io_throttle_get(param ? param->io_limit_bps : 0,
+			param ? param->io_limit_iops : 0);
+	q = io_queue_create(param && param->queue_depth ?
+			param->queue_depth : DEF_MERGE_QUEUE_DEPTH, max_io,
+			throttle);
+	if (q == NULL) {
+		ret = SYSEXIT_MALLOC;
+		goto merge_done;
+	}
+
 	if (!device && !new_image) {
 		struct ploop_pvd_header *vh;
 		vh = (struct ploop_pvd_header *)da.delta_arr[0].hdr0;
@@ -469,135 +621,130 @@ rm_delta:
 		}
 	}
 
+	ret = build_owner_map(&da, da.delta_arr[0].l2_size, &owner);
+	if (ret)
+		goto merge_done;
+
+	if (resume) {
+		ret = merge_journal_resume(&journal, &odelta, merged_image,
+				MERGE_JOURNAL_BATCH, src_id, &start_clu);
+		if (ret)
+			goto merge_done;
+		ploop_log(0, "Resuming merge to %s from cluster %u",
+				merged_image, start_clu);
+	} else if (!raw) {
+		ret = merge_journal_open(&journal, &odelta, merged_image,
+				MERGE_JOURNAL_BATCH, src_id);
+		if (ret)
+			goto merge_done;
+	}
+
 	i_end = (da.delta_arr[0].l2_size + PLOOP_MAP_OFFSET + cluster/4 - 1) /
 		(cluster/4);
-	for (i = 0; i < i_end; i++) {
+	i_start = (start_clu + PLOOP_MAP_OFFSET) / (cluster/4);
+	for (i = i_start; i < i_end; i++) {
 		int k_start = 0;
 		int k_end   = cluster/4;
 
-		/* Load L2 table */
-		if (PREAD(&da.delta_arr[0], da.delta_arr[0].l2,
-			  cluster, (off_t)i * cluster)) {
-			ret = SYSEXIT_READ;
-			goto merge_done;
-		}
-
-		/* Announce L2 cache valid. This information is not used. */
-		da.delta_arr[0].l2_cache = i;
-
-		/* And invalidate L2 cache for lower delta, they will
-		 * be fetched on demand.
-		 */
-		for (k = 1; k < last_delta; k++)
-			da.delta_arr[k].l2_cache = -1;
-
 		/* Iterate over all L2 entries */
-		if (i == 0)
-			k_start = PLOOP_MAP_OFFSET;
+		if (i == i_start)
+			k_start = start_clu + PLOOP_MAP_OFFSET - i * cluster/4;
 		if (i == i_end - 1)
 			k_end   = da.delta_arr[0].l2_size + PLOOP_MAP_OFFSET -
 				  i * cluster/4;
 
+		/* Without the whole index table in memory the cached index
+		 * cluster is written back on switching to another one, so
+		 * the data it points to must be synced by that time.
+		 */
+		if (!raw && odelta.bat == NULL && i != i_start) {
+			ret = merge_commit(q, &run, &odelta, journal,
+					i * (cluster/4) - PLOOP_MAP_OFFSET);
+			if (ret)
+				goto merge_done;
+		}
+
 		for (k = k_start; k < k_end; k++) {
-			int level2 = 0;
+			__u32 clu = i * (cluster/4) + k - PLOOP_MAP_OFFSET;
+			int level2 = owner[clu];
+			__u32 iblk, oiblk;
 
-			/* If entry is not present in base level,
-			 * lookup lower deltas.
-			 */
-			if (da.delta_arr[0].l2[k] == 0) {
-				ret = locate_l2_entry(&da, 0, i, k, &level2);
-				if (ret)
-					goto merge_done;
-				if (level2 < 0)
-					continue;
-			}
+			if (level2 == OWNER_NONE)
+				continue;
 
-			if (PREAD(&da.delta_arr[level2], data_cache, cluster,
-						S2B(ploop_ioff_to_sec(da.delta_arr[level2].l2[k],
-								blocksize, version)))) {
+			if (get_idx_entry(&da.delta_arr[level2], clu, &iblk)) {
 				ret = SYSEXIT_READ;
 				goto merge_done;
 			}
 
 			if (raw) {
-				off_t opos;
-				opos = i * (cluster/4) + k - PLOOP_MAP_OFFSET;
-				if (PWRITE(&odelta, data_cache, cluster,
-					   opos*cluster)) {
-					ret = SYSEXIT_WRITE;
+				ret = add_to_run(q, &run, &odelta, &da.delta_arr[level2],
+						S2B(ploop_ioff_to_sec(iblk, blocksize, version)),
+						(off_t)clu * cluster, cluster, max_io);
+				if (ret)
 					goto merge_done;
-				}
 				continue;
 			}
 
-			if (i != odelta.l2_cache) {
-				if (odelta.l2_cache >= 0)
-					if ((ret = sync_cache(&odelta)))
-						goto merge_done;
-
-				odelta.l2_cache = i;
-				if (PREAD(&odelta, odelta.l2, cluster,
-					  (off_t)(i * cluster))) {
-					ret = SYSEXIT_READ;
-					goto merge_done;
-				}
-				odelta.l2_dirty = 0;
+			if (get_idx_entry(&odelta, clu, &oiblk)) {
+				ret = SYSEXIT_READ;
+				goto merge_done;
 			}
 
-			if (odelta.l2[k] == 0) {
-				odelta.l2[k] = ploop_sec_to_ioff((off_t)odelta.alloc_head++ * B2S(cluster),
+			if (oiblk == 0) {
+				oiblk = ploop_sec_to_ioff((off_t)odelta.alloc_head++ * B2S(cluster),
 							blocksize, version);
-				if (odelta.l2[k] == 0) {
-					ploop_err(0, "abort: odelta.l2[k] == 0");
+				if (oiblk == 0) {
+					ploop_err(0, "abort: oiblk == 0");
 					ret = SYSEXIT_ABORT;
 					goto merge_done;
 				}
-				odelta.l2_dirty = 1;
+				if ((ret = set_idx_entry(&odelta, clu, oiblk)))
+					goto merge_done;
+				commit = merge_journal_add(journal, clu, oiblk);
 				allocated++;
 			}
-			if (PWRITE(&odelta, data_cache, cluster,
-						S2B(ploop_ioff_to_sec(odelta.l2[k],
-								blocksize, version)))) {
-				ret = SYSEXIT_WRITE;
+
+			ret = add_to_run(q, &run, &odelta, &da.delta_arr[level2],
+					S2B(ploop_ioff_to_sec(iblk, blocksize, version)),
+					S2B(ploop_ioff_to_sec(oiblk, blocksize, version)),
+					cluster, max_io);
+			if (ret)
 				goto merge_done;
+
+			merged += cluster;
+			if (commit || merged >= MERGE_CHECKPOINT_SIZE) {
+				ret = merge_commit(q, &run, &odelta, journal, clu + 1);
+				if (ret)
+					goto merge_done;
+				commit = 0;
+				merged = 0;
 			}
 		}
 	}
 
+	if ((ret = flush_run(q, &run, &odelta)))
+		goto merge_done;
+	if ((ret = io_queue_drain(q)))
+		goto merge_done;
+
 	if (fsync(odelta.fd)) {
 		ploop_err(errno, "fsync");
 		ret = SYSEXIT_FSYNC;
 		goto merge_done;
 	}
 
-	if (odelta.l2_dirty) {
-		int skip = 0;
-
-		if (odelta.l2_cache < 0) {
-			ploop_err(0, "abort: odelta.l2_cache < 0");
-			ret = SYSEXIT_ABORT;
-			goto merge_done;
-		}
-		if (odelta.l2_cache >= odelta.l1_size) {
-			ploop_err(0, "abort: odelta.l2_cache >= odelta.l1_size");
-			ret = SYSEXIT_ABORT;
-			goto merge_done;
-		}
-
-		if (odelta.l2_cache == 0)
-			skip = sizeof(struct ploop_pvd_header);
-
-		if (PWRITE(&odelta, (__u8 *)odelta.l2 + skip,
-					cluster - skip,
-					(off_t)odelta.l2_cache * cluster + skip)) {
-			ret = SYSEXIT_WRITE;
+	if (!raw) {
+		/* Write the whole index table at once */
+		if ((ret = write_idx_table(&odelta)))
 			goto merge_done;
-		}
 		if (fsync(odelta.fd)) {
 			ploop_err(errno, "fsync");
 			ret = SYSEXIT_FSYNC;
 			goto merge_done;
 		}
+		merge_journal_close(journal, 1);
+		journal = NULL;
 	}
 
 	if (!raw && clear_delta(&odelta)) {
@@ -611,6 +758,9 @@ rm_delta:
 	}
 
 merge_done:
+	io_queue_destroy(q);
+	/* keep the journal to be replayed on the next check */
+	merge_journal_close(journal, 0);
 	close_delta(&odelta);
 
 	if (device && !ret) {
@@ -661,7 +811,9 @@ merge_done2:
 	if (!device && !raw && ret == 0)
 		ploop_move_cbt(images[1], images[0]);
 
+	free(owner);
 	free(data_cache);
+	io_throttle_put(throttle);
 	deinit_delta_array(&da);
 	return ret;
 }
@@ -718,8 +870,9 @@ static void log_merge_images_info(struct ploop_disk_images_data *di,
 }
 
 int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di,
-		const char *guid, const char *new_delta)
+		const char *guid, struct ploop_merge_param *param)
 {
+	const char *new_delta = param ? param->new_delta : NULL;
 	char conf[PATH_MAX];
 	char conf_tmp[PATH_MAX];
 	char dev[64];
@@ -910,7 +1063,8 @@ int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di,
 	if (ret)
 		goto err;
 
-	ret = merge_image(device, start_level, end_level, raw, merge_top, names, new_delta);
+	ret = merge_image(device, start_level, end_level, raw, merge_top, names,
+			new_delta, param);
 	if (ret)
 		goto err;
 
@@ -997,10 +1151,10 @@ int ploop_merge_snapshot(struct ploop_disk_images_data *di, struct ploop_merge_p
 		guid = di->top_guid;
 
 	if (guid != NULL) {
-		ret = ploop_merge_snapshot_by_guid(di, guid, param->new_delta);
+		ret = ploop_merge_snapshot_by_guid(di, guid, param);
 	} else {
 		while (di->nsnapshots != 1) {
-			ret = ploop_merge_snapshot_by_guid(di, di->top_guid, param->new_delta);
+			ret = ploop_merge_snapshot_by_guid(di, di->top_guid, param);
 			if (ret)
 				break;
 		}
@@ -1009,3 +1163,275 @@ int ploop_merge_snapshot(struct ploop_disk_images_data *di, struct ploop_merge_p
 
 	return ret;
 }
+
+/* Merge estimation state: clusters allocated in the merged data so far */
+struct merge_est {
+	__u8 *used;
+	__u32 size;
+	__u64 cluster;
+	__u64 idx_bytes;	/* index table bytes read */
+	double idx_time;	/* and time spent on it */
+};
+
+static __u32 est_l1_size(__u32 l2_size, __u64 cluster)
+{
+	return ((__u64)(l2_size + PLOOP_MAP_OFFSET) * sizeof(__u32) +
+			cluster - 1) / cluster;
+}
+
+static double est_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int est_open(struct merge_est *e, const char *image, struct delta *d)
+{
+	double start = est_now();
+
+	/* bypass the page cache to get a realistic throughput sample */
+	if (open_delta(d, image, O_RDONLY | O_DIRECT,
+				OD_ALLOW_DIRTY | OD_LOAD_BAT)) {
+		ploop_err(errno, "open_delta");
+		return SYSEXIT_OPEN;
+	}
+
+	if (e->cluster == 0)
+		e->cluster = S2B(d->blocksize);
+	else if (e->cluster != S2B(d->blocksize)) {
+		ploop_err(0, "Wrong blocksize %s bs=%d", image, d->blocksize);
+		close_delta(d);
+		return SYSEXIT_PLOOPFMT;
+	}
+
+	e->idx_bytes += (__u64)d->l1_size * e->cluster;
+	e->idx_time += est_now() - start;
+
+	return 0;
+}
+
+static int est_resize(struct merge_est *e, __u32 size)
+{
+	__u8 *p;
+
+	if (size <= e->size)
+		return 0;
+
+	p = realloc(e->used, size);
+	if (p == NULL) {
+		ploop_err(ENOMEM, "Can't allocate cluster map");
+		return SYSEXIT_MALLOC;
+	}
+	memset(p + e->size, 0, size - e->size);
+	e->used = p;
+	e->size = size;
+
+	return 0;
+}
+
+/*
+ * Account merge of the data collected in e->used to image. raw image
+ * has all clusters allocated. If new_image is set, both are merged
+ * to a new image. The merged data is collected in e->used.
+ */
+static int est_merge(struct merge_est *e, const char *image, int raw,
+		int new_image, struct ploop_merge_level_estimate *l,
+		__u64 *alloc)
+{
+	struct delta d = { .fd = -1 };
+	__u32 clu, iblk, l2_size = e->size;
+	int ret;
+
+	if (!raw) {
+		ret = est_open(e, image, &d);
+		if (ret)
+			return ret;
+		l2_size = d.l2_size;
+		ret = est_resize(e, l2_size);
+		if (ret)
+			goto out;
+	}
+
+	for (clu = 0; clu < e->size; clu++) {
+		iblk = raw;
+		if (!raw && clu < d.l2_size && get_idx_entry(&d, clu, &iblk)) {
+			ret = SYSEXIT_READ;
+			goto out;
+		}
+
+		if (new_image) {
+			if (e->used[clu] || iblk)
+				l->copy_clusters++;
+		} else if (e->used[clu]) {
+			l->copy_clusters++;
+			if (!iblk)
+				l->new_clusters++;
+		}
+		if (iblk)
+			e->used[clu] = 1;
+	}
+
+	if (new_image) {
+		l->new_clusters = l->copy_clusters;
+		*alloc = (l->new_clusters + est_l1_size(e->size, e->cluster)) *
+			e->cluster;
+	} else {
+		*alloc = l->new_clusters * e->cluster;
+		/* index table of the destination is grown first */
+		if (!raw && e->size > l2_size)
+			*alloc += (__u64)(est_l1_size(e->size, e->cluster) -
+					d.l1_size) * e->cluster;
+	}
+	ret = 0;
+out:
+	close_delta(&d);
+
+	return ret;
+}
+
+static __u64 est_image_size(const char *image)
+{
+	struct stat st;
+
+	if (stat(image, &st)) {
+		ploop_err(errno, "Can't stat %s", image);
+		return 0;
+	}
+
+	return (__u64)st.st_blocks * 512;
+}
+
+/*
+ * Estimate the merge described by param (see ploop_merge_snapshot())
+ * from the index tables of the deltas, without data I/O.
+ */
+int ploop_merge_estimate(struct ploop_disk_images_data *di,
+		struct ploop_merge_param *param, struct ploop_merge_estimate *est)
+{
+	struct merge_est e = {};
+	struct ploop_merge_level_estimate top = {};
+	struct io_throttle *throttle;
+	const char *guid, *parent_guid;
+	char **chain = NULL;
+	__u64 total = 0, alloc, copy_bps;
+	int i, n = 0, base = 0, ret;
+
+	memset(est, 0, sizeof(*est));
+
+	if (ploop_lock_dd(di))
+		return SYSEXIT_LOCK;
+
+	/* deltas from the top one down to the last merge destination */
+	chain = calloc(di->nsnapshots + 1, sizeof(char *));
+	if (chain == NULL) {
+		ploop_err(ENOMEM, "ploop_merge_estimate");
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
+
+	guid = param->guid ?: di->top_guid;
+	ret = SYSEXIT_PARAM;
+	while (n < di->nsnapshots) {
+		i = find_snapshot_by_guid(di, guid);
+		chain[n] = find_image_by_guid(di, guid);
+		if (i == -1 || chain[n] == NULL) {
+			ploop_err(0, "Can't find image by uuid %s", guid);
+			goto err;
+		}
+		n++;
+		parent_guid = di->snapshots[i]->parent_guid;
+		if (strcmp(parent_guid, NONE_UUID) == 0) {
+			base = 1;
+			break;
+		}
+		if (n == 2 && (param->guid || !param->merge_all))
+			break;
+		guid = parent_guid;
+	}
+	if (n < 2) {
+		ploop_err(0, "Unable to merge base image");
+		goto err;
+	}
+
+	est->levels = calloc(n - 1, sizeof(struct ploop_merge_level_estimate));
+	if (est->levels == NULL) {
+		ploop_err(ENOMEM, "ploop_merge_estimate");
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
+
+	for (i = 0; i < di->nimages; i++)
+		total += est_image_size(di->images[i]->file);
+
+	/* collect the top delta */
+	ret = est_merge(&e, chain[0], 0, 0, &top, &alloc);
+	if (ret)
+		goto err;
+
+	for (i = 1; i < n; i++) {
+		struct ploop_merge_level_estimate *l = &est->levels[i - 1];
+		/* only the base image could be in raw format */
+		int raw = (i == n - 1 && base && di->mode == PLOOP_RAW_MODE);
+		int new_image = (param->new_delta != NULL && n == 2);
+
+		l->image = strdup(chain[i - 1]);
+		if (l->image == NULL) {
+			ploop_err(ENOMEM, "ploop_merge_estimate");
+			ret = SYSEXIT_MALLOC;
+			goto err;
+		}
+		est->nlevels++;
+
+		ret = est_merge(&e, chain[i], raw, new_image, l, &alloc);
+		if (ret)
+			goto err;
+
+		est->copy_bytes += l->copy_clusters * e.cluster;
+		est->alloc_bytes += alloc;
+		/* the merged delta is removed only after the merge */
+		total += alloc;
+		if (total > est->peak_bytes)
+			est->peak_bytes = total;
+		total -= est_image_size(chain[i - 1]);
+		if (new_image)
+			total -= est_image_size(chain[i]);
+	}
+	if (est->peak_bytes < total)
+		est->peak_bytes = total;
+
+	est->cluster = e.cluster;
+	if (e.idx_time > 0)
+		est->throughput = e.idx_bytes / e.idx_time;
+	throttle = io_throttle_get(param->io_limit_bps, param->io_limit_iops);
+	copy_bps = io_throttle_bps(throttle);
+	io_throttle_put(throttle);
+	if (copy_bps && (est->throughput == 0 || copy_bps < est->throughput))
+		est->throughput = copy_bps;
+	/* every cluster is read and written */
+	if (est->throughput)
+		est->duration = 2 * est->copy_bytes / est->throughput;
+
+	ret = 0;
+err:
+	if (ret)
+		ploop_free_merge_estimate(est);
+	free(e.used);
+	free(chain);
+	ploop_unlock_dd(di);
+
+	return ret;
+}
+
+void ploop_free_merge_estimate(struct ploop_merge_estimate *est)
+{
+	int i;
+
+	for (i = 0; i < est->nlevels; i++)
+		free(est->levels[i].image);
+	free(est->levels);
+	est->levels = NULL;
+	est->nlevels = 0;
+}
@@ -0,0 +1,552 @@
+/*
+ *  Copyright (c) 2008-2017 Parallels International GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Merge journal: a sidecar file <image>.mjournal keeping index updates
+ * made by merge which are not written to the image index table yet.
+ *
+ * merge_image() appends a record with a batch of <clu, iblk> pairs
+ * once the data of the batch is synced, and writes the whole index
+ * table only at the end. If the merge is interrupted, the journal is
+ * replayed on ploop check. A record is applied only if it is complete
+ * and its checksum matches.
+ *
+ * Each batch is followed by a checkpoint record: the first cluster
+ * not merged yet and the allocation head of the image. A new journal
+ * starts with a checkpoint at cluster 0. An offline merge restarted
+ * with the same source deltas continues from the last checkpoint.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+
+#include "ploop.h"
+
+#define MJ_MAGIC	0x4c4e524a	/* "JRNL" */
+#define MJ_REC_MAGIC	0x4345524a	/* "JREC" */
+#define MJ_VERSION	1
+
+#define MJ_REC_IDX	1
+#define MJ_REC_CKPT	2
+
+#define MJ_FNAME(fname, image)	snprintf(fname, sizeof(fname), "%s.mjournal", image)
+
+struct mj_header {
+	__u32 magic;
+	__u32 version;
+	__u32 blocksize;
+	__u32 fmt_version;
+	__u64 l2_size;
+};
+
+struct mj_rec_header {
+	__u32 magic;
+	__u32 type;
+	__u32 n;	/* number of entries */
+	__u32 crc;	/* crc of entries */
+};
+
+struct mj_entry {
+	__u32 clu;
+	__u32 iblk;
+};
+
+struct mj_checkpoint {
+	__u32 next_clu;		/* clusters below are merged */
+	__u32 alloc_head;
+	__u32 src_id;		/* identity of source deltas */
+	__u32 reserved;
+};
+
+struct merge_journal {
+	int fd;
+	char fname[PATH_MAX];
+	__u32 src_id;
+	struct mj_entry *entries;
+	__u32 n;
+	__u32 max;
+};
+
+static __u32 rec_len(struct mj_rec_header *rec)
+{
+	return rec->type == MJ_REC_CKPT ? sizeof(struct mj_checkpoint) :
+		rec->n * sizeof(struct mj_entry);
+}
+
+/*
+ * Read a record at pos into *buf (reallocated as needed).
+ * Returns the size of the record, 0 at the end of valid records,
+ * or -1 on error.
+ */
+static int read_record(int fd, off_t pos, struct mj_rec_header *rec,
+		void **buf, __u32 max_n)
+{
+	__u32 len;
+	void *p;
+
+	if (pread(fd, rec, sizeof(*rec), pos) != sizeof(*rec) ||
+			rec->magic != MJ_REC_MAGIC || rec->n > max_n)
+		return 0;
+
+	len = rec_len(rec);
+	p = realloc(*buf, len ?: 1);
+	if (p == NULL) {
+		ploop_err(ENOMEM, "read journal");
+		return -1;
+	}
+	*buf = p;
+
+	if (pread(fd, p, len, pos + sizeof(*rec)) != len ||
+			ploop_crc32(p, len) != rec->crc)
+		return 0;
+
+	return sizeof(*rec) + len;
+}
+
+static int append_records(struct merge_journal *j,
+		struct mj_checkpoint *ckpt)
+{
+	struct mj_rec_header rec[2] = {
+		{
+			.magic = MJ_REC_MAGIC,
+			.type = MJ_REC_IDX,
+			.n = j->n,
+		}, {
+			.magic = MJ_REC_MAGIC,
+			.type = MJ_REC_CKPT,
+			.n = 1,
+		},
+	};
+	off_t pos;
+
+	rec[0].crc = ploop_crc32((unsigned char *)j->entries,
+			j->n * sizeof(struct mj_entry));
+	rec[1].crc = ploop_crc32((unsigned char *)ckpt, sizeof(*ckpt));
+
+	pos = lseek(j->fd, 0, SEEK_END);
+	if (pos == (off_t)-1) {
+		ploop_err(errno, "lseek %s", j->fname);
+		return SYSEXIT_WRITE;
+	}
+
+	if (j->n != 0) {
+		if (write_safe(j->fd, &rec[0], sizeof(rec[0]), pos, "write journal") ||
+				write_safe(j->fd, j->entries, j->n * sizeof(struct mj_entry),
+					pos + sizeof(rec[0]), "write journal"))
+			return SYSEXIT_WRITE;
+		pos += sizeof(rec[0]) + j->n * sizeof(struct mj_entry);
+	}
+
+	if (write_safe(j->fd, &rec[1], sizeof(rec[1]), pos, "write journal") ||
+			write_safe(j->fd, ckpt, sizeof(*ckpt),
+				pos + sizeof(rec[1]), "write journal"))
+		return SYSEXIT_WRITE;
+
+	return 0;
+}
+
+static struct merge_journal *alloc_journal(const char *image, __u32 max,
+		__u32 src_id)
+{
+	struct merge_journal *j;
+
+	j = calloc(1, sizeof(*j));
+	if (j == NULL) {
+		ploop_err(ENOMEM, "merge journal");
+		return NULL;
+	}
+
+	j->fd = -1;
+	j->max = max;
+	j->src_id = src_id;
+	j->entries = malloc(max * sizeof(struct mj_entry));
+	if (j->entries == NULL) {
+		ploop_err(ENOMEM, "merge journal");
+		free(j);
+		return NULL;
+	}
+	MJ_FNAME(j->fname, image);
+
+	return j;
+}
+
+/* src_id identifies the merge, see merge_journal_resume() */
+int merge_journal_open(struct merge_journal **out, struct delta *delta,
+		const char *image, __u32 max, __u32 src_id)
+{
+	struct merge_journal *j;
+	int ret;
+	struct mj_header hdr = {
+		.magic = MJ_MAGIC,
+		.version = MJ_VERSION,
+		.blocksize = delta->blocksize,
+		.fmt_version = delta->version,
+		.l2_size = delta->l2_size,
+	};
+
+	j = alloc_journal(image, max, src_id);
+	if (j == NULL)
+		return SYSEXIT_MALLOC;
+
+	j->fd = open(j->fname, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600);
+	if (j->fd < 0) {
+		ploop_err(errno, "Can't create %s", j->fname);
+		merge_journal_close(j, 0);
+		return SYSEXIT_OPEN;
+	}
+
+	if (write_safe(j->fd, &hdr, sizeof(hdr), 0, "write journal header") ||
+			fsync(j->fd)) {
+		ploop_err(errno, "Can't write %s", j->fname);
+		merge_journal_close(j, 1);
+		return SYSEXIT_WRITE;
+	}
+
+	/* A merge interrupted before the first batch restarts from 0 */
+	ret = merge_journal_commit(j, 0, delta->alloc_head);
+	if (ret) {
+		merge_journal_close(j, 1);
+		return ret;
+	}
+
+	*out = j;
+
+	return 0;
+}
+
+/* Returns 1 if the batch is full and has to be committed */
+int merge_journal_add(struct merge_journal *j, __u32 clu, __u32 iblk)
+{
+	j->entries[j->n].clu = clu;
+	j->entries[j->n].iblk = iblk;
+	j->n++;
+
+	return j->n >= j->max;
+}
+
+/*
+ * Append the batch of entries to the journal, followed by a checkpoint:
+ * all clusters below next_clu are merged. The data the entries point
+ * to must be synced by the caller already.
+ */
+int merge_journal_commit(struct merge_journal *j, __u32 next_clu,
+		__u32 alloc_head)
+{
+	struct mj_checkpoint ckpt = {
+		.next_clu = next_clu,
+		.alloc_head = alloc_head,
+		.src_id = j->src_id,
+	};
+	int ret;
+
+	ret = append_records(j, &ckpt);
+	if (ret)
+		return ret;
+
+	if (fdatasync(j->fd)) {
+		ploop_err(errno, "fdatasync %s", j->fname);
+		return SYSEXIT_FSYNC;
+	}
+
+	j->n = 0;
+
+	return 0;
+}
+
+void merge_journal_close(struct merge_journal *j, int drop)
+{
+	if (j == NULL)
+		return;
+
+	if (j->fd >= 0)
+		close(j->fd);
+	if (drop && unlink(j->fname) && errno != ENOENT)
+		ploop_err(errno, "Failed to unlink %s", j->fname);
+	free(j->entries);
+	free(j);
+}
+
+static int apply_entries(struct delta *d, struct mj_entry *e, __u32 n,
+		const char *fname)
+{
+	__u32 i, iblk;
+	int ret;
+
+	for (i = 0; i < n; i++) {
+		iblk = ploop_ioff_to_sec(e[i].iblk, d->blocksize,
+				d->version) / d->blocksize;
+		if (e[i].clu >= d->l2_size || iblk >= d->alloc_head ||
+				iblk < d->l1_size) {
+			ploop_err(0, "Journal %s is corrupted: %u -> %u",
+					fname, e[i].clu, e[i].iblk);
+			return SYSEXIT_PLOOPFMT;
+		}
+		ret = set_idx_entry(d, e[i].clu, e[i].iblk);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Apply index entries of valid records located before end */
+static int replay_records(int fd, struct delta *d, const char *fname,
+		off_t end)
+{
+	struct mj_rec_header rec;
+	void *buf = NULL;
+	off_t pos = sizeof(struct mj_header);
+	__u32 n = 0, nrec = 0;
+	int len, ret = 0;
+
+	while (pos < end) {
+		len = read_record(fd, pos, &rec, &buf, d->l2_size);
+		if (len == -1) {
+			ret = SYSEXIT_MALLOC;
+			goto out;
+		} else if (len == 0)
+			break;
+
+		if (rec.type == MJ_REC_IDX) {
+			ret = apply_entries(d, buf, rec.n, fname);
+			if (ret)
+				goto out;
+			n += rec.n;
+		}
+
+		nrec++;
+		pos += len;
+	}
+
+	ploop_log(0, "Replaying %u index entries from %u journal records",
+			n, nrec);
+out:
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Find the last checkpoint of the merge identified by src_id.
+ * *end is set to the end of the checkpoint record, 0 if there is none.
+ */
+static int find_checkpoint(int fd, __u32 src_id, __u32 max_n,
+		struct mj_checkpoint *ckpt, off_t *end)
+{
+	struct mj_rec_header rec;
+	void *buf = NULL;
+	off_t pos = sizeof(struct mj_header);
+	int len;
+
+	*end = 0;
+	for (;;) {
+		len = read_record(fd, pos, &rec, &buf, max_n);
+		if (len == -1) {
+			free(buf);
+			return SYSEXIT_MALLOC;
+		} else if (len == 0)
+			break;
+
+		pos += len;
+		if (rec.type == MJ_REC_CKPT &&
+				((struct mj_checkpoint *)buf)->src_id == src_id) {
+			memcpy(ckpt, buf, sizeof(*ckpt));
+			*end = pos;
+		}
+	}
+	free(buf);
+
+	return 0;
+}
+
+static int check_header(int fd, struct delta *d, const char *fname)
+{
+	struct mj_header hdr;
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			hdr.magic != MJ_MAGIC || hdr.version != MJ_VERSION)
+		return -1;
+
+	if (d != NULL && (hdr.blocksize != d->blocksize ||
+			hdr.fmt_version != d->version ||
+			hdr.l2_size != d->l2_size)) {
+		ploop_err(0, "Journal %s does not match the image", fname);
+		return SYSEXIT_PLOOPFMT;
+	}
+
+	return 0;
+}
+
+int merge_journal_exists(const char *image)
+{
+	char fname[PATH_MAX];
+
+	MJ_FNAME(fname, image);
+
+	return access(fname, F_OK) == 0;
+}
+
+/*
+ * Continue the journal of an interrupted merge identified by src_id:
+ * apply its index entries to the opened delta up to the last
+ * checkpoint, and return the checkpoint. Records after the checkpoint
+ * are discarded, and so are blocks allocated after it.
+ */
+int merge_journal_resume(struct merge_journal **out, struct delta *delta,
+		const char *image, __u32 max, __u32 src_id, __u32 *next_clu)
+{
+	struct merge_journal *j;
+	struct mj_checkpoint ckpt;
+	off_t end;
+	int ret;
+
+	j = alloc_journal(image, max, src_id);
+	if (j == NULL)
+		return SYSEXIT_MALLOC;
+
+	j->fd = open(j->fname, O_RDWR | O_CLOEXEC);
+	if (j->fd < 0) {
+		ploop_err(errno, "Can't open %s", j->fname);
+		ret = SYSEXIT_OPEN;
+		goto err;
+	}
+
+	ret = check_header(j->fd, delta, j->fname);
+	if (ret == 0)
+		ret = find_checkpoint(j->fd, src_id, delta->l2_size, &ckpt, &end);
+	if (ret == 0 && end == 0)
+		ret = -1;
+	if (ret) {
+		if (ret == -1) {
+			ploop_err(0, "Image %s has a journal of another merge,"
+					" run ploop check", image);
+			ret = SYSEXIT_PLOOPINUSE;
+		}
+		goto err;
+	}
+
+	if (ckpt.alloc_head < delta->l1_size ||
+			ckpt.alloc_head > delta->alloc_head ||
+			ckpt.next_clu > delta->l2_size) {
+		ploop_err(0, "Journal %s is corrupted: wrong checkpoint",
+				j->fname);
+		ret = SYSEXIT_PLOOPFMT;
+		goto err;
+	}
+
+	ret = replay_records(j->fd, delta, j->fname, end);
+	if (ret)
+		goto err;
+
+	delta->alloc_head = ckpt.alloc_head;
+	if (ftruncate(delta->fd, (off_t)ckpt.alloc_head * S2B(delta->blocksize))) {
+		ploop_err(errno, "Can't truncate %s", image);
+		ret = SYSEXIT_FTRUNCATE;
+		goto err;
+	}
+
+	if (ftruncate(j->fd, end)) {
+		ploop_err(errno, "Can't truncate %s", j->fname);
+		ret = SYSEXIT_FTRUNCATE;
+		goto err;
+	}
+
+	*next_clu = ckpt.next_clu;
+	*out = j;
+
+	return 0;
+
+err:
+	merge_journal_close(j, 0);
+	return ret;
+}
+
+/*
+ * Apply index updates of an interrupted merge from the journal of
+ * the image if there is any, and drop the journal.
+ */
+int merge_journal_replay(const char *image, int ro)
+{
+	char fname[PATH_MAX];
+	struct delta d = { .fd = -1 };
+	int fd, ret;
+
+	MJ_FNAME(fname, image);
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		ploop_err(errno, "Can't open %s", fname);
+		return SYSEXIT_OPEN;
+	}
+
+	if (ro) {
+		ploop_log(0, "Warning: %s has a merge journal, it will be"
+				" replayed in read-write mode", image);
+		close(fd);
+		return 0;
+	}
+
+	ploop_log(0, "Replaying merge journal %s", fname);
+	if (check_header(fd, NULL, fname)) {
+		/* the journal was not even created completely */
+		ploop_log(0, "Dropping journal %s with a wrong header", fname);
+		ret = 0;
+		goto drop;
+	}
+
+	ret = open_delta(&d, image, O_RDWR, OD_ALLOW_DIRTY | OD_OFFLINE | OD_LOAD_BAT);
+	if (ret) {
+		ret = SYSEXIT_OPEN;
+		goto err;
+	}
+
+	ret = check_header(fd, &d, fname);
+	if (ret)
+		goto err;
+
+	ret = replay_records(fd, &d, fname, LLONG_MAX);
+	if (ret)
+		goto err;
+
+	ret = write_idx_table(&d);
+	if (ret)
+		goto err;
+
+	if (fsync(d.fd)) {
+		ploop_err(errno, "fsync %s", image);
+		ret = SYSEXIT_FSYNC;
+		goto err;
+	}
+
+drop:
+	if (unlink(fname) && errno != ENOENT) {
+		ploop_err(errno, "Failed to unlink %s", fname);
+		ret = SYSEXIT_UNLINK;
+	}
+err:
+	close_delta(&d);
+	close(fd);
+
+	return ret;
+}
@@ -459,8 +459,10 @@ int ploop_copy_send(struct ploop_copy_send_param *arg)
 	__u64 iterpos;
 	__u64 trackpos;
 	__u64 trackend;
-	__u64 xferred;
-	int iter;
+	__u64 xferred, passed;
+	__u64 downtime;
+	int iter, stop;
+	struct pcopy_conv conv = {};
 	struct ploop_track_extent e;
 	int i;
 	pthread_t send_th = 0;
@@ -546,6 +548,7 @@ int ploop_copy_send(struct ploop_copy_send_param *arg)
 	ploop_log(-1, "Sending %s", send_from);
 
 	trackend = e.end;
+	pcopy_conv_start(&conv);
 	for (pos = 0; pos < trackend; ) {
 		int n;
 
@@ -562,10 +565,13 @@ int ploop_copy_send(struct ploop_copy_send_param *arg)
 		pos += n;
 	}
 	/* First copy done */
+	pcopy_conv_done(&conv, pos);
+	pcopy_conv_start(&conv);
 
 	iter = 1;
 	iterpos = 0;
-	xferred = 0;
+	xferred = passed = 0;
+	stop = 0;
 
 	for (;;) {
 		int err;
@@ -578,8 +584,15 @@ int ploop_copy_send(struct ploop_copy_send_param *arg)
 			if (e.end > trackend)
 				trackend = e.end;
 
-			if (e.start < iterpos)
+			if (e.start < iterpos) {
+				/* a pass is over, see if the next one helps */
 				iter++;
+				pcopy_conv_done(&conv, xferred - passed);
+				passed = xferred;
+				stop = pcopy_conv_should_stop(&conv,
+						PCOPY_DEF_DOWNTIME, &downtime);
+				pcopy_conv_start(&conv);
+			}
 			iterpos = e.end;
 			xferred += e.end - e.start;
 
@@ -614,7 +627,7 @@ int ploop_copy_send(struct ploop_copy_send_param *arg)
 			goto done;
 		}
 
-		if (iter > 10 || (iter > 1 && xferred > trackend))
+		if (stop || (iter > 1 && xferred > trackend))
 			break;
 	}
 
@@ -23,17 +23,25 @@
 #include <unistd.h>
 #include <malloc.h>
 #include <limits.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <linux/types.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <openssl/md5.h>
 
 #include "ploop.h"
 #include "cleanup.h"
 #include "cbt.h"
+#include "bit_ops.h"
 
 #define ploop_dbg(level, format, args...) ploop_log(level, format, ##args)
 
@@ -41,12 +49,28 @@ typedef enum {
 	PCOPY_PKT_DATA,
 	PCOPY_PKT_CMD,
 	PCOPY_PKT_DATA_ASYNC,
+	PCOPY_PKT_HOLE,		/* __u64 length of a range reading as zeroes */
+	PCOPY_PKT_HOLE_ASYNC,
+	PCOPY_PKT_ZERO,		/* __u64 length of a range of zero data */
+	PCOPY_PKT_ZERO_ASYNC,
+	PCOPY_PKT_ZDATA,	/* compressed block, see compress.c */
+	PCOPY_PKT_ZDATA_ASYNC,
 } pcopy_pkt_type_t;
 
 typedef enum {
 	PCOPY_CMD_SYNC,
+	PCOPY_CMD_COMPRESS,	/* followed by codec, PLOOP_COPY_COMPRESS_* */
+	PCOPY_CMD_WINDOW,	/* followed by the window size, packets */
+	PCOPY_CMD_HASH,		/* followed by the cluster size, the reply
+				 * is followed by the cluster hashes
+				 */
+	PCOPY_CMD_TRUNCATE,	/* set the file size to the packet pos */
+	PCOPY_CMD_HOLE,		/* check that hole and zero packets are taken */
 } pcopy_cmd_t;
 
+/* Unacknowledged synchronous packets per stream */
+#define PCOPY_WINDOW		64
+
 struct pcopy_pkt_desc
 {
         __u32		marker;
@@ -56,29 +80,96 @@ struct pcopy_pkt_desc
         __u64		pos;
 };
 
-struct sender_data {
-	void *buf;
-	int len;
+/*
+ * With a window negotiated, synchronous data packets are not replied
+ * one by one. The receiver acknowledges them cumulatively by sequence
+ * number, that is the count of such packets on the stream, or reports
+ * the first failed packet along with its position.
+ */
+struct pcopy_ack
+{
+	__u32		marker;
+#define PCOPY_ACK_MARKER 0x4cc0ac3f
+	__u32		seq;
+	__s32		ret;
+	__u32		reserved;
+	__u64		pos;
+};
+
+/*
+ * The receiver's file is hashed per cluster. The hash list is a __u64
+ * count of clusters followed by a hash of each of them; the last one
+ * may be partial and is hashed as it is.
+ */
+#define PCOPY_HASH_SIZE		MD5_DIGEST_LENGTH
+#define PCOPY_HASH_THREADS	8
+
+/* Packets and data buffers in flight per stream */
+#define PCOPY_RING_SIZE		8
+
+struct pcopy_pkt {
+	pcopy_pkt_type_t type;	/* PCOPY_PKT_DATA, _HOLE or _ZERO */
+	void *buf;		/* one of the ring buffers or NULL */
+	__u64 len;
 	off_t pos;
-	int ret;
+};
+
+/*
+ * Single producer/single consumer ring between the image reader and
+ * a sender thread. Only the reader moves head and only the sender
+ * moves tail; the semaphores count free and queued slots, so either
+ * side sleeps only if the ring is full or empty. Data buffers are
+ * taken in turn and returned by the sender once sent.
+ */
+struct pcopy_ring {
+	struct pcopy_pkt pkt[PCOPY_RING_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	sem_t free;
+	sem_t queued;
+	void *buf[PCOPY_RING_SIZE];
+	unsigned int buf_head;	/* the next buffer to be queued */
+	int buf_held;		/* taken from buf_free, not queued yet */
+	int buf_given;		/* of them handed out to the reader */
+	sem_t buf_free;
+	int ret;		/* the first send error */
 	int err_no;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-	pthread_mutex_t wait_mutex;
-	pthread_cond_t wait_cond;
-	pthread_barrier_t barrier;
+};
+
+/* Output stream with its own sender thread */
+struct pcopy_stream {
+	struct ploop_copy_handle *h;
+	struct pcopy_ring ring;
+	int ofd;
+	pthread_t send_th;
+	struct zpool *zpool;
+	__u32 window;		/* 0 - reply to every packet */
+	__u32 sent;		/* windowed packets sent */
+	__u32 acked;		/* and acknowledged */
+	__u64 matched;		/* bytes the receiver had already */
+	int pipe[2];		/* data is spliced from the image through it */
+	int nosplice;
+	void *stage;		/* or read here if it can not be */
+	/* statistics of the pass, collected by the sender */
+	__u64 read_bytes;
+	__u64 read_us;
+	__u64 send_bytes;
+	__u64 send_us;
+	__u64 acks;
+	__u64 ack_us;
+	__u64 ack_max_us;
+	__u64 sent_us[PCOPY_WINDOW];	/* when the windowed packets were sent */
 };
 
 struct ploop_copy_handle {
-	struct sender_data sd;
+	struct pcopy_stream *streams;
+	int nstreams;
 	struct delta idelta;
 	int devfd;
 	int partfd;
-	int ofd;
 	int is_remote;
 	int mntfd;
-	void *iobuf[2];
-	int cur_iobuf;
+	void *rbuf;		/* the last block read */
 	int niter;
 	int cluster;
 	__u64 trackpos;
@@ -87,11 +178,30 @@ struct ploop_copy_handle {
 	int fs_frozen;
 	int dev_frozen;
 	int raw;
-	pthread_t send_th;
 	struct ploop_cleanup_hook *cl;
 	int cancelled;
 	off_t eof_offset;
 	int async;
+	__u64 data_off;		/* first data cluster offset, bytes */
+	__u32 *refmap;		/* clusters referenced by the index */
+	__u32 *skipmap;		/* unreferenced clusters not sent */
+	__u64 mapsize;		/* clusters in the maps */
+	int rescan;		/* index has changed, check skipmap */
+	__u64 zero_pos;		/* pending range of zero clusters */
+	__u64 zero_len;
+	void *zero_buf;		/* zeroes sent as data if holes are not taken */
+	int compress;
+	int compress_level;
+	struct pcopy_conv conv;
+	int resume;		/* the receiver keeps its file */
+	int resume_pass;	/* skip clusters matching rhash */
+	unsigned char *rhash;	/* cluster hashes of the receiver's file */
+	__u64 nrhash;
+	int zerocopy;		/* data clusters are spliced from the image */
+	struct ploop_copy_pass_stat pstat;	/* of the last pass */
+	int npass;
+	__u64 pass_start;
+	__u64 freeze_start;	/* the device or fs is frozen since */
 };
 
 /* Check what a file descriptor refers to.
@@ -149,31 +259,108 @@ static int nwrite(int fd, const void *buf, int len)
 	return -1;
 }
 
-static int remote_write(int fd, pcopy_pkt_type_t type,
-		const void *data, int len, off_t pos)
+static int is_async_pkt(pcopy_pkt_type_t type)
+{
+	return type == PCOPY_PKT_DATA_ASYNC || type == PCOPY_PKT_HOLE_ASYNC ||
+		type == PCOPY_PKT_ZERO_ASYNC || type == PCOPY_PKT_ZDATA_ASYNC;
+}
+
+static pcopy_pkt_type_t get_async_pkt(pcopy_pkt_type_t type)
+{
+	switch (type) {
+	case PCOPY_PKT_DATA:
+		return PCOPY_PKT_DATA_ASYNC;
+	case PCOPY_PKT_HOLE:
+		return PCOPY_PKT_HOLE_ASYNC;
+	case PCOPY_PKT_ZERO:
+		return PCOPY_PKT_ZERO_ASYNC;
+	case PCOPY_PKT_ZDATA:
+		return PCOPY_PKT_ZDATA_ASYNC;
+	default:
+		return type;
+	}
+}
+
+/* Check if the buffer is all zeroes */
+static int is_zero_block(const void *buf, size_t len)
+{
+	const unsigned long *p = buf;
+	size_t i, n = len / sizeof(*p);
+
+	/* data is usually seen in the first words */
+	for (i = 0; i < n && i < 8; i++)
+		if (p[i])
+			return 0;
+
+	/* the OR of the words is vectorized by the compiler */
+	for (; i + 8 <= n; i += 8)
+		if (p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+				p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7])
+			return 0;
+
+	for (; i < n; i++)
+		if (p[i])
+			return 0;
+
+	for (i *= sizeof(*p); i < len; i++)
+		if (((const char *)buf)[i])
+			return 0;
+
+	return 1;
+}
+
+static int send_desc(int fd, pcopy_pkt_type_t type, int len, off_t pos)
 {
-	int rc;
 	struct pcopy_pkt_desc desc = {
 		.marker = PCOPY_MARKER,
 		.type = type,
 	};
 
-	/* Header */
 	desc.size = len;
 	desc.pos = pos;
 	if (nwrite(fd, &desc, sizeof(desc)))
 		return SYSEXIT_WRITE;
 
+	return 0;
+}
+
+static int send_pkt(int fd, pcopy_pkt_type_t type,
+		const void *data, int len, off_t pos)
+{
+	/* Header */
+	if (send_desc(fd, type, len, pos))
+		return SYSEXIT_WRITE;
+
 	/* Data */
 	if (len && nwrite(fd, data, len))
 		return SYSEXIT_WRITE;
 
+	return 0;
+}
+
+static int read_reply(int fd)
+{
+	int rc, n;
+
+	n = TEMP_FAILURE_RETRY(read(fd, &rc, sizeof(rc)));
+	if (n != sizeof(rc))
+		return SYSEXIT_PROTOCOL;
+
+	return rc;
+}
+
+static int remote_write(int fd, pcopy_pkt_type_t type,
+		const void *data, int len, off_t pos)
+{
+	int rc;
+
+	rc = send_pkt(fd, type, data, len, pos);
+	if (rc)
+		return rc;
+
 	/* get reply */
-	if (type != PCOPY_PKT_DATA_ASYNC) {
-		rc = TEMP_FAILURE_RETRY(read(fd, &rc, sizeof(rc)));
-		if (rc != sizeof(rc))
-			return SYSEXIT_PROTOCOL;
-	}
+	if (!is_async_pkt(type))
+		return read_reply(fd);
 
 	return 0;
 }
@@ -201,13 +388,108 @@ static int local_write(int ofd, const void *iobuf, int len, off_t pos)
 	return 0;
 }
 
-static int send_cmd(struct ploop_copy_handle *h, pcopy_cmd_t cmd)
+static int write_data(int fd, const void *buf, __u32 len, off_t pos)
 {
-	if (h->is_remote)
-		return remote_write(h->ofd, PCOPY_PKT_CMD, &cmd, sizeof(cmd), 0);
-	else
-		if (cmd == PCOPY_CMD_SYNC)
-			return data_sync(h->ofd);
+	ssize_t n;
+
+	n = TEMP_FAILURE_RETRY(pwrite(fd, buf, len, pos));
+	if (n != len) {
+		if (n < 0)
+			ploop_err(errno, "Error in pwrite");
+		else
+			ploop_err(0, "Error: short pwrite");
+		return SYSEXIT_WRITE;
+	}
+
+	return 0;
+}
+
+/*
+ * Make a range of the file read as zeroes, keeping it sparse.
+ * If hole_end is given, the file is not extended, the end of the range
+ * is accumulated there instead: with several streams writing to the file
+ * ftruncate() could race with a write past the current size.
+ */
+static int write_hole(int fd, __u64 len, off_t pos, __u64 *hole_end)
+{
+	struct stat st;
+	off_t end;
+	void *buf = NULL;
+	int ret = 0;
+
+	if (fstat(fd, &st)) {
+		ploop_err(errno, "Can't fstat");
+		return SYSEXIT_FSTAT;
+	}
+
+	end = pos + len;
+	if (hole_end != NULL) {
+		if (end > *hole_end)
+			*hole_end = end;
+	} else if (end > st.st_size && ftruncate(fd, end)) {
+		ploop_err(errno, "Can't truncate to %llu", (unsigned long long)end);
+		return SYSEXIT_WRITE;
+	}
+
+	/* the extended part is a hole already */
+	if (end > st.st_size)
+		end = st.st_size;
+	if (pos >= end)
+		return 0;
+
+	if (sys_fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				pos, end - pos) == 0)
+		return 0;
+
+	if (errno != EOPNOTSUPP) {
+		ploop_err(errno, "Can't punch hole pos=%llu len=%llu",
+				(unsigned long long)pos,
+				(unsigned long long)(end - pos));
+		return SYSEXIT_WRITE;
+	}
+
+	buf = calloc(1, DEF_CLUSTER);
+	if (buf == NULL) {
+		ploop_err(ENOMEM, "write_hole");
+		return SYSEXIT_MALLOC;
+	}
+
+	while (pos < end) {
+		ssize_t n = end - pos > DEF_CLUSTER ? DEF_CLUSTER : end - pos;
+
+		if (TEMP_FAILURE_RETRY(pwrite(fd, buf, n, pos)) != n) {
+			ploop_err(errno, "Error in pwrite");
+			ret = SYSEXIT_WRITE;
+			break;
+		}
+		pos += n;
+	}
+	free(buf);
+
+	return ret;
+}
+
+static void sem_wait_nointr(sem_t *sem)
+{
+	while (sem_wait(sem) && errno == EINTR);
+}
+
+static __u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (__u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Start writing back the data received so far, without waiting */
+static int start_writeback(int fd)
+{
+	if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE)) {
+		ploop_err(errno, "Error in sync_file_range()");
+		return SYSEXIT_WRITE;
+	}
 
 	return 0;
 }
@@ -236,804 +518,4118 @@ static int nread(int fd, void * buf, int len)
 	return -1;
 }
 
-static int get_image_info(const char *device, char **send_from_p,
-		char **format_p, int *blocksize)
+static int read_ack(struct pcopy_stream *s)
 {
-	int top_level;
+	struct pcopy_ack ack;
+	__u64 now;
 
-	if (ploop_get_attr(device, "top", &top_level)) {
-		ploop_err(0, "Can't find top delta");
-		return SYSEXIT_SYSFS;
+	if (nread(s->ofd, &ack, sizeof(ack))) {
+		ploop_err(errno, "Error in nread(ack)");
+		return SYSEXIT_PROTOCOL;
 	}
 
-	if (ploop_get_attr(device, "block_size", blocksize)) {
-		ploop_err(0, "Can't find block size");
-		return SYSEXIT_SYSFS;
+	if (ack.marker != PCOPY_ACK_MARKER ||
+			ack.seq - s->acked > s->sent - s->acked) {
+		ploop_err(0, "Stream corrupted: invalid acknowledgement");
+		return SYSEXIT_PROTOCOL;
 	}
 
-	if (find_delta_names(device, top_level, top_level,
-				send_from_p, format_p)) {
-		ploop_err(errno, "find_delta_names");
-		return SYSEXIT_SYSFS;
+	if (ack.ret) {
+		ploop_err(0, "The receiver failed at pos=%llu: %d",
+				(unsigned long long)ack.pos, ack.ret);
+		return ack.ret;
+	}
+
+	now = now_us();
+	for (; s->acked != ack.seq; s->acked++) {
+		__u64 t = now - s->sent_us[s->acked % PCOPY_WINDOW];
+
+		s->acks++;
+		s->ack_us += t;
+		if (t > s->ack_max_us)
+			s->ack_max_us = t;
 	}
 
 	return 0;
 }
 
-int ploop_copy_receiver(struct ploop_copy_receive_param *arg)
+/* Wait till all the windowed packets are acknowledged */
+static int drain_window(struct pcopy_stream *s)
 {
-	int ofd, ret;
-	__u64 cluster = 0;
-	void *iobuf = NULL;
-	int n;
-	struct pcopy_pkt_desc desc;
-
-	if (!arg)
-		return SYSEXIT_PARAM;
+	int ret;
 
-	if (is_fd_socket(arg->ifd) != 1) {
-		ploop_err(errno, "Invalid input fd %d: must be "
-				"a pipe or a socket", arg->ifd);
-		return SYSEXIT_PARAM;
+	while (s->acked != s->sent) {
+		ret = read_ack(s);
+		if (ret)
+			return ret;
 	}
 
-	ofd = open(arg->file, O_WRONLY|O_CREAT|O_TRUNC, 0600);
-	if (ofd < 0) {
-		ploop_err(errno, "Can't open %s", arg->file);
-		return SYSEXIT_CREAT;
+	return 0;
+}
+
+static int send_stage(struct pcopy_stream *s, int len, off_t pos)
+{
+	__u64 t;
+	ssize_t n;
+	int ret;
+
+	if (s->stage == NULL && p_memalign(&s->stage, 4096, s->h->cluster))
+		return SYSEXIT_MALLOC;
+
+	t = now_us();
+	n = TEMP_FAILURE_RETRY(pread(s->h->idelta.fd, s->stage, len, pos));
+	s->read_us += now_us() - t;
+	if (n != len) {
+		if (n < 0)
+			ploop_err(errno, "Error from pread() size=%d pos=%llu",
+					len, (unsigned long long)pos);
+		else
+			ploop_err(0, "Short read");
+		return SYSEXIT_READ;
 	}
+	s->read_bytes += len;
 
-	ploop_dbg(3, "RCV start %s", arg->file);
-	for (;;) {
-		if (nread(arg->ifd, &desc, sizeof(desc)) < 0) {
-			ploop_err(errno, "Error in nread(desc)");
-			ret = SYSEXIT_READ;
-			goto out;
-		}
+	t = now_us();
+	ret = nwrite(s->ofd, s->stage, len) ? SYSEXIT_WRITE : 0;
+	s->send_us += now_us() - t;
+	s->send_bytes += len;
 
-		if (desc.marker != PCOPY_MARKER) {
-			ploop_err(0, "Stream corrupted");
-			ret = SYSEXIT_PROTOCOL;
-			goto out;
-		}
+	return ret;
+}
 
-		if (desc.size > cluster) {
-			free(iobuf);
-			iobuf = NULL;
-			cluster = desc.size;
-			if (p_memalign(&iobuf, 4096, cluster)) {
-				ret = SYSEXIT_MALLOC;
-				goto out;
-			}
-		}
+/*
+ * Send a data packet right from the image: it is spliced to the socket
+ * through a pipe of the cluster size, so that the image is read by a
+ * single O_DIRECT read and the data is not copied to the user space.
+ * If splice() is not supported, the data is read to the staging buffer.
+ */
+static int send_pkt_file(struct pcopy_stream *s, pcopy_pkt_type_t type,
+		int len, off_t pos)
+{
+	loff_t off = pos;
+	ssize_t n, m;
+	__u64 t;
 
-		if (desc.size == 0)
-			break;
+	if (send_desc(s->ofd, type, len, pos))
+		return SYSEXIT_WRITE;
 
-		if (nread(arg->ifd, iobuf, desc.size)) {
-			ploop_err(errno, "Error in nread data");
-			ret = SYSEXIT_READ;
-			goto out;
-		}
+	if (s->nosplice)
+		return send_stage(s, len, pos);
 
-		ploop_log(3, "RCV type=%d len=%d pos=%" PRIu64,
-				desc.type, desc.size, (uint64_t)desc.pos);
-		ret = 0;
-		switch (desc.type) {
-		case PCOPY_PKT_DATA:
-		case PCOPY_PKT_DATA_ASYNC: {
-			n = TEMP_FAILURE_RETRY(pwrite(ofd, iobuf, desc.size, desc.pos));
-			if (n != desc.size) {
-				if (n < 0)
-					ploop_err(errno, "Error in pwrite");
-				else
-					ploop_err(0, "Error: short pwrite");
-				ret = SYSEXIT_WRITE;
-				goto out;
-			}
-			break;
+	if (s->pipe[0] == -1) {
+		if (pipe2(s->pipe, O_CLOEXEC)) {
+			ploop_err(errno, "Can't create pipe");
+			s->nosplice = 1;
+			return send_stage(s, len, pos);
 		}
-		case PCOPY_PKT_CMD: {
-			unsigned int cmd = ((unsigned int *) iobuf)[0];
-			switch(cmd) {
-			case PCOPY_CMD_SYNC:
-				ret = data_sync(ofd);
-				if (ret)
-					goto out;
-				break;
-			default:
-				ploop_err(0, "ploop_copy_receiver: unsupported command %d",
-						cmd);
-				ret = SYSEXIT_PARAM;
-			}
-			break;
+		(void)fcntl(s->pipe[1], F_SETPIPE_SZ, s->h->cluster);
+	}
+
+	while (len > 0) {
+		t = now_us();
+		n = splice(s->h->idelta.fd, &off, s->pipe[1], NULL, len,
+				SPLICE_F_MOVE);
+		s->read_us += now_us() - t;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && off == pos) {
+			ploop_log(1, "splice() is not supported for the image");
+			s->nosplice = 1;
+			return send_stage(s, len, pos);
 		}
-		default:
-			ploop_err(0, "ploop_copy_receiver: unsupported command type%d",
-						desc.type);
-			ret = SYSEXIT_PARAM;
-			break;
+		if (n <= 0) {
+			if (n < 0)
+				ploop_err(errno, "Error in splice(image) pos=%llu",
+						(unsigned long long)off);
+			else
+				ploop_err(0, "Short read");
+			return SYSEXIT_READ;
 		}
-
-		/* send reply */
-		if (desc.type != PCOPY_PKT_DATA_ASYNC &&
-				nwrite(arg->ifd, &ret, sizeof(int))) {
-			ret = SYSEXIT_WRITE;
-			ploop_err(errno, "failed to send reply");
-			goto out;
+		len -= n;
+		s->read_bytes += n;
+
+		while (n > 0) {
+			t = now_us();
+			m = splice(s->pipe[0], NULL, s->ofd, NULL, n,
+					SPLICE_F_MOVE | (len ? SPLICE_F_MORE : 0));
+			s->send_us += now_us() - t;
+			if (m > 0) {
+				n -= m;
+				s->send_bytes += m;
+				continue;
+			}
+			if (m < 0 && errno == EINTR)
+				continue;
+			ploop_err(m ? errno : EIO, "Error in splice(socket)");
+			return SYSEXIT_WRITE;
 		}
 	}
 
-	ret = data_sync(ofd);
-	if (ret)
-		goto out;
+	return 0;
+}
 
-	ploop_dbg(3, "RCV exited");
-	/* send final reply */
-	ret = 0;
-	if (nwrite(arg->ifd, &ret, sizeof(int))) {
-		ret = SYSEXIT_WRITE;
-		ploop_err(errno, "failed to send reply");
-		goto out;
-	}
+/* No data for a data packet means it is sent right from the image */
+static int stream_send_pkt(struct pcopy_stream *s, pcopy_pkt_type_t type,
+		const void *data, int len, off_t pos)
+{
+	__u64 t;
+	int ret;
 
-out:
-	if (close(ofd)) {
-		ploop_err(errno, "Error in close");
-		if (!ret)
-			ret = SYSEXIT_WRITE;
-	}
-	if (ret)
-		unlink(arg->file);
-	free(iobuf);
+	if (data == NULL && len)
+		return send_pkt_file(s, type, len, pos);
+
+	t = now_us();
+	ret = send_pkt(s->ofd, type, data, len, pos);
+	s->send_us += now_us() - t;
+	s->send_bytes += len;
 
 	return ret;
 }
 
-static void cancel_sender(void *data)
-{
-	struct ploop_copy_handle *h = (struct ploop_copy_handle *)data;
+/*
+ * Send a packet to the remote side. Synchronous data packets are only
+ * waited for when the window is full; any other packet expecting a
+ * reply is preceded by waiting for all the acknowledgements, so that
+ * replies and acknowledgements never mix.
+ */
+static int stream_write(struct pcopy_stream *s, pcopy_pkt_type_t type,
+		const void *data, int len, off_t pos)
+{
+	int ret;
 
-	h->cancelled = 1;
-}
+	if (s->window == 0 || is_async_pkt(type)) {
+		__u64 t = now_us();
 
-static void wait_sender(struct ploop_copy_handle *h)
-{
-	pthread_mutex_lock(&h->sd.mutex);
-	pthread_mutex_unlock(&h->sd.mutex);
-}
+		ret = stream_send_pkt(s, type, data, len, pos);
+		if (ret || is_async_pkt(type))
+			return ret;
+		ret = read_reply(s->ofd);
+		t = now_us() - t;
+		s->acks++;
+		s->ack_us += t;
+		if (t > s->ack_max_us)
+			s->ack_max_us = t;
+		return ret;
+	}
 
-static void wakeup(pthread_mutex_t *m, pthread_cond_t *c)
-{
-	pthread_mutex_lock(m);
-	pthread_cond_signal(c);
-	pthread_mutex_unlock(m);
-}
+	if (type == PCOPY_PKT_CMD || len == 0) {
+		ret = drain_window(s);
+		if (ret)
+			return ret;
+		return remote_write(s->ofd, type, data, len, pos);
+	}
 
-static int send_buf(struct ploop_copy_handle *h, const void *iobuf, int len, off_t pos)
-{
-	if (h->cancelled)
-		return SYSEXIT_WRITE;
+	ret = stream_send_pkt(s, type, data, len, pos);
+	if (ret) {
+		/* the receiver may have reported why it has gone */
+		if (s->acked != s->sent) {
+			int rc = drain_window(s);
 
-	if (h->is_remote)
-		return remote_write(h->ofd,
-			h->async ? PCOPY_PKT_DATA_ASYNC : PCOPY_PKT_DATA, iobuf, len, pos);
-	else
-		return local_write(h->ofd, iobuf, len, pos);
-}
+			if (rc)
+				ret = rc;
+		}
+		return ret;
+	}
+	s->sent_us[s->sent % PCOPY_WINDOW] = now_us();
+	s->sent++;
 
-static void *sender_thread(void *data)
-{
-	struct ploop_copy_handle *h = data;
-	struct sender_data *sd = &h->sd;
-	int done;
+	while (s->sent - s->acked >= s->window) {
+		ret = read_ack(s);
+		if (ret)
+			return ret;
+	}
 
-	pthread_mutex_lock(&sd->mutex);
-	ploop_dbg(3, "start sender_thread");
-	pthread_barrier_wait(&sd->barrier);
-	do {
-		pthread_cond_wait(&sd->cond, &sd->mutex);
+	return 0;
+}
 
-		wakeup(&sd->wait_mutex, &sd->wait_cond);
+static int send_cmd(struct ploop_copy_handle *h, pcopy_cmd_t cmd)
+{
+	int i, ret;
 
-		sd->ret = send_buf(h, sd->buf, sd->len, sd->pos);
-		if (sd->ret)
-			sd->err_no = errno;
-		done = (sd->len == 0 && sd->pos == 0);
-	} while (!done);
+	if (!h->is_remote)
+		return cmd == PCOPY_CMD_SYNC ? data_sync(h->streams[0].ofd) : 0;
 
-	pthread_mutex_unlock(&sd->mutex);
+	/* every stream has to reach this point */
+	for (i = 0; i < h->nstreams; i++) {
+		ret = stream_write(&h->streams[i], PCOPY_PKT_CMD,
+				&cmd, sizeof(cmd), 0);
+		if (ret)
+			return ret;
+	}
 
-	ploop_log(3, "send_thread exited ret=%d", sd->ret);
-	return NULL;
+	return 0;
 }
 
-static int send_async(struct ploop_copy_handle *h, void *data,
-		__u64 size, __u64 pos)
+static int get_image_info(const char *device, char **send_from_p,
+		char **format_p, int *blocksize)
 {
-	struct sender_data *sd = &h->sd;
+	int top_level;
+
+	if (ploop_get_attr(device, "top", &top_level)) {
+		ploop_err(0, "Can't find top delta");
+		return SYSEXIT_SYSFS;
+	}
 
-	pthread_mutex_lock(&sd->mutex);
+	if (ploop_get_attr(device, "block_size", blocksize)) {
+		ploop_err(0, "Can't find block size");
+		return SYSEXIT_SYSFS;
+	}
 
-	if (sd->ret) {
-		ploop_err(sd->err_no, "write error");
-		pthread_mutex_unlock(&sd->mutex);
-		return sd->ret;
+	if (find_delta_names(device, top_level, top_level,
+				send_from_p, format_p)) {
+		ploop_err(errno, "find_delta_names");
+		return SYSEXIT_SYSFS;
 	}
 
-	sd->buf = data;
-	sd->len = size;
-	sd->pos = pos;
+	return 0;
+}
+
+struct pcopy_receiver {
+	struct pcopy_receiver *all;	/* all the streams of the file */
+	int nstreams;
+	int ofd;
+	int ifd;
+	pthread_t th;
+	__u64 hole_end;		/* end of the holes written past EOF */
+	int ret;
+	__u32 window;		/* 0 - reply to every packet */
+	__u32 rcvd;		/* windowed packets processed */
+	__u32 acked;
+	int resume;		/* the file is kept, see PCOPY_CMD_HASH */
+	int hashed;		/* and the sender has asked for hashes */
+	__u64 data_end;		/* end of the data and holes received */
+	int pipe[2];		/* data is spliced to the file through it */
+	int nosplice;
+	int dfd;		/* the file opened with O_DIRECT or -1 */
+	struct pcopy_writer *wr;
+	struct pcopy_remap *remap;	/* the image is compacted */
+};
 
-	pthread_cond_signal(&sd->cond);
-	pthread_mutex_unlock(&sd->mutex);
+static int send_ack(struct pcopy_receiver *r, int ret, __u64 pos)
+{
+	struct pcopy_ack ack = {
+		.marker = PCOPY_ACK_MARKER,
+		.seq = r->rcvd,
+		.ret = ret,
+		.pos = pos,
+	};
 
-	/* wait till sender start processing */
-	pthread_cond_wait(&sd->wait_cond, &sd->wait_mutex);
+	if (nwrite(r->ifd, &ack, sizeof(ack))) {
+		ploop_err(errno, "failed to send acknowledgement");
+		return SYSEXIT_WRITE;
+	}
+	r->acked = r->rcvd;
 
 	return 0;
 }
 
-static void *get_free_iobuf(struct ploop_copy_handle *h)
+/*
+ * Acknowledge the processed packets once half of the window is used
+ * or the sender has nothing more in flight, so that it never stalls
+ * with a full window.
+ */
+static int ack_window(struct pcopy_receiver *r)
 {
-	h->cur_iobuf = !h->cur_iobuf;
-	return h->iobuf[h->cur_iobuf];
+	struct pollfd pfd = { .fd = r->ifd, .events = POLLIN };
+
+	if (r->rcvd - r->acked < (r->window + 1) / 2 &&
+			poll(&pfd, 1, 0) > 0)
+		return 0;
+
+	return send_ack(r, 0, 0);
 }
 
-static int send_image_block(struct ploop_copy_handle *h, __u64 size,
-		__u64 pos, ssize_t *nread)
+struct hash_job {
+	int fd;
+	__u32 cluster;
+	__u64 first;		/* clusters to hash */
+	__u64 last;
+	__u64 size;		/* of the file */
+	unsigned char *hash;
+	int ret;
+};
+
+static void *hash_thread(void *data)
 {
-	struct delta *idelta = &h->idelta;
-	void *iobuf = get_free_iobuf(h);
+	struct hash_job *j = data;
+	void *buf;
+	__u64 clu;
+	ssize_t n;
 
-	ploop_dbg(4, "READ size=%llu pos=%llu", size, pos);
-	*nread = TEMP_FAILURE_RETRY(pread(idelta->fd, iobuf, size, pos));
-	if (*nread == 0)
-		return 0;
-	if (*nread < 0) {
-		ploop_err(errno, "Error from pread() size=%llu pos=%llu",
-				 size, pos);
-		return SYSEXIT_READ;
+	if (p_memalign(&buf, 4096, j->cluster)) {
+		j->ret = SYSEXIT_MALLOC;
+		return NULL;
 	}
 
-	return send_async(h, iobuf, *nread, pos);
+	for (clu = j->first; clu < j->last; clu++) {
+		off_t pos = clu * j->cluster;
+		size_t len = j->size - pos < j->cluster ?
+				j->size - pos : j->cluster;
+
+		n = TEMP_FAILURE_RETRY(pread(j->fd, buf, len, pos));
+		if (n != len) {
+			if (n < 0)
+				ploop_err(errno, "Error from pread() pos=%llu",
+						(unsigned long long)pos);
+			else
+				ploop_err(0, "Short read pos=%llu",
+						(unsigned long long)pos);
+			j->ret = SYSEXIT_READ;
+			break;
+		}
+		MD5(buf, len, j->hash + clu * PCOPY_HASH_SIZE);
+	}
+	free(buf);
+
+	return NULL;
 }
 
-void ploop_copy_release(struct ploop_copy_handle *h)
+/* Hash the file per cluster, the parts of it in parallel */
+static int hash_file(int fd, __u32 cluster, unsigned char **hash, __u64 *n)
 {
-	if (h == NULL)
-		return;
+	struct hash_job job[PCOPY_HASH_THREADS];
+	pthread_t th[PCOPY_HASH_THREADS];
+	struct stat st;
+	__u64 per;
+	long nth;
+	int i, ret = 0;
 
-	if (h->dev_frozen) {
-		if (ioctl_device(h->partfd, PLOOP_IOC_THAW, 0))
-			ploop_err(errno, "Failed to PLOOP_IOC_THAW");
-		h->dev_frozen = 0;
+	if (fstat(fd, &st)) {
+		ploop_err(errno, "Can't fstat");
+		return SYSEXIT_FSTAT;
 	}
 
-	if (h->fs_frozen) {
-		(void)ioctl_device(h->mntfd, FITHAW, 0);
-		h->fs_frozen = 0;
-	}
+	*hash = NULL;
+	*n = (st.st_size + cluster - 1) / cluster;
+	if (*n == 0)
+		return 0;
 
-	if (h->tracker_on) {
-		(void)ioctl_device(h->devfd, PLOOP_IOC_TRACK_ABORT, 0);
-		h->tracker_on = 0;
+	*hash = malloc(*n * PCOPY_HASH_SIZE);
+	if (*hash == NULL) {
+		ploop_err(ENOMEM, "hash_file");
+		return SYSEXIT_MALLOC;
 	}
 
-	if (h->mntfd != -1) {
-		close(h->mntfd);
-		h->mntfd = -1;
+	nth = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nth > PCOPY_HASH_THREADS)
+		nth = PCOPY_HASH_THREADS;
+	if (nth > *n)
+		nth = *n;
+	if (nth < 1)
+		nth = 1;
+	per = (*n + nth - 1) / nth;
+
+	for (i = 0; i < nth; i++) {
+		job[i].fd = fd;
+		job[i].cluster = cluster;
+		job[i].first = i * per;
+		job[i].last = job[i].first + per < *n ? job[i].first + per : *n;
+		job[i].size = st.st_size;
+		job[i].hash = *hash;
+		job[i].ret = 0;
+		if (pthread_create(&th[i], NULL, hash_thread, &job[i])) {
+			th[i] = 0;
+			hash_thread(&job[i]);
+		}
 	}
 
-	if (h->devfd != -1) {
-		close(h->devfd);
-		h->devfd = -1;
+	for (i = 0; i < nth; i++) {
+		if (th[i])
+			pthread_join(th[i], NULL);
+		if (job[i].ret && !ret)
+			ret = job[i].ret;
 	}
 
-	if (h->partfd != -1) {
-		close(h->partfd);
-		h->partfd = -1;
+	if (ret) {
+		free(*hash);
+		*hash = NULL;
 	}
 
-	if (h->idelta.fd != -1)
-		close_delta(&h->idelta);
+	return ret;
 }
 
-void free_ploop_copy_handle(struct ploop_copy_handle *h)
+static int send_hashes(int fd, const unsigned char *hash, __u64 n)
 {
-	if (h == NULL)
-		return;
-
-	pthread_mutex_destroy(&h->sd.mutex);
-	pthread_cond_destroy(&h->sd.cond);
-	pthread_mutex_destroy(&h->sd.wait_mutex);
-	pthread_cond_destroy(&h->sd.wait_cond);
-	pthread_barrier_destroy(&h->sd.barrier);
+	size_t len = n * PCOPY_HASH_SIZE, chunk;
 
-	unregister_cleanup_hook(h->cl);
+	if (nwrite(fd, &n, sizeof(n)))
+		goto err;
 
-	free(h->iobuf[0]);
-	free(h->iobuf[1]);
+	for (; len > 0; len -= chunk, hash += chunk) {
+		chunk = len < DEF_CLUSTER ? len : DEF_CLUSTER;
+		if (nwrite(fd, hash, chunk))
+			goto err;
+	}
 
-	free(h);
+	return 0;
+err:
+	ploop_err(errno, "failed to send cluster hashes");
+	return SYSEXIT_WRITE;
 }
 
-static struct ploop_copy_handle *alloc_ploop_copy_handle(int cluster)
+static int recv_data(struct pcopy_receiver *r, void *iobuf, __u32 len,
+		off_t pos)
 {
-	struct ploop_copy_handle *h;
+	if (nread(r->ifd, iobuf, len)) {
+		ploop_err(errno, "Error in nread data");
+		return SYSEXIT_READ;
+	}
 
-	h = calloc(1, sizeof(struct ploop_copy_handle));
-	if (h == NULL)
-		return NULL;
+	return write_data(r->ofd, iobuf, len, pos);
+}
 
-	pthread_mutex_init(&h->sd.mutex, NULL);
-	pthread_cond_init(&h->sd.cond, NULL);
-	pthread_mutex_init(&h->sd.wait_mutex, NULL);
-	pthread_cond_init(&h->sd.wait_cond, NULL);
-	pthread_barrier_init(&h->sd.barrier, NULL, 2);
+/*
+ * Move the data of a packet from the socket to the file through a pipe,
+ * it is not copied to the user space. If splice() is not supported for
+ * the socket or the file, the data is read to iobuf and written.
+ */
+static int splice_data(struct pcopy_receiver *r, void *iobuf, __u32 len,
+		off_t pos)
+{
+	loff_t off = pos;
+	ssize_t n, m;
+	int ret;
 
-	h->devfd = h->ofd = h->mntfd = h->idelta.fd = -1;
-	h->cluster = cluster;
+	if (r->pipe[0] == -1) {
+		if (pipe2(r->pipe, O_CLOEXEC)) {
+			ploop_err(errno, "Can't create pipe");
+			r->nosplice = 1;
+			return recv_data(r, iobuf, len, pos);
+		}
+		/* a cluster at once if allowed */
+		(void)fcntl(r->pipe[1], F_SETPIPE_SZ, len);
+	}
 
-	if (p_memalign(&h->iobuf[0], 4096, cluster))
-		goto err;
+	while (len > 0) {
+		n = splice(r->ifd, NULL, r->pipe[1], NULL, len, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && off == pos) {
+			ploop_log(1, "splice() is not supported for the input");
+			r->nosplice = 1;
+			return recv_data(r, iobuf, len, pos);
+		}
+		if (n <= 0) {
+			ploop_err(n ? errno : EIO, "Error in splice(socket)");
+			return SYSEXIT_READ;
+		}
+		len -= n;
 
-	if (p_memalign(&h->iobuf[1], 4096, cluster))
-		goto err;
+		while (n > 0) {
+			m = splice(r->pipe[0], NULL, r->ofd, &off, n,
+					SPLICE_F_MOVE);
+			if (m > 0) {
+				n -= m;
+				continue;
+			}
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m < 0 && errno == EINVAL) {
+				ploop_log(1, "splice() is not supported for the file");
+				r->nosplice = 1;
+				/* drain the pipe, then the rest of the packet */
+				if (nread(r->pipe[0], iobuf, n)) {
+					ploop_err(errno, "Error in nread(pipe)");
+					return SYSEXIT_READ;
+				}
+				ret = write_data(r->ofd, iobuf, n, off);
+				if (ret || len == 0)
+					return ret;
+				return recv_data(r, iobuf, len, off + n);
+			}
+			ploop_err(m ? errno : EIO, "Error in splice(file)");
+			return SYSEXIT_WRITE;
+		}
+	}
 
-	return h;
-err:
-	free_ploop_copy_handle(h);
-	return NULL;
+	return 0;
 }
 
+/*
+ * With O_DIRECT the file is written by a writer thread per stream, so
+ * that reading the socket and writing the disk overlap. Packets are
+ * read to a pool of aligned buffers, one per queued write; adjacent
+ * writes found queued at once are done by a single pwritev().
+ */
+#define PCOPY_WR_SIZE		16
 
-int ploop_copy_init(struct ploop_disk_images_data *di,
-		struct ploop_copy_param *param,
-		struct ploop_copy_handle **h)
+typedef enum {
+	PCOPY_WR_DATA,
+	PCOPY_WR_HOLE,
+	PCOPY_WR_EXIT,
+} pcopy_wr_type_t;
+
+struct pcopy_wr {
+	pcopy_wr_type_t type;
+	__u64 len;
+	off_t pos;
+};
+
+struct pcopy_writer {
+	struct pcopy_wr q[PCOPY_WR_SIZE];
+	void *buf[PCOPY_WR_SIZE];	/* of each queued write */
+	__u32 bufsize[PCOPY_WR_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	sem_t free;
+	sem_t queued;
+	struct pcopy_receiver *r;
+	pthread_t th;
+	int ret;		/* the first write error */
+	off_t err_pos;
+};
+
+/* O_DIRECT needs the buffer, position and length aligned */
+static int is_direct_wr(const struct pcopy_wr *e)
 {
-	int ret, err;
-	int blocksize;
-	char *image = NULL;
-	char *format = NULL;
-	char device[64];
-	char partdev[64];
-	struct ploop_copy_handle  *_h = NULL;
-	int is_remote;
-	char mnt[PATH_MAX] = "";
+	return e->type == PCOPY_WR_DATA && e->pos % 4096 == 0 &&
+		e->len % 4096 == 0;
+}
 
-	is_remote = is_fd_socket(param->ofd);
-	if (is_remote < 0) {
-		ploop_err(0, "Invalid output fd %d: must be a file, "
-				"a pipe or a socket", param->ofd);
-		return SYSEXIT_PARAM;
+static int write_iov(int fd, struct iovec *iov, int n, __u64 len, off_t pos)
+{
+	ssize_t ret;
+
+	ret = TEMP_FAILURE_RETRY(pwritev(fd, iov, n, pos));
+	if (ret != len) {
+		if (ret < 0)
+			ploop_err(errno, "Error in pwritev");
+		else
+			ploop_err(0, "Error: short pwritev");
+		return SYSEXIT_WRITE;
 	}
 
-	if (param->ofd == STDOUT_FILENO)
-		ploop_set_verbose_level(PLOOP_LOG_NOSTDOUT);
-	else if (param->ofd == STDERR_FILENO)
-		ploop_set_verbose_level(PLOOP_LOG_NOCONSOLE);
+	return 0;
+}
 
-	if (ploop_lock_dd(di))
-		return SYSEXIT_LOCK;
+static void *writer_thread(void *data)
+{
+	struct pcopy_writer *w = data;
+	struct pcopy_receiver *r = w->r;
+	struct iovec iov[PCOPY_WR_SIZE];
+	struct pcopy_wr *e, *x;
+	int i, n, next = 0, ret;
+	__u64 len;
 
-	if (ploop_find_dev_by_dd(di, device, sizeof(device))) {
-		ploop_err(0, "Can't find running ploop device");
-		ret = SYSEXIT_SYS;
-		goto err;
-	}
+	for (;;) {
+		if (!next)
+			sem_wait_nointr(&w->queued);
+		next = 0;
 
-	ret = get_image_info(device, &image, &format, &blocksize);
-	if (ret)
-		goto err;
+		i = w->tail % PCOPY_WR_SIZE;
+		e = &w->q[i];
+		if (e->type == PCOPY_WR_EXIT)
+			break;
 
+		n = 1;
+		ret = 0;
+		if (is_direct_wr(e)) {
+			iov[0].iov_base = w->buf[i];
+			iov[0].iov_len = e->len;
+			len = e->len;
+			/* take the adjacent writes queued by now */
+			while (n < PCOPY_WR_SIZE && sem_trywait(&w->queued) == 0) {
+				i = (w->tail + n) % PCOPY_WR_SIZE;
+				x = &w->q[i];
+				if (!is_direct_wr(x) || x->pos != e->pos + len) {
+					next = 1;
+					break;
+				}
+				iov[n].iov_base = w->buf[i];
+				iov[n].iov_len = x->len;
+				len += x->len;
+				n++;
+			}
+			ploop_dbg(4, "WRITE size=%llu pos=%llu segs=%d",
+					len, (unsigned long long)e->pos, n);
+			if (w->ret == 0)
+				ret = write_iov(r->dfd, iov, n, len, e->pos);
+		} else if (w->ret == 0) {
+			if (e->type == PCOPY_WR_DATA)
+				ret = write_data(r->ofd, w->buf[i], e->len, e->pos);
+			else
+				ret = write_hole(r->ofd, e->len, e->pos,
+						&r->hole_end);
+		}
+		/* after an error the rest is dropped, the reader bails out */
+		if (ret && w->ret == 0) {
+			w->err_pos = e->pos;
+			w->ret = ret;
+		}
 
-	_h = alloc_ploop_copy_handle(S2B(blocksize));
-	if (_h == NULL) {
-		ploop_err(0, "alloc_ploop_copy_handle");
-		ret = SYSEXIT_MALLOC;
-		goto err;
+		for (i = 0; i < n; i++) {
+			w->tail++;
+			sem_post(&w->free);
+		}
 	}
 
-	_h->raw = strcmp(format, "raw") == 0;
-	_h->ofd = param->ofd;
-	_h->is_remote = is_remote;
-	_h->async = param->async;
+	return NULL;
+}
 
-	_h->devfd = open(device, O_RDONLY|O_CLOEXEC);
-	if (_h->devfd == -1) {
-		ploop_err(errno, "Can't open device %s", device);
-		ret = SYSEXIT_DEVICE;
-		goto err;
+/* Get the next write queue entry and its buffer for len bytes */
+static int wr_reserve(struct pcopy_writer *w, __u32 len, void **buf)
+{
+	unsigned int i;
+
+	sem_wait_nointr(&w->free);
+
+	i = w->head % PCOPY_WR_SIZE;
+	if (w->bufsize[i] < len) {
+		free(w->buf[i]);
+		w->buf[i] = NULL;
+		w->bufsize[i] = 0;
+		if (p_memalign(&w->buf[i], 4096, len)) {
+			sem_post(&w->free);
+			return SYSEXIT_MALLOC;
+		}
+		w->bufsize[i] = len;
 	}
+	if (buf != NULL)
+		*buf = w->buf[i];
 
-	ret = get_partition_device_name(device, partdev, sizeof(partdev));
-	if (ret)
-		goto err;
+	return 0;
+}
 
-	_h->partfd = open(partdev, O_RDONLY|O_CLOEXEC);
-	if (_h->partfd == -1) {
-		ploop_err(errno, "Can't open device %s", partdev);
-		ret = SYSEXIT_DEVICE;
-		goto err;
-	}
+static void wr_queue(struct pcopy_writer *w, pcopy_wr_type_t type,
+		__u64 len, off_t pos)
+{
+	struct pcopy_wr *e = &w->q[w->head % PCOPY_WR_SIZE];
 
-	ret = SYSEXIT_OPEN;
-	err = ploop_get_mnt_by_dev(device, mnt, sizeof(mnt));
+	e->type = type;
+	e->len = len;
+	e->pos = pos;
+	w->head++;
+
+	sem_post(&w->queued);
+}
+
+/* Wait till all the queued writes are done */
+static int wr_drain(struct pcopy_writer *w, __u64 *pos)
+{
+	int i;
+
+	for (i = 0; i < PCOPY_WR_SIZE; i++)
+		sem_wait_nointr(&w->free);
+	for (i = 0; i < PCOPY_WR_SIZE; i++)
+		sem_post(&w->free);
+
+	if (w->ret)
+		*pos = w->err_pos;
+
+	return w->ret;
+}
+
+static struct pcopy_writer *wr_start(struct pcopy_receiver *r)
+{
+	struct pcopy_writer *w;
+	int ret;
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL) {
+		ploop_err(ENOMEM, "wr_start");
+		return NULL;
+	}
+
+	w->r = r;
+	sem_init(&w->free, 0, PCOPY_WR_SIZE);
+	sem_init(&w->queued, 0, 0);
+
+	ret = pthread_create(&w->th, NULL, writer_thread, w);
+	if (ret) {
+		ploop_err(ret, "Can't create writer thread");
+		sem_destroy(&w->free);
+		sem_destroy(&w->queued);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+static void wr_stop(struct pcopy_writer *w)
+{
+	int i;
+
+	/* the writes queued are done first */
+	sem_wait_nointr(&w->free);
+	wr_queue(w, PCOPY_WR_EXIT, 0, 0);
+	pthread_join(w->th, NULL);
+
+	sem_destroy(&w->free);
+	sem_destroy(&w->queued);
+	for (i = 0; i < PCOPY_WR_SIZE; i++)
+		free(w->buf[i]);
+	free(w);
+}
+
+/* Read the data of a packet to the write queue */
+static int wr_data(struct pcopy_receiver *r, __u32 len, off_t pos)
+{
+	void *buf;
+	int ret;
+
+	ret = wr_reserve(r->wr, len, &buf);
+	if (ret)
+		return ret;
+
+	if (nread(r->ifd, buf, len)) {
+		sem_post(&r->wr->free);
+		ploop_err(errno, "Error in nread data");
+		return SYSEXIT_READ;
+	}
+	wr_queue(r->wr, PCOPY_WR_DATA, len, pos);
+
+	return 0;
+}
+
+/*
+ * Compaction: the image is received to a fresh ploop1 layout instead
+ * of the sender's one. Once the whole index area is received, the data
+ * clusters it refers to are given clusters of the file in the logical
+ * order, one after another; clusters appearing later go to the end.
+ * The index is written with the new offsets, as is the dirty bitmap
+ * of the format extension. The state is shared by all the streams.
+ */
+enum {
+	PCOPY_REMAP_NOHDR,	/* waiting for the header */
+	PCOPY_REMAP_INDEX,	/* receiving the index area */
+	PCOPY_REMAP_READY,	/* the index is written, data is mapped */
+};
+
+struct pcopy_remap {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int state;
+	int failed;		/* a stream has failed, the rest bail out */
+	int ofd;
+	int version;
+	__u32 blocksize;	/* sectors */
+	__u64 cluster;
+	__u64 data_off;		/* the index area size */
+	void *idx;		/* the sender's index area */
+	void *out;		/* the index area as written */
+	void *ext;		/* the format extension block as written */
+	__u64 ext_sec;		/* where, 0 - none */
+	__u64 *ext_clu;		/* our clusters it refers to */
+	__u32 next_clu;
+	__u32 *got;		/* index clusters received */
+	__u64 missing;		/* and not received yet */
+	__u32 *map;		/* the sender's cluster to ours, 0 - none */
+	__u64 mapsize;
+	__u64 first;		/* the first data cluster */
+	__u64 next;		/* the next cluster to be given */
+};
+
+static struct pcopy_remap *remap_create(int ofd)
+{
+	struct pcopy_remap *m;
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL) {
+		ploop_err(ENOMEM, "remap_create");
+		return NULL;
+	}
+
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->cond, NULL);
+	m->ofd = ofd;
+
+	return m;
+}
+
+static void remap_destroy(struct pcopy_remap *m)
+{
+	if (m == NULL)
+		return;
+
+	pthread_mutex_destroy(&m->lock);
+	pthread_cond_destroy(&m->cond);
+	free(m->idx);
+	free(m->out);
+	free(m->ext);
+	free(m->ext_clu);
+	free(m->got);
+	free(m->map);
+	free(m);
+}
+
+/* Wake up the streams waiting for the index, the transfer has failed */
+static void remap_abort(struct pcopy_remap *m)
+{
+	pthread_mutex_lock(&m->lock);
+	m->failed = 1;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+}
+
+/* Called with the lock held */
+static int remap_wait(struct pcopy_remap *m, int state)
+{
+	while (m->state < state && !m->failed)
+		pthread_cond_wait(&m->cond, &m->lock);
+
+	/* aborted by a failed stream, as if its socket was shut down */
+	return m->failed ? SYSEXIT_READ : 0;
+}
+
+/* Get our cluster for the sender's one, it is given if there is none */
+static int remap_get(struct pcopy_remap *m, __u64 clu, __u64 *out)
+{
+	__u64 size;
+	__u32 *map;
+
+	/* the index area is where it was */
+	if (clu < m->first) {
+		*out = clu;
+		return 0;
+	}
+
+	if (clu >= m->mapsize) {
+		for (size = m->mapsize ? m->mapsize : 1024; size <= clu; )
+			size *= 2;
+		map = realloc(m->map, size * sizeof(__u32));
+		if (map == NULL) {
+			ploop_err(ENOMEM, "remap_get");
+			return SYSEXIT_MALLOC;
+		}
+		memset(map + m->mapsize, 0, (size - m->mapsize) * sizeof(__u32));
+		m->map = map;
+		m->mapsize = size;
+	}
+
+	if (m->map[clu] == 0) {
+		if (m->next > UINT_MAX) {
+			ploop_err(0, "Can't compact: the image is too big");
+			return SYSEXIT_PARAM;
+		}
+		m->map[clu] = m->next++;
+	}
+	*out = m->map[clu];
+
+	return 0;
+}
+
+/* Translate an offset in sectors, cluster aligned or not */
+static int remap_sec(struct pcopy_remap *m, __u64 *sec)
+{
+	__u64 clu;
+	int ret;
+
+	ret = remap_get(m, S2B(*sec) / m->cluster, &clu);
+	if (ret)
+		return ret;
+
+	*sec = clu * m->blocksize + *sec % m->blocksize;
+
+	return 0;
+}
+
+/* Copy the part of the field at off which is in the range */
+static void patch_range(void *buf, __u64 len, __u64 pos,
+		const void *field, __u64 size, __u64 off)
+{
+	__u64 start = MAX(pos, off), end = MIN(pos + len, off + size);
+
+	if (start < end)
+		memcpy((char *)buf + (start - pos),
+				(const char *)field + (start - off), end - start);
+}
+
+/* Make the range of the index area as it is written to m->out */
+static int remap_xlat(struct pcopy_remap *m, __u64 len, __u64 pos)
+{
+	struct ploop_pvd_header *vh = m->idx;
+	__u64 off, sec;
+	__u32 v;
+	int ret;
+
+	memcpy((char *)m->out + pos, (char *)m->idx + pos, len);
+
+	for (off = MAX(pos & ~3ULL, sizeof(*vh)); off < pos + len; off += 4) {
+		v = *(__u32 *)((char *)m->idx + off);
+		if (v == 0)
+			continue;
+
+		sec = ploop_ioff_to_sec(v, m->blocksize, m->version);
+		ret = remap_sec(m, &sec);
+		if (ret)
+			return ret;
+		v = ploop_sec_to_ioff(sec, m->blocksize, m->version);
+		patch_range((char *)m->out + pos, len, pos, &v, sizeof(v), off);
+	}
+
+	if (pos < sizeof(*vh) && vh->m_FormatExtensionOffset) {
+		sec = vh->m_FormatExtensionOffset;
+		ret = remap_sec(m, &sec);
+		if (ret)
+			return ret;
+		patch_range((char *)m->out + pos, len, pos, &sec, sizeof(sec),
+			offsetof(struct ploop_pvd_header, m_FormatExtensionOffset));
+	}
+
+	return 0;
+}
+
+/* The first packet, the image header: learn the image geometry */
+static int remap_init(struct pcopy_remap *m, const void *buf, __u64 len)
+{
+	struct ploop_pvd_header *vh = (struct ploop_pvd_header *)buf;
+
+	if (buf == NULL || len < sizeof(*vh) ||
+			ploop1_version(vh) == PLOOP_FMT_ERROR) {
+		ploop_err(0, "Can't compact: the image is not in ploop1 format");
+		return SYSEXIT_PARAM;
+	}
+
+	m->version = ploop1_version(vh);
+	m->blocksize = vh->m_Sectors;
+	m->cluster = S2B(m->blocksize);
+	m->data_off = S2B(vh->m_FirstBlockOffset);
+	if (m->blocksize == 0 || m->data_off < sizeof(*vh) ||
+			m->data_off % m->cluster) {
+		ploop_err(0, "Can't compact: invalid image header");
+		return SYSEXIT_PROTOCOL;
+	}
+
+	m->first = m->next = m->missing = m->data_off / m->cluster;
+	m->idx = calloc(1, m->data_off);
+	m->out = malloc(m->data_off);
+	m->got = calloc(1, BMAP_SZ(m->first));
+	if (m->idx == NULL || m->out == NULL || m->got == NULL) {
+		ploop_err(ENOMEM, "remap_init");
+		return SYSEXIT_MALLOC;
+	}
+
+	ploop_log(0, "Compacting the image: blocksize=%u index=%llu",
+			m->blocksize, (unsigned long long)m->data_off);
+	m->state = PCOPY_REMAP_INDEX;
+	pthread_cond_broadcast(&m->cond);
+
+	return 0;
+}
+
+/* Write to the index area, NULL is zero data. Called with the lock held */
+static int remap_index(struct pcopy_remap *m, const void *buf, __u64 len,
+		__u64 pos)
+{
+	__u64 clu, end = pos + len;
+	int ret;
+
+	if (buf != NULL)
+		memcpy((char *)m->idx + pos, buf, len);
+	else
+		memset((char *)m->idx + pos, 0, len);
+
+	if (m->state == PCOPY_REMAP_READY) {
+		ret = remap_xlat(m, len, pos);
+		if (ret)
+			return ret;
+		return write_data(m->ofd, (char *)m->out + pos, len, pos);
+	}
+
+	for (clu = pos / m->cluster; clu * m->cluster < end; clu++) {
+		if (clu * m->cluster < pos || (clu + 1) * m->cluster > end ||
+				BMAP_GET(m->got, clu))
+			continue;
+		BMAP_SET(m->got, clu);
+		m->missing--;
+	}
+	if (m->missing)
+		return 0;
+
+	/* the data clusters are laid out in the order of the index */
+	ret = remap_xlat(m, m->data_off - sizeof(struct ploop_pvd_header),
+			sizeof(struct ploop_pvd_header));
+	if (ret == 0)
+		ret = remap_xlat(m, sizeof(struct ploop_pvd_header), 0);
+	if (ret == 0)
+		ret = write_data(m->ofd, m->out, m->data_off, 0);
+	if (ret)
+		return ret;
+
+	ploop_log(3, "Compacting: %llu data clusters in the index",
+			(unsigned long long)(m->next - m->first));
+	m->state = PCOPY_REMAP_READY;
+	pthread_cond_broadcast(&m->cond);
+
+	return 0;
+}
+
+/*
+ * The format extension block keeps the offsets of the dirty bitmap,
+ * they are translated and the block is written. Returns 1 if it has
+ * been, 0 if the packet is not the block. Called with the lock held.
+ */
+static int remap_ext(struct pcopy_remap *m, const void *buf, __u64 len,
+		__u64 pos)
+{
+	struct ploop_pvd_header *vh = m->idx;
+	struct ploop_pvd_ext_block_check *hc;
+	struct ploop_pvd_ext_block_element_header *h;
+	struct ploop_pvd_dirty_bitmap_raw *raw;
+	__u8 *data, *end;
+	__u64 *p, *clu, sec;
+	int ret;
+
+	if (vh->m_FormatExtensionOffset == 0 || len != m->cluster ||
+			pos != S2B(vh->m_FormatExtensionOffset) ||
+			pos % m->cluster)
+		return 0;
+
+	if (m->ext == NULL && p_memalign(&m->ext, 4096, m->cluster))
+		return SYSEXIT_MALLOC;
+	memcpy(m->ext, buf, len);
+	end = (__u8 *)m->ext + len;
+
+	hc = m->ext;
+	if (hc->m_Magic != FORMAT_EXTENSION_MAGIC)
+		return 0;
+	m->ext_sec = 0;
+	m->next_clu = 0;
+
+	for (h = (void *)(hc + 1); ; h = (void *)(data + h->size)) {
+		data = (__u8 *)(h + 1);
+		if (data > end || data + h->size > end) {
+			ploop_err(0, "Can't compact: spoiled format extension");
+			return SYSEXIT_PROTOCOL;
+		}
+		if (h->magic == 0)
+			break;
+		if (h->magic != EXT_MAGIC_DIRTY_BITMAP)
+			continue;
+
+		raw = (void *)data;
+		if (sizeof(*raw) > h->size || sizeof(*raw) +
+				(__u64)raw->m_L1Size * sizeof(*p) > h->size) {
+			ploop_err(0, "Can't compact: spoiled dirty bitmap");
+			return SYSEXIT_PROTOCOL;
+		}
+		clu = realloc(m->ext_clu, (m->next_clu + raw->m_L1Size) *
+				sizeof(*clu));
+		if (clu == NULL) {
+			ploop_err(ENOMEM, "remap_ext");
+			return SYSEXIT_MALLOC;
+		}
+		m->ext_clu = clu;
+		/* 0 and 1 stand for a slice of all zeroes or ones */
+		for (p = raw->m_L1; p < raw->m_L1 + raw->m_L1Size; p++) {
+			if (*p <= 1)
+				continue;
+			sec = *p;
+			ret = remap_sec(m, &sec);
+			if (ret)
+				return ret;
+			*p = sec;
+			m->ext_clu[m->next_clu++] = sec / m->blocksize;
+		}
+	}
+	MD5((const unsigned char *)(hc + 1), len - sizeof(*hc), hc->m_Md5);
+
+	sec = vh->m_FormatExtensionOffset;
+	ret = remap_sec(m, &sec);
+	if (ret)
+		return ret;
+	ret = write_data(m->ofd, m->ext, len, S2B(sec));
+	if (ret)
+		return ret;
+	m->ext_sec = sec;
+
+	return 1;
+}
+
+/*
+ * Write the data of a packet to where it is mapped, NULL is zero data:
+ * the clusters not mapped are left as they are.
+ */
+static int remap_write(struct pcopy_remap *m, const void *buf, __u64 len,
+		__u64 pos, __u64 *hole_end)
+{
+	__u64 n, clu, dst;
+	int ret;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->state == PCOPY_REMAP_NOHDR && pos == 0)
+		ret = remap_init(m, buf, len);
+	else
+		ret = remap_wait(m, PCOPY_REMAP_INDEX);
+	if (ret == 0 && pos < m->data_off) {
+		n = MIN(len, m->data_off - pos);
+		ret = remap_index(m, buf, n, pos);
+		if (buf != NULL)
+			buf = (const char *)buf + n;
+		pos += n;
+		len -= n;
+	}
+	if (ret == 0 && len)
+		ret = remap_wait(m, PCOPY_REMAP_READY);
+	if (ret == 0 && len && buf != NULL) {
+		ret = remap_ext(m, buf, len, pos);
+		if (ret == 1)
+			ret = len = 0;
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	for (; ret == 0 && len; len -= n, pos += n) {
+		clu = pos / m->cluster;
+		n = MIN(len, (clu + 1) * m->cluster - pos);
+
+		pthread_mutex_lock(&m->lock);
+		if (buf != NULL)
+			ret = remap_get(m, clu, &dst);
+		else
+			dst = clu < m->mapsize ? m->map[clu] : 0;
+		pthread_mutex_unlock(&m->lock);
+		if (ret)
+			break;
+
+		dst = dst * m->cluster + pos % m->cluster;
+		if (buf != NULL) {
+			ret = write_data(m->ofd, buf, n, dst);
+			buf = (const char *)buf + n;
+		} else if (dst >= m->data_off)
+			ret = write_hole(m->ofd, n, dst, hole_end);
+	}
+
+	return ret;
+}
+
+/* The clusters past the end are dropped */
+static int remap_truncate(struct pcopy_remap *m, __u64 size)
+{
+	__u64 clu, hole_end = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&m->lock);
+	for (clu = MAX((size + m->cluster - 1) / m->cluster, m->first);
+			ret == 0 && clu < m->mapsize; clu++) {
+		if (m->map[clu] == 0)
+			continue;
+		ret = write_hole(m->ofd, m->cluster, m->map[clu] * m->cluster,
+				&hole_end);
+		m->map[clu] = 0;
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	return ret;
+}
+
+/*
+ * Find our clusters the image refers to in the end: those of the index
+ * and of the format extension, if it is the one written. Returns 0 if
+ * they are not known.
+ */
+static int remap_get_used(struct pcopy_remap *m, __u32 *used)
+{
+	struct ploop_pvd_header *vh = m->out;
+	__u64 off, clu;
+	__u32 i, v;
+
+	for (off = sizeof(*vh); off < m->data_off; off += sizeof(v)) {
+		v = *(__u32 *)((char *)m->out + off);
+		if (v == 0)
+			continue;
+		clu = ploop_ioff_to_sec(v, m->blocksize, m->version) /
+			m->blocksize;
+		if (clu < m->next)
+			BMAP_SET(used, clu);
+	}
+
+	if (vh->m_FormatExtensionOffset == 0)
+		return 1;
+	if (vh->m_FormatExtensionOffset != m->ext_sec)
+		return 0;
+
+	BMAP_SET(used, m->ext_sec / m->blocksize);
+	for (i = 0; i < m->next_clu; i++)
+		if (m->ext_clu[i] < m->next)
+			BMAP_SET(used, m->ext_clu[i]);
+
+	return 1;
+}
+
+/*
+ * Drop the clusters the image does not refer to in the end, written
+ * while the index was changing, and set the size of the file
+ */
+static int remap_finish(struct pcopy_remap *m)
+{
+	__u64 clu, dst, end = m->first, n = 0, dropped = 0, hole_end = 0;
+	__u32 *used;
+	int ret = 0;
+
+	if (m->state != PCOPY_REMAP_READY) {
+		ploop_err(0, "Can't compact: the image index is not received");
+		return SYSEXIT_PROTOCOL;
+	}
+
+	used = calloc(1, BMAP_SZ(m->next));
+	if (used == NULL) {
+		ploop_err(ENOMEM, "remap_finish");
+		return SYSEXIT_MALLOC;
+	}
+	if (!remap_get_used(m, used))
+		memset(used, 0xff, BMAP_SZ(m->next));
+
+	for (clu = m->first; clu < m->mapsize; clu++) {
+		dst = m->map[clu];
+		if (dst == 0)
+			continue;
+		if (!BMAP_GET(used, dst)) {
+			ret = write_hole(m->ofd, m->cluster, dst * m->cluster,
+					&hole_end);
+			if (ret)
+				goto out;
+			dropped++;
+			continue;
+		}
+		n++;
+		if (dst + 1 > end)
+			end = dst + 1;
+	}
+
+	if (ftruncate(m->ofd, end * m->cluster)) {
+		ploop_err(errno, "Can't truncate to %llu",
+				(unsigned long long)(end * m->cluster));
+		ret = SYSEXIT_WRITE;
+		goto out;
+	}
+
+	ploop_log(0, "Compacted: %llu data clusters, %llu dropped",
+			(unsigned long long)n, (unsigned long long)dropped);
+out:
+	free(used);
+
+	return ret;
+}
+
+/* Receive a single stream until the end of data packet */
+static int receive_stream(struct pcopy_receiver *r)
+{
+	int ret, win = 0;
+	__u64 cluster = 0;
+	void *iobuf = NULL;
+	__u32 zsize = 0, len;
+	void *zbuf = NULL;
+	unsigned char *hash = NULL;
+	__u64 nhash = 0, end;
+	struct pcopy_pkt_desc desc;
+	int spliced, staged;
+	void *buf;
+
+	if (r->dfd != -1) {
+		r->wr = wr_start(r);
+		if (r->wr == NULL)
+			return SYSEXIT_SYS;
+	}
+
+	for (;;) {
+		win = 0;
+		if (nread(r->ifd, &desc, sizeof(desc)) < 0) {
+			ploop_err(errno, "Error in nread(desc)");
+			ret = SYSEXIT_READ;
+			goto out;
+		}
+
+		if (desc.marker != PCOPY_MARKER) {
+			ploop_err(0, "Stream corrupted");
+			ret = SYSEXIT_PROTOCOL;
+			goto out;
+		}
+
+		/* doubled, so that it is not reallocated time and again */
+		if (desc.size > cluster) {
+			free(iobuf);
+			iobuf = NULL;
+			while (cluster < desc.size)
+				cluster = cluster ? cluster * 2 : 4096;
+			if (p_memalign(&iobuf, 4096, cluster)) {
+				ret = SYSEXIT_MALLOC;
+				goto out;
+			}
+		}
+
+		if (desc.size == 0)
+			break;
+
+		/*
+		 * Data is moved from the socket to the file as it is, or
+		 * read right to the write queue.
+		 */
+		staged = r->wr != NULL && (desc.type == PCOPY_PKT_DATA ||
+				desc.type == PCOPY_PKT_DATA_ASYNC);
+		spliced = !r->nosplice && (desc.type == PCOPY_PKT_DATA ||
+				desc.type == PCOPY_PKT_DATA_ASYNC);
+		if (!spliced && !staged && nread(r->ifd, iobuf, desc.size)) {
+			ploop_err(errno, "Error in nread data");
+			ret = SYSEXIT_READ;
+			goto out;
+		}
+
+		win = r->window && desc.type != PCOPY_PKT_CMD &&
+			!is_async_pkt(desc.type);
+		if (win)
+			r->rcvd++;
+
+		ploop_log(3, "RCV fd=%d type=%d len=%d pos=%" PRIu64,
+				r->ifd, desc.type, desc.size, (uint64_t)desc.pos);
+		ret = 0;
+		end = 0;
+		switch (desc.type) {
+		case PCOPY_PKT_DATA:
+		case PCOPY_PKT_DATA_ASYNC:
+			if (staged)
+				ret = wr_data(r, desc.size, desc.pos);
+			else if (spliced)
+				ret = splice_data(r, iobuf, desc.size, desc.pos);
+			else if (r->remap != NULL)
+				ret = remap_write(r->remap, iobuf, desc.size,
+						desc.pos, &r->hole_end);
+			else
+				ret = write_data(r->ofd, iobuf, desc.size, desc.pos);
+			if (ret)
+				goto out;
+			end = desc.pos + desc.size;
+			break;
+		case PCOPY_PKT_ZDATA:
+		case PCOPY_PKT_ZDATA_ASYNC:
+			len = zblock_get_size(iobuf, desc.size);
+			if (len == 0) {
+				ploop_err(0, "Stream corrupted: invalid compressed block");
+				ret = SYSEXIT_PROTOCOL;
+				goto out;
+			}
+			if (r->wr != NULL) {
+				ret = wr_reserve(r->wr, len, &buf);
+				if (ret)
+					goto out;
+				ret = zblock_decompress(iobuf, desc.size, buf, len);
+				if (ret) {
+					sem_post(&r->wr->free);
+					goto out;
+				}
+				wr_queue(r->wr, PCOPY_WR_DATA, len, desc.pos);
+				end = desc.pos + len;
+				break;
+			}
+			if (len > zsize) {
+				free(zbuf);
+				zbuf = NULL;
+				zsize = len;
+				if (p_memalign(&zbuf, 4096, zsize)) {
+					ret = SYSEXIT_MALLOC;
+					goto out;
+				}
+			}
+			ret = zblock_decompress(iobuf, desc.size, zbuf, len);
+			if (ret)
+				goto out;
+			if (r->remap != NULL)
+				ret = remap_write(r->remap, zbuf, len, desc.pos,
+						&r->hole_end);
+			else
+				ret = write_data(r->ofd, zbuf, len, desc.pos);
+			if (ret)
+				goto out;
+			end = desc.pos + len;
+			break;
+		case PCOPY_PKT_HOLE:
+		case PCOPY_PKT_HOLE_ASYNC:
+		case PCOPY_PKT_ZERO:
+		case PCOPY_PKT_ZERO_ASYNC:
+			/* zero data is written as a hole */
+			if (desc.size != sizeof(__u64)) {
+				ploop_err(0, "Stream corrupted: hole size %u",
+						desc.size);
+				ret = SYSEXIT_PROTOCOL;
+				goto out;
+			}
+			if (r->wr != NULL) {
+				/* ordered with the writes queued */
+				ret = wr_reserve(r->wr, 0, NULL);
+				if (ret)
+					goto out;
+				wr_queue(r->wr, PCOPY_WR_HOLE,
+						*(__u64 *)iobuf, desc.pos);
+			} else if (r->remap != NULL)
+				ret = remap_write(r->remap, NULL, *(__u64 *)iobuf,
+						desc.pos, &r->hole_end);
+			else
+				ret = write_hole(r->ofd, *(__u64 *)iobuf,
+						desc.pos, &r->hole_end);
+			if (ret)
+				goto out;
+			end = desc.pos + *(__u64 *)iobuf;
+			break;
+		case PCOPY_PKT_CMD: {
+			unsigned int cmd = ((unsigned int *) iobuf)[0];
+
+			/* commands see the file written */
+			if (r->wr != NULL) {
+				ret = wr_drain(r->wr, &desc.pos);
+				if (ret)
+					goto out;
+			}
+
+			switch(cmd) {
+			case PCOPY_CMD_SYNC:
+				/* the file is synced once the transfer is over */
+				ret = start_writeback(r->ofd);
+				if (ret)
+					goto out;
+				break;
+			case PCOPY_CMD_COMPRESS:
+				if (desc.size < 2 * sizeof(unsigned int) ||
+						!codec_supported(((unsigned int *)iobuf)[1])) {
+					ploop_log(0, "Compression is not supported");
+					ret = SYSEXIT_PARAM;
+				}
+				break;
+			case PCOPY_CMD_WINDOW:
+				if (desc.size < 2 * sizeof(unsigned int) ||
+						((unsigned int *)iobuf)[1] == 0) {
+					ploop_err(0, "Invalid window");
+					ret = SYSEXIT_PARAM;
+					break;
+				}
+				r->window = ((unsigned int *)iobuf)[1];
+				break;
+			case PCOPY_CMD_HASH:
+				if (!r->resume) {
+					ploop_log(0, "No data to resume the copy from");
+					ret = SYSEXIT_PARAM;
+					break;
+				}
+				len = desc.size < 2 * sizeof(unsigned int) ? 0 :
+					((unsigned int *)iobuf)[1];
+				if (len == 0 || len % SECTOR_SIZE) {
+					ploop_err(0, "Invalid cluster size %u", len);
+					ret = SYSEXIT_PARAM;
+					break;
+				}
+				ret = hash_file(r->ofd, len, &hash, &nhash);
+				if (ret)
+					goto out;
+				r->hashed = 1;
+				ploop_log(0, "Resume: %llu clusters hashed",
+						(unsigned long long)nhash);
+				break;
+			case PCOPY_CMD_HOLE:
+				break;
+			case PCOPY_CMD_TRUNCATE:
+				/* the file is sized once the transfer is over */
+				if (r->remap != NULL) {
+					ret = remap_truncate(r->remap, desc.pos);
+					if (ret)
+						goto out;
+					break;
+				}
+				if (ftruncate(r->ofd, desc.pos)) {
+					ploop_err(errno, "Can't truncate to %llu",
+						(unsigned long long)desc.pos);
+					ret = SYSEXIT_WRITE;
+					goto out;
+				}
+				break;
+			default:
+				ploop_err(0, "ploop_copy_receiver: unsupported command %d",
+						cmd);
+				ret = SYSEXIT_PARAM;
+			}
+			break;
+		}
+		default:
+			ploop_err(0, "ploop_copy_receiver: unsupported command type%d",
+						desc.type);
+			ret = SYSEXIT_PARAM;
+			break;
+		}
+
+		/* a queued write has failed */
+		if (r->wr != NULL && r->wr->ret) {
+			ret = r->wr->ret;
+			desc.pos = r->wr->err_pos;
+			goto out;
+		}
+
+		if (end > r->data_end)
+			r->data_end = end;
+
+		if (win) {
+			if (ret)
+				goto out;
+			ret = ack_window(r);
+			if (ret)
+				goto out;
+			continue;
+		}
+
+		/* send reply */
+		if (!is_async_pkt(desc.type) &&
+				nwrite(r->ifd, &ret, sizeof(int))) {
+			ret = SYSEXIT_WRITE;
+			ploop_err(errno, "failed to send reply");
+			goto out;
+		}
+
+		/* the hash list follows the reply */
+		if (desc.type == PCOPY_PKT_CMD &&
+				((unsigned int *)iobuf)[0] == PCOPY_CMD_HASH &&
+				ret == 0) {
+			ret = send_hashes(r->ifd, hash, nhash);
+			free(hash);
+			hash = NULL;
+			if (ret)
+				goto out;
+		}
+	}
+	ret = r->wr != NULL ? wr_drain(r->wr, &desc.pos) : 0;
+
+out:
+	/* report the failed packet to the sender */
+	if (ret && win)
+		send_ack(r, ret, desc.pos);
+	if (ret && r->remap != NULL)
+		remap_abort(r->remap);
+	if (r->wr != NULL) {
+		wr_stop(r->wr);
+		r->wr = NULL;
+	}
+	free(iobuf);
+	free(zbuf);
+	free(hash);
+	if (r->pipe[0] != -1) {
+		close(r->pipe[0]);
+		close(r->pipe[1]);
+		r->pipe[0] = r->pipe[1] = -1;
+	}
+
+	return ret;
+}
+
+static void *receiver_thread(void *data)
+{
+	struct pcopy_receiver *r = data;
+	int i;
+
+	r->ret = receive_stream(r);
+	/* abort the other streams, the transfer has failed */
+	if (r->ret)
+		for (i = 0; i < r->nstreams; i++)
+			shutdown(r->all[i].ifd, SHUT_RDWR);
+
+	return NULL;
+}
+
+int ploop_copy_receiver(struct ploop_copy_receive_param *arg)
+{
+	int ofd, dfd = -1, ret, i, n;
+	struct pcopy_receiver *r;
+	struct pcopy_remap *remap = NULL;
+	__u64 hole_end = 0, data_end = 0;
+	struct stat st;
+
+	if (!arg)
+		return SYSEXIT_PARAM;
+
+	if (arg->nifds < 0 || (arg->nifds > 0 && arg->ifds == NULL)) {
+		ploop_err(0, "Invalid number of input streams %d", arg->nifds);
+		return SYSEXIT_PARAM;
+	}
+
+	/* the layout differs, the file kept can not be compared */
+	if (arg->compact && arg->resume) {
+		ploop_err(0, "A compacted copy can not be resumed");
+		return SYSEXIT_PARAM;
+	}
+
+	for (i = -1; i < arg->nifds; i++) {
+		int fd = i < 0 ? arg->ifd : arg->ifds[i];
+
+		if (is_fd_socket(fd) != 1) {
+			ploop_err(errno, "Invalid input fd %d: must be "
+					"a pipe or a socket", fd);
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	n = 1 + arg->nifds;
+	r = calloc(n, sizeof(*r));
+	if (r == NULL) {
+		ploop_err(ENOMEM, "ploop_copy_receiver");
+		return SYSEXIT_MALLOC;
+	}
+
+	/* on resume the data received is kept even if the copy fails */
+	ofd = open(arg->file, arg->resume ? O_RDWR|O_CREAT :
+			O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (ofd < 0) {
+		ploop_err(errno, "Can't open %s", arg->file);
+		free(r);
+		return SYSEXIT_CREAT;
+	}
+
+	if (arg->compact) {
+		remap = remap_create(ofd);
+		if (remap == NULL) {
+			ret = SYSEXIT_MALLOC;
+			goto out;
+		}
+		/* data is written to where it is mapped, cluster by cluster */
+		if (arg->direct)
+			ploop_log(1, "Compacting: using buffered writes");
+	} else if (arg->direct) {
+		dfd = open(arg->file, O_WRONLY|O_DIRECT);
+		if (dfd < 0)
+			ploop_log(0, "Can't open %s with O_DIRECT: %m,"
+					" using buffered writes", arg->file);
+	}
+
+	ploop_dbg(3, "RCV start %s streams=%d direct=%d", arg->file, n,
+			dfd != -1);
+	for (i = 0; i < n; i++) {
+		r[i].all = r;
+		r[i].nstreams = n;
+		r[i].ofd = ofd;
+		r[i].ifd = i == 0 ? arg->ifd : arg->ifds[i - 1];
+		r[i].resume = arg->resume;
+		r[i].pipe[0] = r[i].pipe[1] = -1;
+		/* the data is written from the write queue buffers */
+		r[i].dfd = dfd;
+		r[i].remap = remap;
+		r[i].nosplice = dfd != -1 || remap != NULL;
+	}
+
+	for (i = 1; i < n; i++) {
+		ret = pthread_create(&r[i].th, NULL, receiver_thread, &r[i]);
+		if (ret) {
+			ploop_err(ret, "Can't create receiver thread");
+			r[i].ret = SYSEXIT_SYS;
+			break;
+		}
+	}
+
+	ret = receive_stream(&r[0]);
+	if (ret || i != n)
+		for (i = 1; i < n; i++)
+			shutdown(r[i].ifd, SHUT_RDWR);
+
+	for (i = 1; i < n; i++) {
+		if (r[i].th)
+			pthread_join(r[i].th, NULL);
+		/* a stream aborted by a failed one gets a read error */
+		if (!ret || ret == SYSEXIT_READ)
+			ret = r[i].ret ? r[i].ret : ret;
+	}
+	if (ret)
+		goto out;
+
+	/* extend the file now that no stream writes to it */
+	for (i = 0; i < n; i++) {
+		if (r[i].hole_end > hole_end)
+			hole_end = r[i].hole_end;
+		if (r[i].data_end > data_end)
+			data_end = r[i].data_end;
+	}
+	if (fstat(ofd, &st)) {
+		ploop_err(errno, "Can't fstat %s", arg->file);
+		ret = SYSEXIT_FSTAT;
+		goto out;
+	}
+
+	/* the sender has not resumed the copy but sent the whole image */
+	if (arg->resume && !r[0].hashed && data_end < st.st_size &&
+			ftruncate(ofd, data_end)) {
+		ploop_err(errno, "Can't truncate %s to %llu", arg->file,
+				(unsigned long long)data_end);
+		ret = SYSEXIT_WRITE;
+		goto out;
+	}
+	if (hole_end > st.st_size && ftruncate(ofd, hole_end)) {
+		ploop_err(errno, "Can't truncate %s to %llu", arg->file,
+				(unsigned long long)hole_end);
+		ret = SYSEXIT_WRITE;
+		goto out;
+	}
+
+	if (remap != NULL) {
+		ret = remap_finish(remap);
+		if (ret)
+			goto out;
+	}
+
+	ret = data_sync(ofd);
+	if (ret)
+		goto out;
+
+	ploop_dbg(3, "RCV exited");
+	/* send final reply */
+	for (i = 0; i < n; i++) {
+		ret = 0;
+		if (nwrite(r[i].ifd, &ret, sizeof(int))) {
+			ret = SYSEXIT_WRITE;
+			ploop_err(errno, "failed to send reply");
+			goto out;
+		}
+	}
+
+out:
+	remap_destroy(remap);
+	if (dfd != -1)
+		close(dfd);
+	if (close(ofd)) {
+		ploop_err(errno, "Error in close");
+		if (!ret)
+			ret = SYSEXIT_WRITE;
+	}
+	if (ret && !arg->resume)
+		unlink(arg->file);
+	free(r);
+
+	return ret;
+}
+
+static void cancel_sender(void *data)
+{
+	struct ploop_copy_handle *h = (struct ploop_copy_handle *)data;
+
+	h->cancelled = 1;
+}
+
+static int flush_zero(struct ploop_copy_handle *h);
+
+/* Wait till all the queued packets are sent */
+static int wait_sender(struct ploop_copy_handle *h)
+{
+	int i, j, ret;
+
+	ret = flush_zero(h);
+
+	for (i = 0; i < h->nstreams; i++) {
+		struct pcopy_ring *r = &h->streams[i].ring;
+
+		/* the ring is empty once all its slots are free */
+		for (j = 0; j < PCOPY_RING_SIZE; j++)
+			sem_wait_nointr(&r->free);
+		for (j = 0; j < PCOPY_RING_SIZE; j++)
+			sem_post(&r->free);
+
+		if (r->ret && !ret) {
+			ploop_err(r->err_no, "write error");
+			ret = r->ret;
+		}
+
+		/* the sender is idle, collect the acknowledgements */
+		if (!ret)
+			ret = drain_window(&h->streams[i]);
+	}
+
+	return ret;
+}
+
+/* Clusters are striped over the streams */
+static struct pcopy_stream *get_stream(struct ploop_copy_handle *h,
+		__u64 pos)
+{
+	return &h->streams[(pos / h->cluster) % h->nstreams];
+}
+
+/* Check if the receiver has this cluster with the same data already */
+static int is_cluster_matched(struct ploop_copy_handle *h,
+		const void *iobuf, int len, off_t pos)
+{
+	unsigned char hash[PCOPY_HASH_SIZE];
+	__u64 clu = pos / h->cluster;
+
+	if (!h->resume_pass || iobuf == NULL || len != h->cluster ||
+			pos % h->cluster || clu >= h->nrhash)
+		return 0;
+
+	MD5(iobuf, len, hash);
+
+	return !memcmp(hash, h->rhash + clu * PCOPY_HASH_SIZE, PCOPY_HASH_SIZE);
+}
+
+static int send_buf(struct pcopy_stream *s, const void *iobuf, int len, off_t pos)
+{
+	struct ploop_copy_handle *h = s->h;
+	void *zbuf;
+	__u32 zlen;
+
+	if (h->cancelled)
+		return SYSEXIT_WRITE;
+
+	/* hashed in the sender threads, in parallel over the streams */
+	if (is_cluster_matched(h, iobuf, len, pos)) {
+		s->matched += len;
+		return 0;
+	}
+
+	if (s->zpool != NULL && len > 0) {
+		zlen = zpool_compress(s->zpool, iobuf, len, &zbuf);
+		if (zlen)
+			return stream_write(s, h->async ?
+				PCOPY_PKT_ZDATA_ASYNC : PCOPY_PKT_ZDATA,
+				zbuf, zlen, pos);
+	}
+
+	if (h->is_remote)
+		return stream_write(s,
+			h->async ? PCOPY_PKT_DATA_ASYNC : PCOPY_PKT_DATA, iobuf, len, pos);
+	else {
+		__u64 t = now_us();
+		int ret;
+
+		ret = local_write(s->ofd, iobuf, len, pos);
+		s->send_us += now_us() - t;
+		s->send_bytes += len;
+		return ret;
+	}
+}
+
+/* A receiver not taking holes gets the range as zero data */
+static int send_zero_data(struct pcopy_stream *s, __u64 len, off_t pos)
+{
+	struct ploop_copy_handle *h = s->h;
+	int n, ret;
+
+	for (; len > 0; len -= n, pos += n) {
+		n = len < h->cluster ? len : h->cluster;
+		ret = stream_write(s, h->async ? PCOPY_PKT_DATA_ASYNC :
+				PCOPY_PKT_DATA, h->zero_buf, n, pos);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int send_hole(struct pcopy_stream *s, pcopy_pkt_type_t type,
+		__u64 len, off_t pos)
+{
+	struct ploop_copy_handle *h = s->h;
+
+	if (h->cancelled)
+		return SYSEXIT_WRITE;
+
+	if (!h->is_remote)
+		return write_hole(s->ofd, len, pos, NULL);
+	else if (h->zero_buf != NULL)
+		return send_zero_data(s, len, pos);
+	else
+		return stream_write(s,
+			h->async ? get_async_pkt(type) : type,
+			&len, sizeof(len), pos);
+}
+
+static void *sender_thread(void *data)
+{
+	struct pcopy_stream *s = data;
+	struct pcopy_ring *r = &s->ring;
+	struct pcopy_pkt *pkt;
+	int ret, done;
+
+	ploop_dbg(3, "start sender_thread");
+	do {
+		sem_wait_nointr(&r->queued);
+
+		pkt = &r->pkt[r->tail % PCOPY_RING_SIZE];
+		done = (pkt->type == PCOPY_PKT_DATA && pkt->len == 0 &&
+				pkt->pos == 0);
+		/* after an error the rest is dropped, the reader bails out */
+		if (r->ret == 0) {
+			if (pkt->type == PCOPY_PKT_DATA)
+				ret = send_buf(s, pkt->buf, pkt->len, pkt->pos);
+			else
+				ret = send_hole(s, pkt->type, pkt->len, pkt->pos);
+			if (ret) {
+				r->err_no = errno;
+				r->ret = ret;
+			}
+		}
+
+		if (pkt->buf != NULL)
+			sem_post(&r->buf_free);
+		r->tail++;
+		sem_post(&r->free);
+	} while (!done);
+
+	ploop_log(3, "send_thread exited ret=%d", r->ret);
+	return NULL;
+}
+
+/* The reader waits for the sender, the time is accounted as blocked */
+static void reader_wait(struct pcopy_stream *s, sem_t *sem)
+{
+	__u64 t;
+
+	if (sem_trywait(sem) == 0)
+		return;
+
+	t = now_us();
+	sem_wait_nointr(sem);
+	s->h->pstat.blocked_us += now_us() - t;
+}
+
+static int queue_pkt(struct pcopy_stream *s, pcopy_pkt_type_t type,
+		void *data, __u64 size, __u64 pos)
+{
+	struct pcopy_ring *r = &s->ring;
+	struct pcopy_pkt *pkt;
+
+	reader_wait(s, &r->free);
+
+	if (r->ret) {
+		sem_post(&r->free);
+		ploop_err(r->err_no, "write error");
+		return r->ret;
+	}
+
+	pkt = &r->pkt[r->head % PCOPY_RING_SIZE];
+	pkt->type = type;
+	pkt->buf = data;
+	pkt->len = size;
+	pkt->pos = pos;
+	/* the buffer is owned by the sender till it is sent */
+	if (data != NULL) {
+		r->buf_held--;
+		r->buf_given--;
+		r->buf_head++;
+	}
+	r->head++;
+
+	sem_post(&r->queued);
+
+	return 0;
+}
+
+/* Send the pending range of zero clusters */
+static int flush_zero(struct ploop_copy_handle *h)
+{
+	__u64 len = h->zero_len;
+
+	if (len == 0)
+		return 0;
+
+	h->zero_len = 0;
+	ploop_dbg(4, "ZERO size=%llu pos=%llu", len, h->zero_pos);
+
+	return queue_pkt(get_stream(h, h->zero_pos), PCOPY_PKT_ZERO, NULL,
+			len, h->zero_pos);
+}
+
+static int send_async(struct ploop_copy_handle *h, void *data,
+		__u64 size, __u64 pos)
+{
+	int ret;
+
+	ret = flush_zero(h);
+	if (ret)
+		return ret;
+
+	return queue_pkt(get_stream(h, pos), PCOPY_PKT_DATA, data, size, pos);
+}
+
+static int send_hole_async(struct ploop_copy_handle *h, __u64 len, __u64 pos)
+{
+	int ret;
+
+	ret = flush_zero(h);
+	if (ret)
+		return ret;
+
+	return queue_pkt(get_stream(h, pos), PCOPY_PKT_HOLE, NULL, len, pos);
+}
+
+/* Zero clusters are coalesced and sent as a single zero packet */
+static int send_zero_async(struct ploop_copy_handle *h, __u64 len, __u64 pos)
+{
+	int ret;
+
+	if (h->zero_len && h->zero_pos + h->zero_len == pos) {
+		h->zero_len += len;
+		return 0;
+	}
+
+	ret = flush_zero(h);
+	if (ret)
+		return ret;
+
+	h->zero_pos = pos;
+	h->zero_len = len;
+
+	return 0;
+}
+
+/*
+ * Get the next data buffer of the stream. Buffers must be queued in
+ * the order they are handed out; put_iobuf() gives back the last one
+ * if it is not sent (zero data), leaving it to the next read.
+ */
+static void *get_free_iobuf(struct pcopy_stream *s)
+{
+	struct pcopy_ring *r = &s->ring;
+
+	if (r->buf_given == r->buf_held) {
+		reader_wait(s, &r->buf_free);
+		r->buf_held++;
+	}
+
+	return r->buf[(r->buf_head + r->buf_given++) % PCOPY_RING_SIZE];
+}
+
+static void put_iobuf(struct pcopy_stream *s)
+{
+	s->ring.buf_given--;
+}
+
+/* Queue the data read from the image, zeroes go as a zero packet */
+static int send_read_buf(struct ploop_copy_handle *h, void *buf,
+		__u64 len, __u64 pos)
+{
+	int ret;
+
+	if (!is_zero_block(buf, len))
+		return send_async(h, buf, len, pos);
+
+	ret = flush_zero(h);
+	if (ret)
+		return ret;
+
+	return queue_pkt(get_stream(h, pos), PCOPY_PKT_ZERO, buf, len, pos);
+}
+
+/*
+ * Check if the range can be left to the sender thread to send right
+ * from the image. The index area is read here to be scanned, and
+ * O_DIRECT needs the range aligned.
+ */
+static int can_send_file(struct ploop_copy_handle *h, __u64 len, __u64 pos)
+{
+	return h->zerocopy && !h->resume_pass && pos >= h->data_off &&
+		pos % 4096 == 0 && len % 4096 == 0;
+}
+
+static int send_image_block(struct ploop_copy_handle *h, __u64 size,
+		__u64 pos, ssize_t *nread)
+{
+	struct delta *idelta = &h->idelta;
+	struct pcopy_stream *s = get_stream(h, pos);
+	void *iobuf = get_free_iobuf(s);
+
+	__u64 t = now_us();
+
+	ploop_dbg(4, "READ size=%llu pos=%llu", size, pos);
+	h->rbuf = iobuf;
+	*nread = TEMP_FAILURE_RETRY(pread(idelta->fd, iobuf, size, pos));
+	h->pstat.read_us += now_us() - t;
+	if (*nread == 0) {
+		put_iobuf(s);
+		return 0;
+	}
+	if (*nread < 0) {
+		put_iobuf(s);
+		ploop_err(errno, "Error from pread() size=%llu pos=%llu",
+				 size, pos);
+		return SYSEXIT_READ;
+	}
+	h->pstat.read_bytes += *nread;
+
+	if (is_zero_block(iobuf, *nread)) {
+		put_iobuf(s);
+		return send_zero_async(h, *nread, pos);
+	}
+
+	return send_async(h, iobuf, *nread, pos);
+}
+
+static int grow_maps(struct ploop_copy_handle *h, __u64 clusters)
+{
+	__u64 n = h->mapsize ? h->mapsize : 1024;
+	__u32 *ref, *skip;
+
+	if (clusters <= h->mapsize)
+		return 0;
+
+	while (n < clusters)
+		n *= 2;
+
+	ref = realloc(h->refmap, BMAP_SZ(n));
+	if (ref == NULL)
+		goto err;
+	h->refmap = ref;
+	skip = realloc(h->skipmap, BMAP_SZ(n));
+	if (skip == NULL)
+		goto err;
+	h->skipmap = skip;
+
+	memset((char *)ref + BMAP_SZ(h->mapsize), 0,
+			BMAP_SZ(n) - BMAP_SZ(h->mapsize));
+	memset((char *)skip + BMAP_SZ(h->mapsize), 0,
+			BMAP_SZ(n) - BMAP_SZ(h->mapsize));
+	h->mapsize = n;
+
+	return 0;
+err:
+	ploop_err(ENOMEM, "grow_maps");
+	return SYSEXIT_MALLOC;
+}
+
+static int is_referenced(struct ploop_copy_handle *h, __u64 clu)
+{
+	return clu < h->mapsize && BMAP_GET(h->refmap, clu);
+}
+
+/*
+ * Account index entries in buf, read from the image at pos. A cluster
+ * skipped earlier as unreferenced may be referenced now; such clusters
+ * are sent by resend_skipped().
+ */
+static int scan_index(struct ploop_copy_handle *h, const void *buf,
+		__u64 len, __u64 pos)
+{
+	const __u32 *idx = buf;
+	__u64 i, n, first = 0;
+
+	if (h->raw)
+		return 0;
+
+	if (pos == 0 && len >= sizeof(struct ploop_pvd_header)) {
+		const struct ploop_pvd_header *vh = buf;
+
+		h->data_off = (__u64)vh->m_FirstBlockOffset * SECTOR_SIZE;
+		first = PLOOP_MAP_OFFSET;
+	}
+
+	if (pos >= h->data_off)
+		return 0;
+	if (pos + len > h->data_off)
+		len = h->data_off - pos;
+
+	n = len / sizeof(__u32);
+	for (i = first; i < n; i++) {
+		__u64 clu;
+
+		if (idx[i] == 0)
+			continue;
+
+		clu = S2B(ploop_ioff_to_sec(idx[i], h->idelta.blocksize,
+				h->idelta.version)) / h->cluster;
+		if (grow_maps(h, clu + 1))
+			return SYSEXIT_MALLOC;
+
+		BMAP_SET(h->refmap, clu);
+		if (BMAP_GET(h->skipmap, clu))
+			h->rescan = 1;
+	}
+
+	return 0;
+}
+
+/* Send clusters skipped as unreferenced that got referenced since */
+static int resend_skipped(struct ploop_copy_handle *h, __u64 *xferred)
+{
+	__u64 clu;
+	ssize_t n;
+	int ret;
+
+	if (!h->rescan)
+		return 0;
+	h->rescan = 0;
+
+	for (clu = 0; clu < h->mapsize; clu++) {
+		if (!BMAP_GET(h->skipmap, clu) || !BMAP_GET(h->refmap, clu))
+			continue;
+
+		BMAP_CLR(h->skipmap, clu);
+		ret = send_image_block(h, h->cluster, clu * h->cluster, &n);
+		if (ret)
+			return ret;
+		*xferred += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the end of the run of clusters from pos up to limit which need
+ * not be sent: holes in the image file, or data clusters not referenced
+ * by the index.
+ */
+static __u64 get_skip_end(struct ploop_copy_handle *h, __u64 pos,
+		__u64 limit)
+{
+	off_t data = pos;
+
+	while (pos < limit && pos >= h->data_off) {
+		if (h->raw || is_referenced(h, pos / h->cluster)) {
+			if (data <= pos) {
+				data = lseek(h->idelta.fd, pos, SEEK_DATA);
+				if (data == -1)
+					/* ENXIO: no data till EOF */
+					data = errno == ENXIO ? limit : pos;
+			}
+			if (data < pos + h->cluster)
+				break;
+		}
+		pos += h->cluster;
+	}
+
+	return pos < limit ? pos : limit;
+}
+
+static int set_trackpos(struct ploop_copy_handle *h, __u64 pos)
+{
+	if (pos <= h->trackpos)
+		return 0;
+
+	h->trackpos = pos;
+	return ioctl_device(h->devfd, PLOOP_IOC_TRACK_SETPOS, &h->trackpos);
+}
+
+/*
+ * Get the next range of the image to send: a data cluster, or a run
+ * of clusters to be sent as a hole. The range is tracked before it is
+ * looked at, so writes to it are caught by the next iteration.
+ */
+static int get_next_range(struct ploop_copy_handle *h, __u64 pos,
+		__u64 *len, int *hole)
+{
+	struct stat st;
+	__u64 end, clu;
+	int ret;
+
+	if (fstat(h->idelta.fd, &st)) {
+		ploop_err(errno, "Can't fstat image");
+		return SYSEXIT_FSTAT;
+	}
+
+	end = get_skip_end(h, pos, st.st_size);
+
+	ret = set_trackpos(h, end > pos ? end : pos + h->cluster);
+	if (ret)
+		return ret;
+
+	/* recheck, a hole could be filled before it was tracked */
+	if (end > pos)
+		end = get_skip_end(h, pos, end);
+
+	*hole = end > pos;
+	*len = *hole ? end - pos : h->cluster;
+
+	for (clu = pos / h->cluster; clu < end / h->cluster; clu++)
+		if (!h->raw && !is_referenced(h, clu)) {
+			if (grow_maps(h, clu + 1))
+				return SYSEXIT_MALLOC;
+			BMAP_SET(h->skipmap, clu);
+		}
+
+	return 0;
+}
+
+void ploop_copy_release(struct ploop_copy_handle *h)
+{
+	if (h == NULL)
+		return;
+
+	if (h->freeze_start) {
+		h->pstat.freeze_us = now_us() - h->freeze_start;
+		h->freeze_start = 0;
+	}
+
+	if (h->dev_frozen) {
+		if (ioctl_device(h->partfd, PLOOP_IOC_THAW, 0))
+			ploop_err(errno, "Failed to PLOOP_IOC_THAW");
+		h->dev_frozen = 0;
+	}
+
+	if (h->fs_frozen) {
+		(void)ioctl_device(h->mntfd, FITHAW, 0);
+		h->fs_frozen = 0;
+	}
+
+	if (h->tracker_on) {
+		(void)ioctl_device(h->devfd, PLOOP_IOC_TRACK_ABORT, 0);
+		h->tracker_on = 0;
+	}
+
+	if (h->mntfd != -1) {
+		close(h->mntfd);
+		h->mntfd = -1;
+	}
+
+	if (h->devfd != -1) {
+		close(h->devfd);
+		h->devfd = -1;
+	}
+
+	if (h->partfd != -1) {
+		close(h->partfd);
+		h->partfd = -1;
+	}
+
+	if (h->idelta.fd != -1)
+		close_delta(&h->idelta);
+}
+
+void free_ploop_copy_handle(struct ploop_copy_handle *h)
+{
+	int i;
+
+	if (h == NULL)
+		return;
+
+	for (i = 0; i < h->nstreams; i++) {
+		struct pcopy_stream *s = &h->streams[i];
+		int j;
+
+		sem_destroy(&s->ring.free);
+		sem_destroy(&s->ring.queued);
+		sem_destroy(&s->ring.buf_free);
+
+		for (j = 0; j < PCOPY_RING_SIZE; j++)
+			free(s->ring.buf[j]);
+		free(s->stage);
+		if (s->pipe[0] != -1) {
+			close(s->pipe[0]);
+			close(s->pipe[1]);
+		}
+		zpool_destroy(s->zpool);
+	}
+
+	unregister_cleanup_hook(h->cl);
+
+	free(h->streams);
+	free(h->refmap);
+	free(h->skipmap);
+	free(h->rhash);
+	free(h->zero_buf);
+
+	free(h);
+}
+
+static struct ploop_copy_handle *alloc_ploop_copy_handle(int cluster,
+		int nstreams)
+{
+	struct ploop_copy_handle *h;
+	int i, j;
+
+	h = calloc(1, sizeof(struct ploop_copy_handle));
+	if (h == NULL)
+		return NULL;
+
+	h->devfd = h->partfd = h->mntfd = h->idelta.fd = -1;
+	h->cluster = cluster;
+
+	h->streams = calloc(nstreams, sizeof(struct pcopy_stream));
+	if (h->streams == NULL)
+		goto err;
+
+	for (h->nstreams = 0; h->nstreams < nstreams; h->nstreams++) {
+		struct pcopy_stream *s = &h->streams[h->nstreams];
+
+		s->h = h;
+		s->ofd = -1;
+		s->pipe[0] = s->pipe[1] = -1;
+		sem_init(&s->ring.free, 0, PCOPY_RING_SIZE);
+		sem_init(&s->ring.queued, 0, 0);
+		sem_init(&s->ring.buf_free, 0, PCOPY_RING_SIZE);
+	}
+
+	for (i = 0; i < nstreams; i++) {
+		struct pcopy_stream *s = &h->streams[i];
+
+		for (j = 0; j < PCOPY_RING_SIZE; j++)
+			if (p_memalign(&s->ring.buf[j], 4096, cluster))
+				goto err;
+	}
+
+	return h;
+err:
+	free_ploop_copy_handle(h);
+	return NULL;
+}
+
+
+static int check_copy_param(struct ploop_copy_param *param, int *remote)
+{
+	int is_remote, i;
+
+	if (param->compress != PLOOP_COPY_COMPRESS_NONE &&
+			!codec_supported(param->compress)) {
+		ploop_err(0, "Unsupported compression codec %d",
+				param->compress);
+		return SYSEXIT_PARAM;
+	}
+
+	is_remote = is_fd_socket(param->ofd);
+	if (is_remote < 0) {
+		ploop_err(0, "Invalid output fd %d: must be a file, "
+				"a pipe or a socket", param->ofd);
+		return SYSEXIT_PARAM;
+	}
+
+	if (param->nofds < 0 || (param->nofds > 0 && param->ofds == NULL)) {
+		ploop_err(0, "Invalid number of output streams %d",
+				param->nofds);
+		return SYSEXIT_PARAM;
+	}
+
+	for (i = 0; i < param->nofds; i++) {
+		if (!is_remote || is_fd_socket(param->ofds[i]) != 1) {
+			ploop_err(0, "Invalid output fd %d: additional streams "
+					"must be pipes or sockets",
+					param->ofds[i]);
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	if (param->ofd == STDOUT_FILENO)
+		ploop_set_verbose_level(PLOOP_LOG_NOSTDOUT);
+	else if (param->ofd == STDERR_FILENO)
+		ploop_set_verbose_level(PLOOP_LOG_NOCONSOLE);
+
+	*remote = is_remote;
+
+	return 0;
+}
+
+static void set_copy_param(struct ploop_copy_handle *h,
+		struct ploop_copy_param *param, int is_remote)
+{
+	int i;
+
+	h->streams[0].ofd = param->ofd;
+	for (i = 0; i < param->nofds; i++)
+		h->streams[i + 1].ofd = param->ofds[i];
+	h->is_remote = is_remote;
+	h->async = param->async;
+	h->compress = param->compress;
+	h->compress_level = param->compress_level;
+	h->resume = param->resume;
+	h->zerocopy = param->zerocopy;
+}
+
+int ploop_copy_init(struct ploop_disk_images_data *di,
+		struct ploop_copy_param *param,
+		struct ploop_copy_handle **h)
+{
+	int ret, err;
+	int blocksize;
+	char *image = NULL;
+	char *format = NULL;
+	char device[64];
+	char partdev[64];
+	struct ploop_copy_handle  *_h = NULL;
+	int is_remote;
+	char mnt[PATH_MAX] = "";
+
+	ret = check_copy_param(param, &is_remote);
+	if (ret)
+		return ret;
+
+	if (ploop_lock_dd(di))
+		return SYSEXIT_LOCK;
+
+	if (ploop_find_dev_by_dd(di, device, sizeof(device))) {
+		ploop_err(0, "Can't find running ploop device");
+		ret = SYSEXIT_SYS;
+		goto err;
+	}
+
+	ret = get_image_info(device, &image, &format, &blocksize);
+	if (ret)
+		goto err;
+
+
+	_h = alloc_ploop_copy_handle(S2B(blocksize), 1 + param->nofds);
+	if (_h == NULL) {
+		ploop_err(0, "alloc_ploop_copy_handle");
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
+
+	_h->raw = strcmp(format, "raw") == 0;
+	set_copy_param(_h, param, is_remote);
+
+	_h->devfd = open(device, O_RDONLY|O_CLOEXEC);
+	if (_h->devfd == -1) {
+		ploop_err(errno, "Can't open device %s", device);
+		ret = SYSEXIT_DEVICE;
+		goto err;
+	}
+
+	ret = get_partition_device_name(device, partdev, sizeof(partdev));
+	if (ret)
+		goto err;
+
+	_h->partfd = open(partdev, O_RDONLY|O_CLOEXEC);
+	if (_h->partfd == -1) {
+		ploop_err(errno, "Can't open device %s", partdev);
+		ret = SYSEXIT_DEVICE;
+		goto err;
+	}
+
+	ret = SYSEXIT_OPEN;
+	err = ploop_get_mnt_by_dev(device, mnt, sizeof(mnt));
 	if (err == -1)
 		goto err;
-	else if (err == 0) {
-		_h->mntfd = open(mnt, O_RDONLY|O_NONBLOCK|O_DIRECTORY);
-		if (_h->mntfd < 0) {
-			ploop_err(errno, "Can't open %s", mnt);
+	else if (err == 0) {
+		_h->mntfd = open(mnt, O_RDONLY|O_NONBLOCK|O_DIRECTORY);
+		if (_h->mntfd < 0) {
+			ploop_err(errno, "Can't open %s", mnt);
+			goto err;
+		}
+	}
+
+	ploop_log(0, "Send image %s dev=%s mnt=%s fmt=%s blocksize=%d local=%d streams=%d",
+			image, device, mnt, format, blocksize, !is_remote,
+			_h->nstreams);
+
+	if (_h->raw ?
+			open_delta_simple(&_h->idelta, image, O_RDONLY|O_DIRECT, OD_NOFLAGS) :
+			open_delta(&_h->idelta, image, O_RDONLY|O_DIRECT, OD_ALLOW_DIRTY)) {
+		ret = SYSEXIT_OPEN;
+		goto err;
+	}
+
+	ret = complete_running_operation(di, device);
+	if (ret)
+		goto err;
+
+	_h->cl = register_cleanup_hook(cancel_sender, _h);
+err:
+	if (ret) {
+		ploop_copy_release(_h);
+		free_ploop_copy_handle(_h);
+	} else
+		*h = _h;
+
+	free(image);
+	ploop_unlock_dd(di);
+
+	return ret;
+}
+
+/* Check that the receiver takes hole and zero packets */
+static int setup_hole(struct ploop_copy_handle *h)
+{
+	pcopy_cmd_t cmd = PCOPY_CMD_HOLE;
+	int ret;
+
+	if (!h->is_remote || h->zero_buf != NULL)
+		return 0;
+
+	ret = remote_write(h->streams[0].ofd, PCOPY_PKT_CMD, &cmd, sizeof(cmd), 0);
+	if (ret != SYSEXIT_PARAM)
+		return ret;
+
+	ploop_log(0, "The receiver does not support holes,"
+			" sending zero data");
+	if (p_memalign(&h->zero_buf, 4096, h->cluster))
+		return SYSEXIT_MALLOC;
+	memset(h->zero_buf, 0, h->cluster);
+
+	return 0;
+}
+
+/* Agree on compression with the receiver */
+static int setup_compress(struct ploop_copy_handle *h)
+{
+	unsigned int cmd[2] = { PCOPY_CMD_COMPRESS, h->compress };
+	long cpus;
+	int i, ret;
+
+	if (h->compress == PLOOP_COPY_COMPRESS_NONE)
+		return 0;
+
+	if (!h->is_remote) {
+		ploop_log(1, "Compression is not used for a local copy");
+		return 0;
+	}
+
+	ret = remote_write(h->streams[0].ofd, PCOPY_PKT_CMD, cmd, sizeof(cmd), 0);
+	if (ret == SYSEXIT_PARAM) {
+		ploop_log(0, "The receiver does not support compression,"
+				" sending uncompressed data");
+		return 0;
+	}
+	if (ret)
+		return ret;
+
+	/* share CPUs between the streams */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN) / h->nstreams;
+	for (i = 0; i < h->nstreams; i++) {
+		h->streams[i].zpool = zpool_create(h->compress,
+				h->compress_level, h->cluster,
+				cpus > 0 ? cpus : 1);
+		if (h->streams[i].zpool == NULL)
+			return SYSEXIT_MALLOC;
+	}
+
+	return 0;
+}
+
+/* Ask the receiver to acknowledge synchronous packets by window */
+static int setup_window(struct ploop_copy_handle *h)
+{
+	unsigned int cmd[2] = { PCOPY_CMD_WINDOW, PCOPY_WINDOW };
+	int i, ret;
+
+	if (!h->is_remote || h->async)
+		return 0;
+
+	for (i = 0; i < h->nstreams; i++) {
+		ret = remote_write(h->streams[i].ofd, PCOPY_PKT_CMD,
+				cmd, sizeof(cmd), 0);
+		if (ret == SYSEXIT_PARAM) {
+			ploop_log(1, "The receiver does not support windowed"
+					" acknowledgements");
+			return 0;
+		}
+		if (ret)
+			return ret;
+
+		h->streams[i].window = PCOPY_WINDOW;
+	}
+
+	return 0;
+}
+
+/* Get the cluster hashes of the receiver's copy of the image */
+static int setup_resume(struct ploop_copy_handle *h)
+{
+	unsigned int cmd[2] = { PCOPY_CMD_HASH, h->cluster };
+	int fd = h->streams[0].ofd;
+	unsigned char *p;
+	size_t len, chunk;
+	__u64 n;
+	int ret;
+
+	if (!h->resume)
+		return 0;
+
+	if (!h->is_remote) {
+		ploop_log(1, "Resume is not used for a local copy");
+		h->resume = 0;
+		return 0;
+	}
+
+	ret = remote_write(fd, PCOPY_PKT_CMD, cmd, sizeof(cmd), 0);
+	if (ret == SYSEXIT_PARAM) {
+		/* the receiver has truncated its file */
+		ploop_log(0, "The receiver can not resume the copy,"
+				" sending all the data");
+		h->resume = 0;
+		return 0;
+	}
+	if (ret)
+		return ret;
+
+	if (nread(fd, &n, sizeof(n))) {
+		ploop_err(errno, "Error in nread(hashes)");
+		return SYSEXIT_PROTOCOL;
+	}
+
+	if (n > SIZE_MAX / PCOPY_HASH_SIZE) {
+		ploop_err(0, "Stream corrupted: %llu cluster hashes",
+				(unsigned long long)n);
+		return SYSEXIT_PROTOCOL;
+	}
+
+	len = n * PCOPY_HASH_SIZE;
+	h->rhash = malloc(len ? len : 1);
+	if (h->rhash == NULL) {
+		ploop_err(ENOMEM, "setup_resume");
+		return SYSEXIT_MALLOC;
+	}
+
+	for (p = h->rhash; len > 0; len -= chunk, p += chunk) {
+		chunk = len < DEF_CLUSTER ? len : DEF_CLUSTER;
+		if (nread(fd, p, chunk)) {
+			ploop_err(errno, "Error in nread(hashes)");
+			return SYSEXIT_PROTOCOL;
+		}
+	}
+	h->nrhash = n;
+
+	ploop_log(0, "Resume: the receiver has %llu clusters",
+			(unsigned long long)n);
+
+	return 0;
+}
+
+/* Cut off whatever the receiver had past the end of the image */
+static int send_truncate(struct ploop_copy_handle *h)
+{
+	pcopy_cmd_t cmd = PCOPY_CMD_TRUNCATE;
+
+	if (!h->resume)
+		return 0;
+
+	ploop_dbg(3, "TRUNCATE size=%llu", (unsigned long long)h->eof_offset);
+
+	return stream_write(&h->streams[0], PCOPY_PKT_CMD, &cmd, sizeof(cmd),
+			h->eof_offset);
+}
+
+static double conv_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A pass over the image or its dirty part is starting */
+void pcopy_conv_start(struct pcopy_conv *c)
+{
+	c->prev_start = c->start;
+	c->start = conv_now();
+}
+
+/* The pass has sent xferred bytes */
+void pcopy_conv_done(struct pcopy_conv *c, __u64 xferred)
+{
+	c->bytes += xferred;
+	c->time += conv_now() - c->start;
+	/*
+	 * A pass over the dirty data picks up what was written since
+	 * the previous pass has started; the first one sends it all.
+	 */
+	if (c->passes > 0 && c->start > c->prev_start)
+		c->dirty_rate = xferred / (c->start - c->prev_start);
+	c->passes++;
+}
+
+/*
+ * Decide if the copy should be stopped now, that is the guest frozen
+ * for the final pass. Its size is predicted as the data written since
+ * the last pass started and its duration, returned in downtime (ms),
+ * from the average transfer rate. It is time to stop if the pass fits
+ * in max_downtime or if more passes do not make it smaller: the data
+ * is written about as fast as it is sent.
+ */
+int pcopy_conv_should_stop(struct pcopy_conv *c, unsigned int max_downtime,
+		__u64 *downtime)
+{
+	double rate, size, t;
+
+	if (c->passes == 0 || c->time <= 0) {
+		*downtime = 0;
+		return 0;
+	}
+
+	rate = c->bytes / c->time;
+	size = c->dirty_rate * (conv_now() - c->start);
+	t = rate > 0 ? size / rate : 0;
+	*downtime = t * 1000;
+
+	ploop_log(3, "pcopy pass %d rate=%.0f dirty_rate=%.0f downtime=%llums",
+			c->passes, rate, c->dirty_rate,
+			(unsigned long long)*downtime);
+
+	/* the dirty rate is known after a pass over the dirty data */
+	if (c->passes < 2)
+		return 0;
+
+	if (*downtime <= max_downtime)
+		return 1;
+
+	if (c->dirty_rate >= rate * 0.9) {
+		ploop_log(1, "Copy does not converge: data is written at"
+				" %.0f bytes/s and sent at %.0f bytes/s",
+				c->dirty_rate, rate);
+		return 1;
+	}
+
+	return c->passes > PCOPY_MAX_PASSES;
+}
+
+/* Agree on the transfer options with the receiver, start the senders */
+static int start_senders(struct ploop_copy_handle *h)
+{
+	int i, ret;
+
+	ret = setup_hole(h);
+	if (ret)
+		return ret;
+
+	ret = setup_compress(h);
+	if (ret)
+		return ret;
+
+	ret = setup_window(h);
+	if (ret)
+		return ret;
+
+	ret = setup_resume(h);
+	if (ret)
+		return ret;
+
+	if (h->zerocopy && (!h->is_remote || h->streams[0].zpool != NULL)) {
+		ploop_log(1, "Zero-copy is used for an uncompressed copy"
+				" to a socket only");
+		h->zerocopy = 0;
+	}
+
+	for (i = 0; i < h->nstreams; i++) {
+		struct pcopy_stream *s = &h->streams[i];
+
+		ret = pthread_create(&s->send_th, NULL, sender_thread, s);
+		if (ret) {
+			ploop_err(ret, "Can't create send thread");
+			return SYSEXIT_SYS;
+		}
+	}
+
+	return 0;
+}
+
+/* Close all the streams, the receiver replies once they are closed */
+static int close_streams(struct ploop_copy_handle *h)
+{
+	int i, ret;
+
+	ploop_dbg(3, "SEND 0 0 (close)");
+	for (i = 0; i < h->nstreams; i++) {
+		ret = queue_pkt(&h->streams[i], PCOPY_PKT_DATA, NULL, 0, 0);
+		if (ret)
+			return ret;
+	}
+	for (i = 0; i < h->nstreams; i++) {
+		struct pcopy_stream *s = &h->streams[i];
+
+		pthread_join(s->send_th, NULL);
+		s->send_th = 0;
+		if (s->ring.ret && !ret) {
+			ploop_err(s->ring.err_no, "write error");
+			ret = s->ring.ret;
+		}
+	}
+
+	return ret;
+}
+
+static void pass_stat_begin(struct ploop_copy_handle *h)
+{
+	int i;
+
+	memset(&h->pstat, 0, sizeof(h->pstat));
+	h->pstat.version = PLOOP_COPY_PASS_STAT_V1;
+	h->pstat.pass = h->npass++;
+	h->pass_start = now_us();
+
+	for (i = 0; i < h->nstreams; i++) {
+		struct pcopy_stream *s = &h->streams[i];
+
+		s->read_bytes = s->read_us = 0;
+		s->send_bytes = s->send_us = 0;
+		s->acks = s->ack_us = s->ack_max_us = 0;
+	}
+}
+
+static __u64 get_rate(__u64 bytes, __u64 us)
+{
+	return us ? bytes * 1000000 / us : 0;
+}
+
+/* Sum up the statistics of the streams, the senders must be idle */
+static void pass_stat_end(struct ploop_copy_handle *h)
+{
+	struct ploop_copy_pass_stat *p = &h->pstat;
+	__u64 ack_us = 0;
+	int i;
+
+	for (i = 0; i < h->nstreams; i++) {
+		struct pcopy_stream *s = &h->streams[i];
+
+		p->read_bytes += s->read_bytes;
+		p->read_us += s->read_us;
+		p->send_bytes += s->send_bytes;
+		p->send_us += s->send_us;
+		p->acks += s->acks;
+		ack_us += s->ack_us;
+		if (s->ack_max_us > p->ack_max_us)
+			p->ack_max_us = s->ack_max_us;
+	}
+
+	p->read_rate = get_rate(p->read_bytes, p->read_us);
+	p->send_rate = get_rate(p->send_bytes, p->send_us);
+	p->ack_avg_us = p->acks ? ack_us / p->acks : 0;
+	p->wall_us = now_us() - h->pass_start;
+
+	ploop_log(3, "pcopy pass %d: %llu bytes in %llu us, read %llu B/s, "
+			"send %llu B/s, blocked %llu us",
+			p->pass, p->xferred, p->wall_us, p->read_rate,
+			p->send_rate, p->blocked_us);
+}
+
+/* Bytes the receiver had already, once the resume pass is done */
+static __u64 get_matched(struct ploop_copy_handle *h, __u64 xferred)
+{
+	__u64 matched = 0;
+	int i;
+
+	if (!h->resume)
+		return 0;
+
+	for (i = 0; i < h->nstreams; i++)
+		matched += h->streams[i].matched;
+	ploop_log(0, "Resume: %llu of %llu bytes are up to date",
+			(unsigned long long)matched,
+			(unsigned long long)xferred);
+	free(h->rhash);
+	h->rhash = NULL;
+	h->nrhash = 0;
+
+	return matched;
+}
+
+int ploop_copy_start(struct ploop_copy_handle *h,
+		struct ploop_copy_stat *stat)
+{
+	int ret;
+	struct ploop_track_extent e;
+	ssize_t n;
+	__u64 pos, len, xferred = 0;
+	int hole;
+
+	ret = start_senders(h);
+	if (ret)
+		goto err;
+
+	pass_stat_begin(h);
+	pcopy_conv_start(&h->conv);
+
+	ploop_dbg(3, "pcopy track init");
+	ret = ioctl_device(h->devfd, PLOOP_IOC_TRACK_INIT, &e);
+	if (ret)
+		goto err;
+
+	h->tracker_on = 1;
+	h->trackend = e.end;
+	ploop_log(3, "pcopy start %s e.end=%" PRIu64,
+			h->async ? "async" : "", (uint64_t)e.end);
+	if (!h->raw) {
+		struct ploop_pvd_header *vh = (void *)h->idelta.hdr0;
+
+		h->data_off = (__u64)vh->m_FirstBlockOffset * SECTOR_SIZE;
+	}
+
+	/*
+	 * Only the index and the clusters it refers to are sent, the rest
+	 * is sent as holes. The index area comes first, so the clusters
+	 * referenced are known by the time the data area is reached.
+	 * On resume the clusters the receiver has are skipped in this
+	 * pass only: once a cluster is sent, its hash is stale.
+	 */
+	h->resume_pass = h->nrhash != 0;
+	for (pos = 0; pos <= h->trackend; ) {
+		ret = get_next_range(h, pos, &len, &hole);
+		if (ret)
+			goto err;
+
+		if (hole) {
+			ret = send_hole_async(h, len, pos);
+			if (ret)
+				goto err;
+			n = len;
+		} else if (pos + len <= h->trackend &&
+				can_send_file(h, len, pos)) {
+			ret = send_async(h, NULL, len, pos);
+			if (ret)
+				goto err;
+			n = len;
+			xferred += n;
+		} else {
+			ret = send_image_block(h, len, pos, &n);
+			if (ret)
+				goto err;
+			if (n == 0) /* EOF */
+				break;
+
+			ret = scan_index(h, h->rbuf, n, pos);
+			if (ret)
+				goto err;
+			xferred += n;
+		}
+
+		pos += n;
+		if (pos > h->eof_offset)
+			h->eof_offset = pos;
+	}
+
+	ret = wait_sender(h);
+	h->resume_pass = 0;
+	if (ret)
+		goto err;
+
+	xferred -= get_matched(h, xferred);
+
+	stat->xferred_total = stat->xferred = xferred;
+	send_cmd(h, PCOPY_CMD_SYNC);
+	pcopy_conv_done(&h->conv, xferred);
+	h->pstat.xferred = xferred;
+	pass_stat_end(h);
+	ploop_dbg(3, "pcopy start finished");
+
+	return 0;
+err:
+	ploop_copy_release(h);
+
+	return ret;
+}
+
+/* Dirty chunks read and sent at once, no more than the ring holds */
+#define PCOPY_BATCH		PCOPY_RING_SIZE
+
+struct pcopy_chunk {
+	__u64 pos;
+	__u64 len;
+};
+
+/*
+ * Send a batch of dirty chunks. The whole batch is tracked at once,
+ * then each contiguous run of it is read by a single preadv() right
+ * into the buffers of the streams the chunks are sent by.
+ */
+static int send_chunks(struct ploop_copy_handle *h,
+		struct pcopy_chunk *c, int n)
+{
+	struct iovec iov[PCOPY_BATCH];
+	__u64 end = 0, size, t;
+	ssize_t len;
+	int i, j, k, ret;
+
+	for (i = 0; i < n; i++)
+		if (c[i].pos + c[i].len > end)
+			end = c[i].pos + c[i].len;
+
+	ret = set_trackpos(h, end);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < n; i = j) {
+		if (can_send_file(h, c[i].len, c[i].pos)) {
+			j = i + 1;
+			ret = send_async(h, NULL, c[i].len, c[i].pos);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		size = 0;
+		for (j = i; j < n; j++) {
+			if (j > i && (c[j].pos != c[j - 1].pos + c[j - 1].len ||
+					can_send_file(h, c[j].len, c[j].pos)))
+				break;
+			iov[j - i].iov_base = get_free_iobuf(get_stream(h, c[j].pos));
+			iov[j - i].iov_len = c[j].len;
+			size += c[j].len;
+		}
+
+		ploop_dbg(4, "READ size=%llu pos=%llu segs=%d",
+				size, c[i].pos, j - i);
+		t = now_us();
+		len = TEMP_FAILURE_RETRY(preadv(h->idelta.fd, iov, j - i,
+					c[i].pos));
+		h->pstat.read_us += now_us() - t;
+		if (len != size) {
+			if (len < 0)
+				ploop_err(errno, "Error from preadv() size=%llu pos=%llu",
+						size, c[i].pos);
+			else
+				ploop_err(0, "Short read");
+			return SYSEXIT_READ;
+		}
+		h->pstat.read_bytes += len;
+
+		/* queue the buffers in the order they were taken */
+		for (k = i; k < j; k++) {
+			void *buf = iov[k - i].iov_base;
+
+			ret = scan_index(h, buf, c[k].len, c[k].pos);
+			if (ret)
+				return ret;
+
+			ret = send_read_buf(h, buf, c[k].len, c[k].pos);
+			if (ret)
+				return ret;
+		}
+	}
+
+	if (end > h->eof_offset)
+		h->eof_offset = end;
+
+	return 0;
+}
+
+int ploop_copy_next_iteration(struct ploop_copy_handle *h,
+		struct ploop_copy_stat *stat)
+{
+	struct ploop_track_extent e;
+	struct pcopy_chunk chunk[PCOPY_BATCH];
+	int ret = 0;
+	int done = 0;
+	int nchunks = 0;
+	__u64 pos = 0, end = 0;
+	__u64 iterpos = 0;
+
+	stat->xferred = 0;
+	ploop_dbg(3, "pcopy iter %d", h->niter);
+	pcopy_conv_start(&h->conv);
+	/* the passes of ploop_copy_stop() make up a single one */
+	if (h->freeze_start == 0)
+		pass_stat_begin(h);
+	for (;;) {
+		if (pos == end) {
+			if (done)
+				break;
+
+			if (ioctl(h->devfd, PLOOP_IOC_TRACK_READ, &e)) {
+				if (errno == EAGAIN) /* no more dirty blocks */
+					break;
+
+				ploop_err(errno, "PLOOP_IOC_TRACK_READ");
+				ret = SYSEXIT_DEVIOC;
+				goto err;
+			}
+
+			if (e.end > h->trackend)
+				h->trackend = e.end;
+
+			if (e.start < iterpos)
+				done = 1;
+
+			iterpos = e.end;
+			stat->xferred += e.end - e.start;
+			h->pstat.extents++;
+			if (e.end - e.start > h->pstat.max_extent)
+				h->pstat.max_extent = e.end - e.start;
+			pos = e.start;
+			end = e.end;
+		}
+
+		/* gather the extents into cluster sized chunks */
+		for (; pos < end && nchunks < PCOPY_BATCH; nchunks++) {
+			__u64 copy = end - pos;
+
+			if (copy > h->cluster)
+				copy = h->cluster;
+
+			chunk[nchunks].pos = pos;
+			chunk[nchunks].len = copy;
+			pos += copy;
+		}
+
+		if (nchunks == PCOPY_BATCH) {
+			ret = send_chunks(h, chunk, nchunks);
+			if (ret)
+				goto err;
+			nchunks = 0;
+		}
+	}
+
+	if (nchunks) {
+		ret = send_chunks(h, chunk, nchunks);
+		if (ret)
 			goto err;
+	}
+
+	ret = resend_skipped(h, &stat->xferred);
+	if (ret)
+		goto err;
+
+	ret = wait_sender(h);
+	if (ret)
+		goto err;
+
+	/* sync after each iteration */
+	ret = send_cmd(h, PCOPY_CMD_SYNC);
+	if (ret)
+		goto err;
+
+	stat->xferred_total += stat->xferred;
+	pcopy_conv_done(&h->conv, stat->xferred);
+	h->pstat.xferred += stat->xferred;
+	if (h->freeze_start == 0)
+		pass_stat_end(h);
+
+	ploop_log(3, "pcopy iter %d xferred=%" PRIu64,
+			h->niter++, (uint64_t)stat->xferred);
+
+	return 0;
+
+err:
+	ploop_copy_release(h);
+	return ret;
+}
+
+/*
+ * Returns 1 if it is time for ploop_copy_stop(), 0 if another
+ * iteration is worth it. The estimated duration of the final frozen
+ * iteration, ms, is stored to downtime; max_downtime is the acceptable
+ * one, 0 means the default.
+ */
+int ploop_copy_should_stop(struct ploop_copy_handle *h,
+		unsigned int max_downtime, __u64 *downtime)
+{
+	__u64 t;
+
+	return pcopy_conv_should_stop(&h->conv, max_downtime ? max_downtime :
+			PCOPY_DEF_DOWNTIME, downtime ? downtime : &t);
+}
+
+static int freeze_fs(struct ploop_copy_handle *h)
+{
+	int ret;
+
+	if (h->mntfd != -1) {
+		/* Sync fs */
+		ploop_log(0, "Freezing fs...");
+		if (sys_syncfs(h->mntfd)) {
+			ploop_err(errno, "syncfs() failed");
+			return SYSEXIT_FSYNC;
 		}
+
+		/* Flush journal and freeze fs (this also clears the fs dirty bit) */
+		ploop_dbg(3, "FIFREEZE");
+		ret = ioctl_device(h->mntfd, FIFREEZE, 0);
+		if (ret)
+			return ret;
+
+		h->fs_frozen = 1;
 	}
 
-	ploop_log(0, "Send image %s dev=%s mnt=%s fmt=%s blocksize=%d local=%d",
-			image, device, mnt, format, blocksize, !is_remote);
+	return 0;
+}
 
-	if (open_delta(&_h->idelta, image, O_RDONLY|O_DIRECT, OD_ALLOW_DIRTY)) {
-		ret = SYSEXIT_OPEN;
-		goto err;
+static int freeze(struct ploop_copy_handle *h)
+{
+	int ret;
+
+	ret = ioctl(h->partfd, PLOOP_IOC_FREEZE);
+	if (ret) {
+		if (errno == EINVAL)
+			ret = freeze_fs(h);
+		else
+			ploop_err(errno, "Failed to freeze device");
+		if (ret)
+			goto err;
+
+	} else {
+		ploop_log(0, "Freezing device...");
+		h->dev_frozen = 1;
 	}
 
-	ret = complete_running_operation(di, device);
+	ploop_dbg(3, "IOC_SYNC");
+	ret = ioctl_device(h->devfd, PLOOP_IOC_SYNC, 0);
 	if (ret)
 		goto err;
 
-	_h->cl = register_cleanup_hook(cancel_sender, _h);
-
-	pthread_mutex_lock(&_h->sd.wait_mutex);
+	return 0;
 err:
+	ploop_copy_release(h);
+	return ret;
+}
+
+static int cbt_writer(void *data, const void *buf, int len, off_t pos)
+{
+	struct ploop_copy_handle *h = (struct ploop_copy_handle *)data;
+
+	h->eof_offset += len;
+
+	return send_buf(&h->streams[0], buf, len, pos);
+}
+
+static int send_optional_header(struct ploop_copy_handle *copy_h)
+{
+	int ret;
+	struct ploop_pvd_header *vh;
+	size_t block_size;
+	struct ploop_pvd_ext_block_check *hc;
+	struct ploop_pvd_ext_block_element_header *h;
+	__u8 *block = NULL, *data;
+
+	vh = (struct ploop_pvd_header *)copy_h->idelta.hdr0;
+	block_size = vh->m_Sectors * SECTOR_SIZE;
+	if (p_memalign((void **)&block, 4096, block_size))
+		return SYSEXIT_MALLOC;
+
+	hc = (struct ploop_pvd_ext_block_check *)block;
+	h = (struct ploop_pvd_ext_block_element_header *)(hc + 1);
+	data = (__u8 *)(h + 1);
+	h->magic = EXT_MAGIC_DIRTY_BITMAP;
+
+	ret = save_dirty_bitmap(copy_h->devfd, &copy_h->idelta,
+			copy_h->eof_offset, data, &h->size,
+			NULL, cbt_writer, copy_h);
 	if (ret) {
-		ploop_copy_release(_h);
-		free_ploop_copy_handle(_h);
-	} else
-		*h = _h;
+		if (ret == SYSEXIT_NOCBT)
+			ret = 0;
+		goto out;
+	}
 
-	free(image);
-	ploop_unlock_dd(di);
+	vh->m_DiskInUse = SIGNATURE_DISK_CLOSED_V21;
+	vh->m_FormatExtensionOffset = (copy_h->eof_offset + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	if (send_buf(&copy_h->streams[0], vh, sizeof(*vh), 0)) {
+		ploop_err(errno, "Can't write header");
+		ret = SYSEXIT_WRITE;
+		goto out;
+	}
+	ploop_log(3, "Send extension header offset=%llu size=%d",
+			vh->m_FormatExtensionOffset * SECTOR_SIZE, h->size);
+	hc->m_Magic = FORMAT_EXTENSION_MAGIC;
+	MD5((const unsigned char *)(hc + 1), block_size - sizeof(*hc), hc->m_Md5);
+
+	if (send_buf(&copy_h->streams[0], block, block_size, vh->m_FormatExtensionOffset * SECTOR_SIZE)) {
+		ploop_err(errno, "Can't write optional header");
+		ret = SYSEXIT_WRITE;
+		goto out;
+	}
+
+out:
+	free(block);
 
 	return ret;
 }
 
-int ploop_copy_start(struct ploop_copy_handle *h,
+int ploop_copy_stop(struct ploop_copy_handle *h,
 		struct ploop_copy_stat *stat)
 {
 	int ret;
-	struct ploop_track_extent e;
-	ssize_t n;
-	__u64 pos;
+	int iter;
+	__u64 prev = 0;
 
-	ret = pthread_create(&h->send_th, NULL, sender_thread, h);
-	if (ret) {
-		ploop_err(ret, "Can't create send thread");
-		ret = SYSEXIT_SYS;
+	ploop_log(3, "pcopy last");
+
+	pass_stat_begin(h);
+	ret = freeze(h);
+	if (ret)
 		goto err;
-	}
+	h->freeze_start = now_us();
 
-	pthread_barrier_wait(&h->sd.barrier);
+	/* nothing is written any more, passes have to shrink to zero */
+	for (iter = 1; ; iter++) {
+		ret = ploop_copy_next_iteration(h, stat);
+		if (ret)
+			goto err;
+		else if (stat->xferred == 0)
+			break;
+		if ((iter > 1 && stat->xferred >= prev) ||
+				iter >= PCOPY_MAX_PASSES) {
+			ploop_err(0, "Too many iterations on frozen FS, aborting");
+			return SYSEXIT_LOOP;
+		}
+		prev = stat->xferred;
+	}
 
-	ploop_dbg(3, "pcopy track init");
-	ret = ioctl_device(h->devfd, PLOOP_IOC_TRACK_INIT, &e);
+	ret = send_truncate(h);
 	if (ret)
 		goto err;
 
-	h->tracker_on = 1;
-	h->trackend = e.end;
-	ploop_log(3, "pcopy start %s e.end=%" PRIu64,
-			h->async ? "async" : "", (uint64_t)e.end);
-	for (pos = 0; pos <= h->trackend; ) {
-		h->trackpos = pos + h->cluster;
-		ret = ioctl_device(h->devfd, PLOOP_IOC_TRACK_SETPOS, &h->trackpos);
-		if (ret)
+	if (!h->raw) {
+		/* Must clear dirty flag on ploop1 image. */
+		struct ploop_pvd_header *vh = get_free_iobuf(&h->streams[0]);
+
+		if (PREAD(&h->idelta, vh, 4096, 0)) {
+			ret = SYSEXIT_READ;
 			goto err;
+		}
 
-		ret = send_image_block(h, h->cluster, pos, &n);
+		vh->m_DiskInUse = 0;
+
+		ploop_dbg(3, "Update header");
+
+		ret = send_buf(&h->streams[0], vh, 4096, 0);
+		put_iobuf(&h->streams[0]);
 		if (ret)
 			goto err;
-		if (n == 0) /* EOF */
-			break;
 
-		pos += n;
-		if (pos > h->eof_offset)
-			h->eof_offset = pos;
+		ret = send_optional_header(h);
+		if (ret)
+			goto err;
 	}
 
-	wait_sender(h);
+	ploop_dbg(4, "IOCTL TRACK_STOP");
+	ret = ioctl(h->devfd, PLOOP_IOC_TRACK_STOP, 0);
+	if (ret)
+		goto err;
 
-	stat->xferred_total = stat->xferred = pos;
-	send_cmd(h, PCOPY_CMD_SYNC);
-	ploop_dbg(3, "pcopy start finished");
+	h->tracker_on = 0;
+
+	ret = close_streams(h);
+	if (ret)
+		goto err;
+
+	ploop_dbg(3, "pcopy stop done");
 
-	return 0;
 err:
 	ploop_copy_release(h);
+	if (ret == 0)
+		pass_stat_end(h);
 
 	return ret;
 }
 
-int ploop_copy_next_iteration(struct ploop_copy_handle *h,
-		struct ploop_copy_stat *stat)
+int ploop_copy_get_stat(struct ploop_copy_handle *h,
+		struct ploop_copy_pass_stat *stat)
 {
-	struct ploop_track_extent e;
-	int ret = 0;
-	int done = 0;
-	__u64 pos;
-	__u64 iterpos = 0;
+	if (h == NULL || stat == NULL)
+		return SYSEXIT_PARAM;
 
-	stat->xferred = 0;
-	ploop_dbg(3, "pcopy iter %d", h->niter);
-	do {
-		if (ioctl(h->devfd, PLOOP_IOC_TRACK_READ, &e)) {
-			if (errno == EAGAIN) /* no more dirty blocks */
-				break;
+	if (stat->version != PLOOP_COPY_PASS_STAT_V1) {
+		ploop_err(0, "Unsupported ploop_copy_pass_stat version %d",
+				stat->version);
+		return SYSEXIT_PARAM;
+	}
 
-			ploop_err(errno, "PLOOP_IOC_TRACK_READ");
-			ret = SYSEXIT_DEVIOC;
-			goto err;
+	memcpy(stat, &h->pstat, sizeof(*stat));
+	stat->version = PLOOP_COPY_PASS_STAT_V1;
+
+	return 0;
+}
+
+
+void ploop_copy_deinit(struct ploop_copy_handle *h)
+{
+	int i;
+
+	if (h == NULL)
+		return;
+
+	ploop_dbg(4, "pcopy deinit");
+
+	for (i = 0; i < h->nstreams; i++) {
+		struct pcopy_stream *s = &h->streams[i];
+
+		if (s->send_th) {
+			pthread_cancel(s->send_th);
+			pthread_join(s->send_th, NULL);
+			s->send_th = 0;
 		}
+	}
+
+	ploop_copy_release(h);
+	free_ploop_copy_handle(h);
 
-		if (e.end > h->trackend)
-			h->trackend = e.end;
+	ploop_dbg(3, "pcopy deinit done");
+}
 
-		if (e.start < iterpos)
-			done = 1;
+/*
+ * Offline copy. The image is not mounted and the disk descriptor is
+ * locked, so nothing changes the image while it is sent and a single
+ * pass does. Either the delta is sent as it is, or the chain up to it
+ * is flattened to a single image.
+ */
 
-		iterpos = e.end;
-		stat->xferred += e.end - e.start;
+/* Send the data from memory, zero clusters are not sent as data */
+static int send_mem(struct ploop_copy_handle *h, const void *data,
+		__u64 size, __u64 pos)
+{
+	__u64 off, len;
+	int ret;
 
-		for (pos = e.start; pos < e.end; ) {
-			ssize_t n;
-			__u64 copy = e.end - pos;
+	for (off = 0; off < size; off += len) {
+		struct pcopy_stream *s = get_stream(h, pos + off);
+		void *buf = get_free_iobuf(s);
+
+		len = MIN(size - off, h->cluster);
+		memcpy(buf, (const char *)data + off, len);
+		if (is_zero_block(buf, len)) {
+			put_iobuf(s);
+			ret = send_zero_async(h, len, pos + off);
+		} else
+			ret = send_async(h, buf, len, pos + off);
+		if (ret)
+			return ret;
+	}
 
-			if (copy > h->cluster)
-				copy = h->cluster;
+	return 0;
+}
 
-			if (pos + copy > h->trackpos) {
-				h->trackpos = pos + copy;
-				if (ioctl(h->devfd, PLOOP_IOC_TRACK_SETPOS, &h->trackpos)) {
-					ploop_err(errno, "PLOOP_IOC_TRACK_SETPOS");
-					ret = SYSEXIT_DEVIOC;
-					goto err;
-				}
-			}
+/* The header goes last, clearing the dirty flag it was sent with */
+static int send_clean_header(struct ploop_copy_handle *h, const void *hdr)
+{
+	struct ploop_pvd_header *vh = get_free_iobuf(&h->streams[0]);
+	int ret;
 
-			ret = send_image_block(h, copy, pos, &n);
-			if (ret)
-				goto err;
-			if (n != copy) {
-				ploop_err(errno, "Short read");
-				ret = SYSEXIT_READ;
-				goto err;
-			}
+	memcpy(vh, hdr, 4096);
+	/* SIGNATURE_DISK_CLOSED_V21 is kept, it validates the extension */
+	if (vh->m_DiskInUse == SIGNATURE_DISK_IN_USE)
+		vh->m_DiskInUse = 0;
+
+	ploop_dbg(3, "Update header");
+	ret = send_buf(&h->streams[0], vh, 4096, 0);
+	put_iobuf(&h->streams[0]);
+
+	return ret;
+}
+
+/*
+ * A run of clusters contiguous both in the source and in the image
+ * sent, read by a single preadv() right into the buffers of the streams
+ * they are sent by. It takes no more than half of the ring of a stream,
+ * so the sender has the other half to send while the run is read.
+ */
+struct pcopy_run {
+	int fd;
+	off_t src;
+	__u64 pos;
+	__u64 len;
+	int n;
+	struct iovec iov[PCOPY_BATCH];
+};
+
+static int flush_run(struct ploop_copy_handle *h, struct pcopy_run *run)
+{
+	__u64 pos, t;
+	ssize_t len;
+	int i, n, ret;
+
+	if (run->n == 0)
+		return 0;
+
+	ploop_dbg(4, "READ size=%llu pos=%llu segs=%d",
+			run->len, run->pos, run->n);
+	t = now_us();
+	len = TEMP_FAILURE_RETRY(preadv(run->fd, run->iov, run->n, run->src));
+	h->pstat.read_us += now_us() - t;
+	if (len != run->len) {
+		if (len < 0)
+			ploop_err(errno, "Error from preadv() size=%llu pos=%llu",
+					run->len, (unsigned long long)run->src);
+		else
+			ploop_err(0, "Short read");
+		return SYSEXIT_READ;
+	}
+	h->pstat.read_bytes += len;
+
+	/* queue the buffers in the order they were taken */
+	n = run->n;
+	run->n = 0;
+	for (i = 0, pos = run->pos; i < n; pos += run->iov[i++].iov_len) {
+		ret = send_read_buf(h, run->iov[i].iov_base,
+				run->iov[i].iov_len, pos);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int add_to_run(struct ploop_copy_handle *h, struct pcopy_run *run,
+		int fd, off_t src, __u64 len, __u64 pos)
+{
+	int max = MIN(PCOPY_BATCH, PCOPY_RING_SIZE / 2 * h->nstreams);
+	int ret;
+
+	if (run->n && (run->n == max || fd != run->fd ||
+			src != run->src + run->len ||
+			pos != run->pos + run->len)) {
+		ret = flush_run(h, run);
+		if (ret)
+			return ret;
+	}
+
+	if (run->n == 0) {
+		run->fd = fd;
+		run->src = src;
+		run->pos = pos;
+		run->len = 0;
+	}
+	run->iov[run->n].iov_base = get_free_iobuf(get_stream(h, pos));
+	run->iov[run->n].iov_len = len;
+	run->n++;
+	run->len += len;
+
+	return 0;
+}
+
+/* The slices of the dirty bitmap are kept before the format extension */
+static int mark_ext_bitmap(struct ploop_copy_handle *h, __u64 offset)
+{
+	struct ploop_pvd_ext_block_check *hc;
+	struct ploop_pvd_ext_block_element_header *e;
+	struct ploop_pvd_dirty_bitmap_raw *raw;
+	__u8 *block, *data, *end;
+	__u64 *p, clu;
+	int ret = 0;
 
-			pos += n;
-			if (pos > h->eof_offset)
-				h->eof_offset = pos;
-		}
-	} while (!done);
+	if (p_memalign((void **)&block, 4096, h->cluster))
+		return SYSEXIT_MALLOC;
 
-	wait_sender(h);
+	if (PREAD(&h->idelta, block, h->cluster, offset)) {
+		ret = SYSEXIT_READ;
+		goto out;
+	}
 
-	/* sync after each iteration */
-	ret = send_cmd(h, PCOPY_CMD_SYNC);
-	if (ret)
-		goto err;
+	/* a spoiled extension is dropped on load, it is sent as it is */
+	hc = (struct ploop_pvd_ext_block_check *)block;
+	if (hc->m_Magic != FORMAT_EXTENSION_MAGIC)
+		goto out;
 
-	stat->xferred_total += stat->xferred;
+	end = block + h->cluster;
+	for (e = (void *)(hc + 1); ; e = (void *)(data + e->size)) {
+		data = (__u8 *)(e + 1);
+		if (data > end || data + e->size > end || e->magic == 0)
+			break;
+		if (e->magic != EXT_MAGIC_DIRTY_BITMAP)
+			continue;
 
-	ploop_log(3, "pcopy iter %d xferred=%" PRIu64,
-			h->niter++, (uint64_t)stat->xferred);
+		raw = (struct ploop_pvd_dirty_bitmap_raw *)data;
+		if (sizeof(*raw) + (__u64)raw->m_L1Size * sizeof(*p) > e->size)
+			break;
+		/* 0 and 1 stand for a slice of all zeroes or ones */
+		for (p = raw->m_L1; p < raw->m_L1 + raw->m_L1Size; p++) {
+			if (*p <= 1)
+				continue;
+			clu = S2B(*p) / h->cluster;
+			if (grow_maps(h, clu + 1)) {
+				ret = SYSEXIT_MALLOC;
+				goto out;
+			}
+			BMAP_SET(h->refmap, clu);
+		}
+	}
 
-	return 0;
+out:
+	free(block);
 
-err:
-	ploop_copy_release(h);
 	return ret;
 }
 
-static int freeze_fs(struct ploop_copy_handle *h)
+/*
+ * Send the delta as it is. The data clusters not referenced by the
+ * index and holes in the file are sent as holes; the rest is read in
+ * runs, a cluster per packet.
+ */
+static int send_delta(struct ploop_copy_handle *h, void *hdr,
+		__u64 *xferred)
 {
+	struct delta *d = &h->idelta;
+	struct ploop_pvd_header *vh;
+	struct pcopy_run run = {};
+	struct stat st;
+	__u64 pos, len, end, clu;
+	__u32 iblk;
 	int ret;
 
-	if (h->mntfd != -1) {
-		/* Sync fs */
-		ploop_log(0, "Freezing fs...");
-		if (sys_syncfs(h->mntfd)) {
-			ploop_err(errno, "syncfs() failed");
-			return SYSEXIT_FSYNC;
-		}
+	if (fstat(d->fd, &st)) {
+		ploop_err(errno, "Can't fstat image");
+		return SYSEXIT_FSTAT;
+	}
 
-		/* Flush journal and freeze fs (this also clears the fs dirty bit) */
-		ploop_dbg(3, "FIFREEZE");
-		ret = ioctl_device(h->mntfd, FIFREEZE, 0);
-		if (ret)
-			return ret;
+	pos = 0;
+	if (!h->raw) {
+		vh = (struct ploop_pvd_header *)d->hdr0;
+		h->data_off = S2B(vh->m_FirstBlockOffset);
 
-		h->fs_frozen = 1;
-	}
+		for (clu = 0; clu < d->l2_size; clu++) {
+			ret = get_idx_entry(d, clu, &iblk);
+			if (ret)
+				return ret;
+			if (iblk == 0)
+				continue;
 
-	return 0;
-}
+			end = S2B(ploop_ioff_to_sec(iblk, d->blocksize,
+						d->version)) / h->cluster;
+			if (grow_maps(h, end + 1))
+				return SYSEXIT_MALLOC;
+			BMAP_SET(h->refmap, end);
+		}
 
-static int freeze(struct ploop_copy_handle *h)
-{
-	int ret;
+		/* the format extension follows the data clusters */
+		if (vh->m_FormatExtensionOffset) {
+			end = (st.st_size + h->cluster - 1) / h->cluster;
+			if (grow_maps(h, end))
+				return SYSEXIT_MALLOC;
+			for (clu = S2B(vh->m_FormatExtensionOffset) / h->cluster;
+					clu < end; clu++)
+				BMAP_SET(h->refmap, clu);
+
+			ret = mark_ext_bitmap(h,
+					S2B(vh->m_FormatExtensionOffset));
+			if (ret)
+				return ret;
+		}
 
-	ret = ioctl(h->partfd, PLOOP_IOC_FREEZE);
-	if (ret) {
-		if (errno == EINVAL)
-			ret = freeze_fs(h);
-		else
-			ploop_err(errno, "Failed to freeze device");
+		/* the header is dirty till the image is complete */
+		memcpy(hdr, d->hdr0, 4096);
+		len = MIN(h->cluster, st.st_size);
+		vh = get_free_iobuf(&h->streams[0]);
+		if (PREAD(d, vh, len, 0)) {
+			put_iobuf(&h->streams[0]);
+			return SYSEXIT_READ;
+		}
+		vh->m_DiskInUse = SIGNATURE_DISK_IN_USE;
+		ret = send_async(h, vh, len, 0);
 		if (ret)
-			goto err;
+			return ret;
+		pos = len;
+	}
 
-	} else {
-		ploop_log(0, "Freezing device...");
-		h->dev_frozen = 1;
+	for (; pos < st.st_size; pos += len) {
+		end = get_skip_end(h, pos, st.st_size);
+		if (end > pos) {
+			len = end - pos;
+			ret = flush_run(h, &run);
+			if (ret == 0)
+				ret = send_hole_async(h, len, pos);
+		} else {
+			len = MIN(h->cluster, st.st_size - pos);
+			if (can_send_file(h, len, pos)) {
+				ret = flush_run(h, &run);
+				if (ret == 0)
+					ret = send_async(h, NULL, len, pos);
+			} else
+				ret = add_to_run(h, &run, d->fd, pos, len, pos);
+			*xferred += len;
+		}
+		if (ret)
+			return ret;
 	}
 
-	ploop_dbg(3, "IOC_SYNC");
-	ret = ioctl_device(h->devfd, PLOOP_IOC_SYNC, 0);
+	ret = flush_run(h, &run);
 	if (ret)
-		goto err;
+		return ret;
+
+	h->eof_offset = st.st_size;
 
 	return 0;
-err:
-	ploop_copy_release(h);
-	return ret;
 }
 
-static int cbt_writer(void *data, const void *buf, int len, off_t pos)
+/* Find the topmost delta the cluster is allocated in */
+static int get_flat_src(struct delta_array *da, __u32 clu, int *fd,
+		off_t *src)
 {
-	struct ploop_copy_handle *h = (struct ploop_copy_handle *)data;
+	__u32 iblk;
+	int i, ret;
 
-	h->eof_offset += len;
+	for (i = da->delta_max - 1; i >= 0; i--) {
+		struct delta *d = &da->delta_arr[i];
+
+		ret = get_idx_entry(d, clu, &iblk);
+		if (ret)
+			return ret;
+		if (iblk) {
+			*fd = d->fd;
+			*src = S2B(ploop_ioff_to_sec(iblk, d->blocksize,
+						d->version));
+			return 0;
+		}
+	}
 
-	return send_buf(h, buf, len, pos);
+	*fd = -1;
+
+	return 0;
 }
 
-static int send_optional_header(struct ploop_copy_handle *copy_h)
+/*
+ * Flatten the ploop1 chain: the clusters are allocated densely in
+ * the logical order, so the image is written sequentially and has
+ * no unreferenced clusters. The index is built before any data.
+ */
+static int send_flat(struct ploop_copy_handle *h, struct delta_array *da,
+		void *hdr, __u64 *xferred)
 {
-	int ret;
+	struct delta *top = &da->delta_arr[da->delta_max - 1];
 	struct ploop_pvd_header *vh;
-	size_t block_size;
-	struct ploop_pvd_ext_block_check *hc;
-	struct ploop_pvd_ext_block_element_header *h;
-	__u8 *block = NULL, *data;
-
-	vh = (struct ploop_pvd_header *)copy_h->idelta.hdr0;
-	block_size = vh->m_Sectors * SECTOR_SIZE;
-	if (p_memalign((void **)&block, 4096, block_size))
+	struct pcopy_run run = {};
+	__u32 *idx = NULL;
+	__u64 clu, pos, n = 0;
+	off_t src;
+	int fd, ret;
+
+	vh = (struct ploop_pvd_header *)top->hdr0;
+	h->data_off = S2B(vh->m_FirstBlockOffset);
+	if (p_memalign((void **)&idx, 4096, h->data_off))
 		return SYSEXIT_MALLOC;
+	memset(idx, 0, h->data_off);
 
-	hc = (struct ploop_pvd_ext_block_check *)block;
-	h = (struct ploop_pvd_ext_block_element_header *)(hc + 1);
-	data = (__u8 *)(h + 1);
-	h->magic = EXT_MAGIC_DIRTY_BITMAP;
+	vh = (struct ploop_pvd_header *)idx;
+	memcpy(vh, top->hdr0, sizeof(*vh));
+	vh->m_DiskInUse = SIGNATURE_DISK_IN_USE;
+	vh->m_FormatExtensionOffset = 0;
 
-	ret = save_dirty_bitmap(copy_h->devfd, &copy_h->idelta,
-			copy_h->eof_offset, data, &h->size,
-			NULL, cbt_writer, copy_h);
-	if (ret) {
-		if (ret == SYSEXIT_NOCBT)
-			ret = 0;
-		goto out;
+	for (clu = 0; clu < top->l2_size; clu++) {
+		ret = get_flat_src(da, clu, &fd, &src);
+		if (ret)
+			goto out;
+		if (fd != -1)
+			idx[PLOOP_MAP_OFFSET + clu] = ploop_sec_to_ioff(
+					vh->m_FirstBlockOffset + n++ * top->blocksize,
+					top->blocksize, top->version);
 	}
+	if (n)
+		vh->m_Flags &= ~CIF_Empty;
 
-	vh->m_DiskInUse = SIGNATURE_DISK_CLOSED_V21;
-	vh->m_FormatExtensionOffset = (copy_h->eof_offset + SECTOR_SIZE - 1) / SECTOR_SIZE;
-	if (send_buf(copy_h, vh, sizeof(*vh), 0)) {
-		ploop_err(errno, "Can't write header");
-		ret = SYSEXIT_WRITE;
+	ploop_log(0, "Flattened image: %llu clusters",
+			(unsigned long long)n);
+	memcpy(hdr, idx, 4096);
+	ret = send_mem(h, idx, h->data_off, 0);
+	if (ret)
 		goto out;
+
+	pos = h->data_off;
+	for (clu = 0; clu < top->l2_size; clu++) {
+		ret = get_flat_src(da, clu, &fd, &src);
+		if (ret)
+			goto out;
+		if (fd == -1)
+			continue;
+
+		ret = add_to_run(h, &run, fd, src, h->cluster, pos);
+		if (ret)
+			goto out;
+		pos += h->cluster;
+		*xferred += h->cluster;
 	}
-	ploop_log(3, "Send extension header offset=%llu size=%d",
-			vh->m_FormatExtensionOffset * SECTOR_SIZE, h->size);
-	hc->m_Magic = FORMAT_EXTENSION_MAGIC;
-	MD5((const unsigned char *)(hc + 1), block_size - sizeof(*hc), hc->m_Md5);
 
-	if (send_buf(copy_h, block, block_size, vh->m_FormatExtensionOffset * SECTOR_SIZE)) {
-		ploop_err(errno, "Can't write optional header");
-		ret = SYSEXIT_WRITE;
+	ret = flush_run(h, &run);
+	if (ret)
 		goto out;
-	}
 
+	h->eof_offset = pos;
 out:
-	free(block);
+	free(idx);
 
 	return ret;
 }
 
-int ploop_copy_stop(struct ploop_copy_handle *h,
-		struct ploop_copy_stat *stat)
+/*
+ * Flatten the chain on the raw base: the image is raw, the clusters
+ * of the deltas are put in place of the base ones.
+ */
+static int send_flat_raw(struct ploop_copy_handle *h, struct delta_array *da,
+		__u64 *xferred)
 {
-	int ret;
-	int iter;
+	struct pcopy_run run = {};
+	struct stat st;
+	__u64 size, pos, len, hole_pos = 0, hole_len = 0;
+	off_t src, data = -1;
+	int fd, ret;
 
-	ploop_log(3, "pcopy last");
+	if (fstat(da->raw_fd, &st)) {
+		ploop_err(errno, "Can't fstat image");
+		return SYSEXIT_FSTAT;
+	}
 
-	ret = freeze(h);
-	if (ret)
-		goto err;
+	size = st.st_size;
+	if (da->delta_max) {
+		struct delta *top = &da->delta_arr[da->delta_max - 1];
 
-	iter = 1;
-	for (;;) {
-		ret = ploop_copy_next_iteration(h, stat);
-		if (ret)
-			goto err;
-		else if (stat->xferred == 0)
-			break;
-		if (iter++ > 2) {
-			ploop_err(0, "Too many iterations on frozen FS, aborting");
-			return SYSEXIT_LOOP;
-		}
+		size = MAX(size, S2B(get_SizeInSectors(
+				(struct ploop_pvd_header *)top->hdr0)));
 	}
 
-	if (!h->raw) {
-		/* Must clear dirty flag on ploop1 image. */
-		struct ploop_pvd_header *vh = get_free_iobuf(h);
+	for (pos = 0; pos < size; pos += len) {
+		len = MIN(h->cluster, size - pos);
+		ret = get_flat_src(da, pos / h->cluster, &fd, &src);
+		if (ret)
+			return ret;
 
-		if (PREAD(&h->idelta, vh, 4096, 0)) {
-			ret = SYSEXIT_READ;
-			goto err;
+		if (fd == -1 && pos < st.st_size) {
+			if (data < (off_t)pos) {
+				data = lseek(da->raw_fd, pos, SEEK_DATA);
+				if (data == -1)
+					/* ENXIO: no data till EOF */
+					data = errno == ENXIO ? st.st_size : pos;
+			}
+			if (data < pos + len) {
+				fd = da->raw_fd;
+				src = pos;
+				len = MIN(len, st.st_size - pos);
+			}
 		}
 
-		vh->m_DiskInUse = 0;
+		if (fd == -1) {
+			if (hole_len == 0)
+				hole_pos = pos;
+			hole_len += len;
+			continue;
+		}
 
-		ploop_dbg(3, "Update header");
+		if (hole_len) {
+			ret = flush_run(h, &run);
+			if (ret == 0)
+				ret = send_hole_async(h, hole_len, hole_pos);
+			if (ret)
+				return ret;
+			hole_len = 0;
+		}
 
-		ret = send_buf(h, vh, 4096, 0);
+		ret = add_to_run(h, &run, fd, src, len, pos);
 		if (ret)
-			goto err;
+			return ret;
+		*xferred += len;
+	}
 
-		ret = send_optional_header(h);
+	ret = flush_run(h, &run);
+	if (ret)
+		return ret;
+
+	if (hole_len) {
+		ret = send_hole_async(h, hole_len, hole_pos);
 		if (ret)
-			goto err;
+			return ret;
 	}
 
-	ploop_dbg(4, "IOCTL TRACK_STOP");
-	ret = ioctl(h->devfd, PLOOP_IOC_TRACK_STOP, 0);
+	h->eof_offset = size;
+
+	return 0;
+}
+
+int ploop_copy_image(struct ploop_disk_images_data *di, const char *guid,
+		int flags, struct ploop_copy_param *param,
+		struct ploop_copy_stat *stat)
+{
+	struct ploop_copy_handle *h = NULL;
+	struct delta_array da;
+	char **images = NULL;
+	char dev[64];
+	void *hdr = NULL;
+	__u64 xferred = 0;
+	int ret, rc, is_remote, i, n;
+	int flatten = flags & PLOOP_COPY_FLATTEN;
+
+	ret = check_copy_param(param, &is_remote);
 	if (ret)
+		return ret;
+
+	init_delta_array(&da);
+
+	if (ploop_lock_dd(di))
+		return SYSEXIT_LOCK;
+
+	rc = ploop_find_dev_by_dd(di, dev, sizeof(dev));
+	if (rc == -1) {
+		ret = SYSEXIT_SYS;
 		goto err;
+	} else if (rc == 0) {
+		ploop_err(0, "Image is mounted on %s: use the online copy", dev);
+		ret = SYSEXIT_PARAM;
+		goto err;
+	}
 
-	h->tracker_on = 0;
+	images = make_images_list(di, guid != NULL ? guid : di->top_guid, 0);
+	if (images == NULL) {
+		ret = SYSEXIT_PARAM;
+		goto err;
+	}
+	n = get_list_size(images);
 
-	ploop_dbg(3, "SEND 0 0 (close)");
-	send_async(h, NULL, 0, 0);
+	h = alloc_ploop_copy_handle(S2B(di->blocksize), 1 + param->nofds);
+	if (h == NULL) {
+		ploop_err(0, "alloc_ploop_copy_handle");
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
+	set_copy_param(h, param, is_remote);
+	h->cl = register_cleanup_hook(cancel_sender, h);
 
-	pthread_join(h->send_th, NULL);
-	h->send_th = 0;
+	if (p_memalign(&hdr, 4096, 4096)) {
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
 
-	ploop_dbg(3, "pcopy stop done");
+	/* only the base can be raw */
+	h->raw = di->mode == PLOOP_RAW_MODE && (flatten || n == 1);
+	if (flatten) {
+		for (i = 0; i < n; i++) {
+			if (i == 0 && di->mode == PLOOP_RAW_MODE) {
+				da.raw_fd = open(images[i],
+						O_RDONLY|O_DIRECT|O_CLOEXEC);
+				if (da.raw_fd == -1) {
+					ploop_err(errno, "Can't open %s", images[i]);
+					ret = SYSEXIT_OPEN;
+					goto err;
+				}
+				continue;
+			}
 
-err:
-	ploop_copy_release(h);
+			if (extend_delta_array(&da, images[i],
+						O_RDONLY|O_DIRECT,
+						OD_OFFLINE|OD_LOAD_BAT)) {
+				ret = SYSEXIT_OPEN;
+				goto err;
+			}
+			if (da.delta_arr[da.delta_max - 1].blocksize != di->blocksize) {
+				ploop_err(0, "Image %s has a different cluster size",
+						images[i]);
+				ret = SYSEXIT_PARAM;
+				goto err;
+			}
+		}
 
-	return ret;
-}
+		if (h->zerocopy) {
+			ploop_log(1, "Zero-copy is not used for a flattened image");
+			h->zerocopy = 0;
+		}
+	} else if (h->raw ?
+			open_delta_simple(&h->idelta, images[n - 1],
+				O_RDONLY|O_DIRECT, OD_NOFLAGS) :
+			open_delta(&h->idelta, images[n - 1],
+				O_RDONLY|O_DIRECT, OD_OFFLINE|OD_LOAD_BAT)) {
+		ret = SYSEXIT_OPEN;
+		goto err;
+	} else if (!h->raw && h->idelta.blocksize != di->blocksize) {
+		ploop_err(0, "Image %s has a different cluster size",
+				images[n - 1]);
+		ret = SYSEXIT_PARAM;
+		goto err;
+	}
 
+	ploop_log(0, "Send image %s%s fmt=%s blocksize=%d local=%d streams=%d",
+			images[n - 1], flatten ? " flattened" : "",
+			h->raw ? "raw" : "ploop1", di->blocksize, !is_remote,
+			h->nstreams);
 
-void ploop_copy_deinit(struct ploop_copy_handle *h)
-{
-	if (h == NULL)
-		return;
+	ret = start_senders(h);
+	if (ret)
+		goto err;
 
-	ploop_dbg(4, "pcopy deinit");
+	h->resume_pass = h->nrhash != 0;
+	if (!flatten)
+		ret = send_delta(h, hdr, &xferred);
+	else if (h->raw)
+		ret = send_flat_raw(h, &da, &xferred);
+	else
+		ret = send_flat(h, &da, hdr, &xferred);
+	if (ret)
+		goto err;
+
+	ret = wait_sender(h);
+	h->resume_pass = 0;
+	if (ret)
+		goto err;
 
-	pthread_mutex_unlock(&h->sd.wait_mutex);
+	xferred -= get_matched(h, xferred);
 
-	if (h->send_th) {
-		pthread_cancel(h->send_th);
-		pthread_join(h->send_th, NULL);
-		h->send_th = 0;
+	ret = send_truncate(h);
+	if (ret)
+		goto err;
+
+	if (!h->raw) {
+		ret = send_clean_header(h, hdr);
+		if (ret)
+			goto err;
 	}
 
-	ploop_copy_release(h);
-	free_ploop_copy_handle(h);
+	ret = close_streams(h);
+	if (ret)
+		goto err;
 
-	ploop_dbg(3, "pcopy deinit done");
+	stat->xferred_total = stat->xferred = xferred;
+	ploop_log(0, "Image sent: %llu bytes", (unsigned long long)xferred);
+
+err:
+	ploop_copy_deinit(h);
+	deinit_delta_array(&da);
+	ploop_free_array(images);
+	free(hdr);
+	ploop_unlock_dd(di);
+
+	return ret;
 }
@@ -111,6 +111,13 @@ int sys_syncfs(int fd)
 	return syscall(__NR_syncfs, fd);
 }
 
+ssize_t sys_copy_file_range(int fd_in, loff_t *off_in, int fd_out,
+		loff_t *off_out, size_t len, unsigned int flags)
+{
+	return syscall(__NR_copy_file_range, fd_in, off_in, fd_out,
+			off_out, len, flags);
+}
+
 int get_list_size(char **list)
 {
 	int i;
@@ -3279,10 +3286,13 @@ static int expanded2raw(struct ploop_disk_images_data *di)
 	char tmp[PATH_MAX] = "";
 	int ret = -1;
 	__u64 cluster;
+	struct io_throttle *throttle = io_throttle_get(0, 0);
+	double start;
 
 	ploop_log(0, "Converting image to raw...");
 	// FIXME: deny snapshots
-	if (open_delta(&delta, di->images[0]->file, O_RDONLY, OD_OFFLINE))
+	if (open_delta(&delta, di->images[0]->file, O_RDONLY,
+				OD_OFFLINE | OD_LOAD_BAT))
 		return SYSEXIT_OPEN;
 	cluster = S2B(delta.blocksize);
 
@@ -3295,28 +3305,20 @@ static int expanded2raw(struct ploop_disk_images_data *di)
 		goto err;
 
 	for (clu = 0; clu < delta.l2_size; clu++) {
-		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
-		__u32 l2_slot  = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
-
-		if (l2_cluster >= delta.l1_size) {
-			ploop_err(0, "abort: l2_cluster >= delta.l1_size");
+		__u32 iblk;
 
+		if (get_idx_entry(&delta, clu, &iblk))
 			goto err;
-		}
 
-		if (delta.l2_cache != l2_cluster) {
-			if (PREAD(&delta, delta.l2, cluster, (off_t)l2_cluster * cluster))
-				goto err;
-			delta.l2_cache = l2_cluster;
-		}
 		if (delta.version == PLOOP_FMT_V1 &&
-				(delta.l2[l2_slot] % delta.blocksize) != 0) {
-			ploop_err(0, "Image corrupted: delta.l2[%d]=%d",
-					l2_slot, delta.l2[l2_slot]);
+				(iblk % delta.blocksize) != 0) {
+			ploop_err(0, "Image corrupted: clu %u iblk=%u",
+					clu, iblk);
 			goto err;
 		}
-		if (delta.l2[l2_slot] != 0) {
-			if (PREAD(&delta, buf, cluster, S2B(ploop_ioff_to_sec(delta.l2[l2_slot],
+		start = io_throttle_wait(throttle, cluster, iblk ? 2 : 1);
+		if (iblk != 0) {
+			if (PREAD(&delta, buf, cluster, S2B(ploop_ioff_to_sec(iblk,
 								delta.blocksize, delta.version))))
 				goto err;
 		} else {
@@ -3325,6 +3327,7 @@ static int expanded2raw(struct ploop_disk_images_data *di)
 
 		if (PWRITE(&odelta, buf, cluster, clu * cluster))
 			goto err;
+		io_throttle_done(throttle, start, cluster);
 	}
 
 	if (fsync(odelta.fd))
@@ -3357,7 +3360,8 @@ static int expanded2preallocated(struct ploop_disk_images_data *di)
 
 	ploop_log(0, "Converting image to preallocated...");
 	// FIXME: deny on snapshots
-	if (open_delta(&delta, di->images[0]->file, O_RDWR, OD_OFFLINE))
+	if (open_delta(&delta, di->images[0]->file, O_RDWR,
+				OD_OFFLINE | OD_LOAD_BAT))
 		return SYSEXIT_OPEN;
 
 	cluster = S2B(delta.blocksize);
@@ -3365,52 +3369,49 @@ static int expanded2preallocated(struct ploop_disk_images_data *di)
 
 	// Second stage: update index
 	for (clu = 0; clu < delta.l2_size; clu++) {
-		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
-		__u32 l2_slot  = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
+		__u32 iblk;
+		int rc;
 
-		if (l2_cluster >= delta.l1_size) {
-			ploop_err(0, "abort: l2_cluster >= delta.l1_size");
+		if (get_idx_entry(&delta, clu, &iblk))
 			goto err;
-		}
-
-		if (delta.l2_cache != l2_cluster) {
-			if (PREAD(&delta, delta.l2, cluster, (off_t)l2_cluster * cluster))
-				goto err;
-			delta.l2_cache = l2_cluster;
-		}
-		if (delta.l2[l2_slot] == 0) {
-			off_t idx_off = (off_t)l2_cluster * cluster + (l2_slot*sizeof(__u32));
-			int rc;
-
-			delta.l2[l2_slot] = ploop_sec_to_ioff(data_off * delta.blocksize,
-					delta.blocksize, delta.version);
+		if (iblk != 0)
+			continue;
 
-			rc = sys_fallocate(delta.fd, 0, data_off * cluster, cluster);
-			if (rc) {
-				if (errno == ENOTSUP) {
+		rc = sys_fallocate(delta.fd, 0, data_off * cluster, cluster);
+		if (rc) {
+			if (errno == ENOTSUP) {
+				if (buf == NULL) {
+					ploop_log(0, "Warning: fallocate is not supported,"
+							" using write instead");
+					buf = calloc(1, cluster);
 					if (buf == NULL) {
-						ploop_log(0, "Warning: fallocate is not supported,"
-								" using write instead");
-						buf = calloc(1, cluster);
-						if (buf == NULL) {
-							ploop_err(errno, "malloc");
-							goto err;
-						}
+						ploop_err(errno, "malloc");
+						goto err;
 					}
-					rc = PWRITE(&delta, buf, cluster, data_off * cluster);
-				}
-				if (rc) {
-					ploop_err(errno, "Failed to expand %s", di->images[0]->file);
-					goto err;
 				}
+				rc = PWRITE(&delta, buf, cluster, data_off * cluster);
 			}
-
-			if (PWRITE(&delta, &delta.l2[l2_slot], sizeof(__u32), idx_off))
+			if (rc) {
+				ploop_err(errno, "Failed to expand %s", di->images[0]->file);
 				goto err;
-			data_off++;
+			}
 		}
+
+		if (set_idx_entry(&delta, clu, ploop_sec_to_ioff(data_off * delta.blocksize,
+					delta.blocksize, delta.version)))
+			goto err;
+		data_off++;
+	}
+
+	/* Allocated blocks must be on disk before the index points to them */
+	if (fsync(delta.fd)) {
+		ploop_err(errno, "fsync");
+		goto err;
 	}
 
+	if (write_idx_table(&delta))
+		goto err;
+
 	if (fsync(delta.fd)) {
 		ploop_err(errno, "fsync");
 		goto err;
@@ -3486,7 +3487,12 @@ static int backup_idx_table(struct delta *d, const char *image)
 	}
 
 	cluster = S2B(d->blocksize);
-	for (clu = 0; clu < d->l1_size; clu++) {
+	if (d->bat) {
+		if (WRITE(fd, d->bat, d->l1_size * cluster)) {
+			ret = SYSEXIT_WRITE;
+			goto err;
+		}
+	} else for (clu = 0; clu < d->l1_size; clu++) {
 		if (PREAD(d, d->l2, cluster, (off_t)clu * cluster)) {
 			ret = SYSEXIT_WRITE;
 			goto err;
@@ -3508,58 +3514,35 @@ err:
 	return ret;
 }
 
-/* Write index table */
-static int writeback_idx(struct delta *delta)
-{
-	__u32 l1_cluster = delta->l2_cache;
-	__u8 *buf = (__u8 *)delta->l2;
-	int skip = l1_cluster == 0 ? sizeof(struct ploop_pvd_header) : 0;
-
-	if (PWRITE(delta, (__u8 *)buf + skip, S2B(delta->blocksize) - skip,
-				(off_t)l1_cluster * S2B(delta->blocksize) + skip))
-		return SYSEXIT_WRITE;
-
-	delta->dirtied = 0;
-	return 0;
-}
-
 static int change_fmt_version(struct delta *d, int new_version)
 {
-	__u32 clu, l2_cluster, l2_slot;
+	__u32 clu, iblk;
 	int ret, n;
 	off_t off;
 	__u32 cluster = S2B(d->blocksize);
 
 	n = cluster / sizeof(__u32);
-	d->dirtied = 0;
 	for (clu = 0; clu < d->l1_size * n - PLOOP_MAP_OFFSET; clu++) {
-		l2_cluster = (clu + PLOOP_MAP_OFFSET) / n;
-		l2_slot    = (clu + PLOOP_MAP_OFFSET) % n;
-
-		if (d->l2_cache != l2_cluster) {
-			if (d->dirtied && (ret = writeback_idx(d)))
-				goto err;
-
-			if (PREAD(d, d->l2, cluster, (off_t)l2_cluster * cluster)) {
-				ret = SYSEXIT_READ;
-				goto err;
-			}
-
-			d->l2_cache = l2_cluster;
+		if (get_idx_entry(d, clu, &iblk)) {
+			ret = SYSEXIT_READ;
+			goto err;
 		}
-		if (d->l2[l2_slot] == 0)
+		if (iblk == 0)
 			continue;
 
-		off = ploop_ioff_to_sec(d->l2[l2_slot], d->blocksize, d->version);
+		off = ploop_ioff_to_sec(iblk, d->blocksize, d->version);
 		if (new_version == PLOOP_FMT_V1 && check_size(off, d->blocksize, new_version)) {
 			ret = SYSEXIT_PARAM;
 			goto err;
 		}
-		d->l2[l2_slot] = ploop_sec_to_ioff(off, d->blocksize, new_version);
-		d->dirtied = 1;
+		ret = set_idx_entry(d, clu, ploop_sec_to_ioff(off, d->blocksize,
+					new_version));
+		if (ret)
+			goto err;
 	}
 
-	if (d->dirtied && (ret = writeback_idx(d)))
+	ret = write_idx_table(d);
+	if (ret)
 		goto err;
 
 	/* update header and sync */
@@ -3610,7 +3593,7 @@ int ploop_change_fmt_version(struct ploop_disk_images_data *di, int new_version,
 	/* 0. Validate */
 	for (i = 0; i < di->nimages; i++) {
 		if (extend_delta_array(&da, di->images[i]->file,
-					O_RDWR, OD_OFFLINE)) {
+					O_RDWR, OD_OFFLINE | OD_LOAD_BAT)) {
 			ret = SYSEXIT_OPEN;
 			goto err;
 		}
@@ -4002,7 +3985,10 @@ int copy_delta(const char *src, const char *dst)
 	struct ploop_pvd_header *vh;
 	int version, cluster = DEF_CLUSTER;
 	struct stat st;
-	off_t i;
+	off_t i, len;
+	int zcopy = ZCOPY_PROBE;
+	struct io_throttle *throttle = io_throttle_get(0, 0);
+	double start;
 	int ret = 0;
 
 	sfd = open(src, O_DIRECT | O_RDONLY);
@@ -4082,6 +4068,22 @@ int copy_delta(const char *src, const char *dst)
 	ploop_log(0, "Copying %lu MB delta %s to %s",
 			(unsigned long)(st.st_size >> 20), src, dst);
 
+	/* Try to share or copy blocks in kernel first, by clusters
+	 * so that the rate can be limited and adapted.
+	 */
+	for (i = 0; i < st.st_size; i += len) {
+		len = cluster;
+		start = io_throttle_wait(throttle, len, 1);
+		ret = copy_range(sfd, i, dfd, i, len, &zcopy);
+		io_throttle_done(throttle, start, len);
+		if (ret == -1)
+			break;
+		if (ret)
+			goto out;
+	}
+	if (i == st.st_size)
+		goto sync;
+
 	/* Preallocate disk space */
 	if (sys_fallocate(dfd, 0, 0, st.st_size) && errno != ENOTSUP) {
 		ploop_err(errno, "Can't fallocate(%s, %lu)",
@@ -4090,16 +4092,19 @@ int copy_delta(const char *src, const char *dst)
 		goto out;
 	}
 
-	/* Copy data */
-	for (i = 0; i < st.st_size; i+=cluster) {
+	/* Copy the rest of data */
+	for (; i < st.st_size; i+=cluster) {
+		start = io_throttle_wait(throttle, cluster, 2);
 		ret = read_safe(sfd, buf, cluster, i, "read cluster");
 		if (ret)
 			goto out;
 		ret = write_safe(dfd, buf, cluster, i, "write cluster");
 		if (ret)
 			goto out;
+		io_throttle_done(throttle, start, cluster);
 	}
 
+sync:
 	if (fsync(dfd)) {
 		ploop_err(errno, "Failed to sync %s", dst);
 		ret = SYSEXIT_FSYNC;
@@ -38,6 +38,16 @@
 #endif
 #endif /* ! __NR_syncfs */
 
+#ifndef __NR_copy_file_range
+#if defined __i386__
+#define __NR_copy_file_range	377
+#elif defined __x86_64__
+#define __NR_copy_file_range	326
+#else
+#error "No copy_file_range syscall known for this arch"
+#endif
+#endif /* ! __NR_copy_file_range */
+
 /* from linux/magic.h */
 #ifndef EXT4_SUPER_MAGIC
 #define EXT4_SUPER_MAGIC	0xEF53
@@ -54,6 +64,7 @@
 #define OD_NOFLAGS	0x0
 #define OD_ALLOW_DIRTY	0x1
 #define OD_OFFLINE	0x2
+#define OD_LOAD_BAT	0x4	/* keep the whole index table in memory */
 
 /* flags for ploop_check() */
 #define CHECK_FORCE	0x01
@@ -101,6 +112,10 @@ struct delta
 	int    version;	  /* ploop1 version */
 
 	void *reserved1;
+
+	__u32 *bat;	  /* whole index table if opened with OD_LOAD_BAT */
+	int    bat_dirty_start; /* range of index CLUSTERs to write back */
+	int    bat_dirty_end;
 };
 
 struct delta_array
@@ -250,6 +265,10 @@ int extend_delta_array(struct delta_array * p, char * path, int rw, int od_flags
 void close_delta(struct delta *delta);
 int open_delta(struct delta * delta, const char * path, int rw, int od_flags);
 int open_delta_simple(struct delta * delta, const char * path, int rw, int od_flags);
+int load_idx_table(struct delta *delta);
+int get_idx_entry(struct delta *delta, __u32 clu, __u32 *iblk);
+int set_idx_entry(struct delta *delta, __u32 clu, __u32 iblk);
+int write_idx_table(struct delta *delta);
 int change_delta_version(struct delta *delta, int version);
 int change_delta_flags(struct delta * delta, __u32 flags);
 int dirty_delta(struct delta * delta);
@@ -347,6 +366,8 @@ int ploop_find_dev_by_dd(struct ploop_disk_images_data *di,
 		char *out, int len);
 int sys_fallocate(int fd, int mode, off_t offset, off_t len);
 int sys_syncfs(int fd);
+ssize_t sys_copy_file_range(int fd_in, loff_t *off_in, int fd_out,
+		loff_t *off_out, size_t len, unsigned int flags);
 int create_snapshot_delta(const char *path, __u32 blocksize, off_t bdsize,
 		int version);
 int get_image_param_online(const char *device, off_t *size,
@@ -452,9 +473,71 @@ int is_device_inuse(const char *dev);
 // merge
 PL_EXT int get_delta_info(const char *device, struct merge_info *info);
 PL_EXT int merge_image(const char *device, int start_level, int end_level, int raw, int merge_top,
-		char **images, const char *new_delta);
-int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di, const char *guid, const char *new_delta);
+		char **images, const char *new_delta, struct ploop_merge_param *param);
+int ploop_merge_snapshot_by_guid(struct ploop_disk_images_data *di, const char *guid,
+		struct ploop_merge_param *param);
 int merge_temporary_snapshots(struct ploop_disk_images_data *di);
+// io_queue
+struct io_queue;
+struct io_throttle;
+struct io_queue *io_queue_create(int depth, __u32 bufsize,
+		struct io_throttle *throttle);
+int io_queue_submit(struct io_queue *q, struct delta *src, off_t src_pos,
+		struct delta *dst, off_t dst_pos, __u32 len);
+int io_queue_drain(struct io_queue *q);
+void io_queue_destroy(struct io_queue *q);
+/* zero-copy modes for copy_range() */
+#define ZCOPY_PROBE	0
+#define ZCOPY_CLONE	1	/* FICLONERANGE */
+#define ZCOPY_CFR	2	/* copy_file_range */
+#define ZCOPY_NONE	3
+int copy_range(int sfd, off_t spos, int dfd, off_t dpos, off_t len,
+		int *mode);
+// throttle
+struct io_throttle *io_throttle_get(__u64 bps, unsigned int iops);
+void io_throttle_put(struct io_throttle *t);
+double io_throttle_wait(struct io_throttle *t, __u64 bytes,
+		unsigned int nr_ios);
+void io_throttle_done(struct io_throttle *t, double start, __u64 bytes);
+__u64 io_throttle_bps(struct io_throttle *t);
+// live copy convergence
+#define PCOPY_DEF_DOWNTIME	1000	/* ms */
+#define PCOPY_MAX_PASSES	10
+struct pcopy_conv {
+	double start;		/* start of the current pass */
+	double prev_start;	/* start of the previous one */
+	double bytes;		/* sent by all the passes */
+	double time;		/* spent in them */
+	double dirty_rate;	/* bytes/s, written meanwhile */
+	int passes;
+};
+void pcopy_conv_start(struct pcopy_conv *c);
+void pcopy_conv_done(struct pcopy_conv *c, __u64 xferred);
+int pcopy_conv_should_stop(struct pcopy_conv *c, unsigned int max_downtime,
+		__u64 *downtime);
+
+// compress
+struct zpool;
+int codec_supported(int id);
+struct zpool *zpool_create(int codec, int level, __u32 maxlen,
+		int nthreads);
+void zpool_destroy(struct zpool *p);
+__u32 zpool_compress(struct zpool *p, const void *src, __u32 len,
+		void **out);
+__u32 zblock_get_size(const void *src, __u32 len);
+int zblock_decompress(const void *src, __u32 len, void *dst, __u32 dlen);
+// merge_journal
+struct merge_journal;
+int merge_journal_open(struct merge_journal **out, struct delta *delta,
+		const char *image, __u32 max, __u32 src_id);
+int merge_journal_resume(struct merge_journal **out, struct delta *delta,
+		const char *image, __u32 max, __u32 src_id, __u32 *next_clu);
+int merge_journal_exists(const char *image);
+int merge_journal_add(struct merge_journal *j, __u32 clu, __u32 iblk);
+int merge_journal_commit(struct merge_journal *j, __u32 next_clu,
+		__u32 alloc_head);
+void merge_journal_close(struct merge_journal *j, int drop);
+int merge_journal_replay(const char *image, int ro);
 
 PL_EXT int ploop_change_fmt_version(struct ploop_disk_images_data *di,
 		int new_version, int flags);
@@ -475,7 +558,14 @@ PL_EXT int ploop_copy_start(struct ploop_copy_handle *h, struct ploop_copy_stat
 PL_EXT int ploop_copy_next_iteration(struct ploop_copy_handle *h, struct ploop_copy_stat *stat);
 PL_EXT int ploop_copy_stop(struct ploop_copy_handle *h, struct ploop_copy_stat *stat);
 PL_EXT void ploop_copy_deinit(struct ploop_copy_handle *h);
+PL_EXT int ploop_copy_should_stop(struct ploop_copy_handle *h,
+		unsigned int max_downtime, __u64 *downtime);
+PL_EXT int ploop_copy_get_stat(struct ploop_copy_handle *h,
+		struct ploop_copy_pass_stat *stat);
 PL_EXT int ploop_copy_receiver(struct ploop_copy_receive_param *arg);
+PL_EXT int ploop_copy_image(struct ploop_disk_images_data *di,
+		const char *guid, int flags, struct ploop_copy_param *param,
+		struct ploop_copy_stat *stat);
 PL_EXT int ploop_create_snapshot_offline(struct ploop_disk_images_data *di,
 		struct ploop_snapshot_param *param);
 int complete_running_operation(struct ploop_disk_images_data *di,
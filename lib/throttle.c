@@ -0,0 +1,264 @@
+/*
+ *  Copyright (c) 2008-2017 Parallels International GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * I/O throttle for long-running data movers (merge, copy, convert).
+ *
+ * A token bucket limits both bytes and I/O requests per second. A caller
+ * takes tokens before an I/O and sleeps if the bucket is in debt, so
+ * concurrent callers are served in turn. Completion times are tracked
+ * to adapt the rate: if the latency of our I/O grows well above the
+ * lowest seen, the storage is assumed to be busy with somebody else's
+ * I/O and the rate is cut down; it recovers as the latency drops.
+ *
+ * Without a limit set the default throttle is adaptive: the rate is not
+ * limited until the latency grows, then the limit starts from the
+ * throughput measured so far, and it is lifted once fully recovered.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ploop.h"
+
+/* Max amount of tokens to accumulate while idle, seconds */
+#define THROTTLE_BURST		0.1
+/* Smoothing of the latency average */
+#define THROTTLE_EWMA_WEIGHT	0.125
+/* Latency above the base one to back off / to recover at */
+#define THROTTLE_BACKOFF_LAT	2.0
+#define THROTTLE_RECOVER_LAT	1.5
+#define THROTTLE_MIN_FACTOR	0.05
+/* Min interval between rate adjustments, seconds */
+#define THROTTLE_ADJUST_INTERVAL	0.1
+
+struct io_throttle {
+	__u64 bps;		/* bytes per second, 0 - unlimited */
+	unsigned int iops;	/* requests per second, 0 - unlimited */
+	int adaptive;		/* no limit set, bps is set on backoff */
+	int owned;		/* freed by io_throttle_put() */
+	pthread_mutex_t lock;
+	double bytes;		/* available tokens, negative is a debt */
+	double ios;
+	double last;		/* time of the last refill */
+	double factor;		/* rate backoff, (0, 1] */
+	double lat;		/* average latency per MB */
+	double base_lat;	/* lowest average latency seen */
+	double adjusted;	/* time of the last rate adjustment */
+	double done;		/* bytes completed since then */
+	double rate;		/* average throughput, bytes per second */
+};
+
+static struct io_throttle default_throttle = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.adaptive = 1,
+	.factor = 1.0,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void throttle_reset(struct io_throttle *t, __u64 bps,
+		unsigned int iops)
+{
+	t->bps = bps;
+	t->iops = iops;
+	t->adaptive = (bps == 0 && iops == 0);
+	t->bytes = 0;
+	t->ios = 0;
+	t->last = now();
+	t->factor = 1.0;
+	t->lat = 0;
+	t->base_lat = 0;
+	t->adjusted = 0;
+	t->done = 0;
+	t->rate = 0;
+}
+
+/* Set the default I/O limits, 0 means unlimited */
+int ploop_set_io_limit(unsigned long long bps, unsigned int iops)
+{
+	pthread_mutex_lock(&default_throttle.lock);
+	throttle_reset(&default_throttle, bps, iops);
+	pthread_mutex_unlock(&default_throttle.lock);
+
+	if (bps || iops)
+		ploop_log(1, "I/O limit: %llu bytes/s %u iops", bps, iops);
+
+	return 0;
+}
+
+/*
+ * Get a throttle with the given limits, or the default one if no
+ * limits are given. Returns NULL if out of memory.
+ */
+struct io_throttle *io_throttle_get(__u64 bps, unsigned int iops)
+{
+	struct io_throttle *t;
+
+	if (bps == 0 && iops == 0)
+		return &default_throttle;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		ploop_err(ENOMEM, "io_throttle_get");
+		return NULL;
+	}
+	t->owned = 1;
+	pthread_mutex_init(&t->lock, NULL);
+	throttle_reset(t, bps, iops);
+
+	return t;
+}
+
+void io_throttle_put(struct io_throttle *t)
+{
+	if (t == NULL || !t->owned)
+		return;
+
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+/* Bytes per second limit set, 0 if unlimited */
+__u64 io_throttle_bps(struct io_throttle *t)
+{
+	return t && !t->adaptive ? t->bps : 0;
+}
+
+static double take_tokens(double *tokens, double rate, double elapsed,
+		double n)
+{
+	if (rate == 0)
+		return 0;
+
+	*tokens += elapsed * rate;
+	if (*tokens > rate * THROTTLE_BURST)
+		*tokens = rate * THROTTLE_BURST;
+	*tokens -= n;
+
+	return *tokens < 0 ? -*tokens / rate : 0;
+}
+
+/*
+ * Wait until nr_ios requests of total size bytes can be issued.
+ * Returns the time to be passed to io_throttle_done().
+ */
+double io_throttle_wait(struct io_throttle *t, __u64 bytes,
+		unsigned int nr_ios)
+{
+	double wait, w, cur;
+
+	if (t == NULL)
+		return 0;
+
+	pthread_mutex_lock(&t->lock);
+	cur = now();
+	wait = take_tokens(&t->bytes, t->bps * t->factor, cur - t->last, bytes);
+	w = take_tokens(&t->ios, t->iops * t->factor, cur - t->last, nr_ios);
+	if (w > wait)
+		wait = w;
+	t->last = cur;
+	pthread_mutex_unlock(&t->lock);
+
+	if (wait > 0) {
+		struct timespec ts = {
+			.tv_sec = (time_t)wait,
+			.tv_nsec = (wait - (time_t)wait) * 1e9,
+		};
+
+		while (nanosleep(&ts, &ts) && errno == EINTR);
+	}
+
+	return now();
+}
+
+/* Account completion of the I/O started at start */
+void io_throttle_done(struct io_throttle *t, double start, __u64 bytes)
+{
+	double lat, cur;
+
+	if (t == NULL || bytes == 0)
+		return;
+
+	cur = now();
+	lat = (cur - start) * (1 << 20) / bytes;
+
+	pthread_mutex_lock(&t->lock);
+	t->done += bytes;
+	if (t->lat == 0)
+		t->lat = lat;
+	else
+		t->lat += (lat - t->lat) * THROTTLE_EWMA_WEIGHT;
+
+	/* forget the base latency slowly, the storage may be replaced */
+	if (t->base_lat == 0 || t->lat < t->base_lat)
+		t->base_lat = t->lat;
+	else
+		t->base_lat *= 1.001;
+
+	if (cur - t->adjusted < THROTTLE_ADJUST_INTERVAL)
+		goto out;
+
+	/* the throughput is measured while it is not limited */
+	if (t->adjusted != 0 && t->bps == 0) {
+		double rate = t->done / (cur - t->adjusted);
+
+		if (t->rate == 0)
+			t->rate = rate;
+		else
+			t->rate += (rate - t->rate) * THROTTLE_EWMA_WEIGHT;
+	}
+	t->adjusted = cur;
+	t->done = 0;
+
+	if (t->lat > t->base_lat * THROTTLE_BACKOFF_LAT) {
+		if (t->adaptive && t->bps == 0) {
+			if (t->rate == 0)
+				goto out;
+			t->bps = t->rate;
+			t->bytes = 0;
+			ploop_log(3, "I/O latency is up, limit %llu bytes/s",
+					(unsigned long long)t->bps);
+		}
+		t->factor *= 0.75;
+		if (t->factor < THROTTLE_MIN_FACTOR)
+			t->factor = THROTTLE_MIN_FACTOR;
+	} else if (t->lat < t->base_lat * THROTTLE_RECOVER_LAT &&
+			t->factor < 1.0) {
+		t->factor += 0.05;
+		if (t->factor >= 1.0) {
+			t->factor = 1.0;
+			if (t->adaptive)
+				t->bps = 0;
+		}
+	}
+out:
+	pthread_mutex_unlock(&t->lock);
+}
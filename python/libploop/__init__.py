@@ -2,9 +2,12 @@ import libploopapi
 import threading
 
 class ploopcopy():
-	def __init__(self, ddxml, fd, async = 0):
+	def __init__(self, ddxml, fd, async = 0, compress = 0, compress_level = 0,
+			resume = 0, zerocopy = 0):
 		self.di = libploopapi.open_dd(ddxml)
-		self.h = libploopapi.copy_init(self.di, fd, async)
+		self.stat = None
+		self.h = libploopapi.copy_init(self.di, fd, async, compress,
+				compress_level, resume, zerocopy)
 
 	def __del__(self):
 		if self.h:
@@ -18,24 +21,48 @@ class ploopcopy():
 	def copy_next_iteration(self):
 		return libploopapi.copy_next_iteration(self.h)
 
+	def copy_should_stop(self, max_downtime = 0):
+		return libploopapi.copy_should_stop(self.h, max_downtime)
+
+	def copy_get_stat(self):
+		if self.h is None:
+			return self.stat
+		return libploopapi.copy_get_stat(self.h)
+
 	def copy_stop(self):
 		ret = libploopapi.copy_stop(self.h)
+		# the handle is gone, keep the statistics of the last pass
+		self.stat = libploopapi.copy_get_stat(self.h)
 		libploopapi.copy_deinit(self.h)
 		self.h = None
 		return ret;
 
+def ploopcopy_image(ddxml, fd, guid = None, flatten = 0, async = 0,
+		compress = 0, compress_level = 0, resume = 0, zerocopy = 0,
+		ofds = None):
+	return libploopapi.copy_image(ddxml, fd, guid, flatten, async,
+			compress, compress_level, resume, zerocopy, ofds)
+
 class ploopcopy_receiver():
-	def __init__(self, fname, fd):
-		libploopapi.start_receiver(fname, fd);
+	def __init__(self, fname, fd, resume = 0, direct = 0, compact = 0,
+			ifds = None):
+		libploopapi.start_receiver(fname, fd, resume, direct, compact,
+				ifds);
 
 class ploopcopy_thr_receiver(threading.Thread):
-	def __init__(self, fname, fd):
+	def __init__(self, fname, fd, resume = 0, direct = 0, compact = 0,
+			ifds = None):
 		threading.Thread.__init__(self)
 		self.__fname = fname
 		self.__fd = fd
+		self.__resume = resume
+		self.__direct = direct
+		self.__compact = compact
+		self.__ifds = ifds
 
 	def run(self):
-		libploopapi.start_receiver(self.__fname, self.__fd);
+		libploopapi.start_receiver(self.__fname, self.__fd, self.__resume,
+				self.__direct, self.__compact, self.__ifds);
 
 class snapshot():
 	def __init__(self, ddxml):
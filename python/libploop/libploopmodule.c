@@ -32,6 +32,44 @@ static int is_ploop_copy_handle_object(PyObject *obj)
 	return is_valid_object(obj, ploop_copy_handle_object_t);
 }
 
+/* A sequence of file descriptors to an array, to be freed by the caller */
+static int get_fds(PyObject *list, int **fds, int *n)
+{
+	Py_ssize_t i, len;
+	long fd;
+
+	*fds = NULL;
+	*n = 0;
+	if (list == NULL || list == Py_None)
+		return 0;
+
+	if (!PySequence_Check(list))
+		return -1;
+	len = PySequence_Size(list);
+	if (len <= 0)
+		return len;
+
+	*fds = malloc(len * sizeof(int));
+	if (*fds == NULL)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		PyObject *o = PySequence_GetItem(list, i);
+
+		fd = o ? PyInt_AsLong(o) : -1;
+		Py_XDECREF(o);
+		if (fd < 0) {
+			free(*fds);
+			*fds = NULL;
+			return -1;
+		}
+		(*fds)[i] = fd;
+	}
+	*n = len;
+
+	return 0;
+}
+
 static PyObject *libploop_open_dd(PyObject *self, PyObject *args)
 {
 	int ret;
@@ -80,8 +118,10 @@ static PyObject *libploop_copy_init(PyObject *self, PyObject *args)
 	struct ploop_copy_handle *h;
 	struct ploop_copy_param param = {};
 
-	if (!PyArg_ParseTuple(args, "Ok|n:libploop_copy_init",
-				&py_di,	&param.ofd, &param.async) ||
+	if (!PyArg_ParseTuple(args, "Oi|iiiii:libploop_copy_init",
+				&py_di,	&param.ofd, &param.async,
+				&param.compress, &param.compress_level,
+				&param.resume, &param.zerocopy) ||
 			!is_ploop_di_object(py_di))
 	{
 		PyErr_SetString(PyExc_ValueError, "An incorrect parameter");
@@ -155,6 +195,30 @@ static PyObject *libploop_copy_next_iteration(PyObject *self, PyObject *args)
 	return PyLong_FromLong((long)stat.xferred_total);
 }
 
+static PyObject *libploop_copy_should_stop(PyObject *self, PyObject *args)
+{
+	int ret;
+	PyObject *py_h;
+	struct ploop_copy_handle *h;
+	unsigned int max_downtime = 0;
+	__u64 downtime;
+
+	if (!PyArg_ParseTuple(args, "O|I:libploop_copy_should_stop", &py_h,
+				&max_downtime) ||
+			!is_ploop_copy_handle_object(py_h))
+	{
+		PyErr_SetString(PyExc_ValueError, "An incorrect parameter");
+		return NULL;
+	}
+
+	h = ((ploop_copy_handle_object *)py_h)->h;
+
+	ret = ploop_copy_should_stop(h, max_downtime, &downtime);
+
+	return Py_BuildValue("(OK)", ret ? Py_True : Py_False,
+			(unsigned long long)downtime);
+}
+
 static PyObject *libploop_copy_stop(PyObject *self, PyObject *args)
 {
 	int ret;
@@ -182,6 +246,50 @@ static PyObject *libploop_copy_stop(PyObject *self, PyObject *args)
 	return PyLong_FromLong((long)stat.xferred_total);
 }
 
+static PyObject *libploop_copy_get_stat(PyObject *self, PyObject *args)
+{
+	int ret;
+	PyObject *py_h;
+	struct ploop_copy_handle *h;
+	struct ploop_copy_pass_stat stat = {
+		.version = PLOOP_COPY_PASS_STAT_V1,
+	};
+
+	if (!PyArg_ParseTuple(args, "O:libploop_copy_get_stat", &py_h) ||
+			!is_ploop_copy_handle_object(py_h))
+	{
+		PyErr_SetString(PyExc_ValueError, "An incorrect parameter");
+		return NULL;
+	}
+
+	h = ((ploop_copy_handle_object *)py_h)->h;
+
+	ret = ploop_copy_get_stat(h, &stat);
+	if (ret) {
+		PyErr_SetString(PyExc_RuntimeError, ploop_get_last_error());
+		return NULL;
+	}
+
+	return Py_BuildValue("{s:i,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,"
+			"s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+			"pass", stat.pass,
+			"wall_us", (unsigned long long)stat.wall_us,
+			"xferred", (unsigned long long)stat.xferred,
+			"read_bytes", (unsigned long long)stat.read_bytes,
+			"read_us", (unsigned long long)stat.read_us,
+			"read_rate", (unsigned long long)stat.read_rate,
+			"send_bytes", (unsigned long long)stat.send_bytes,
+			"send_us", (unsigned long long)stat.send_us,
+			"send_rate", (unsigned long long)stat.send_rate,
+			"extents", (unsigned long long)stat.extents,
+			"max_extent", (unsigned long long)stat.max_extent,
+			"blocked_us", (unsigned long long)stat.blocked_us,
+			"acks", (unsigned long long)stat.acks,
+			"ack_avg_us", (unsigned long long)stat.ack_avg_us,
+			"ack_max_us", (unsigned long long)stat.ack_max_us,
+			"freeze_us", (unsigned long long)stat.freeze_us);
+}
+
 static PyObject *libploop_copy_deinit(PyObject *self, PyObject *args)
 {
 	PyObject *py_h;
@@ -207,8 +315,12 @@ static PyObject *libploop_start_receiver(PyObject *self, PyObject *args)
 {
 	int ret;
 	struct ploop_copy_receive_param param = {};
+	PyObject *py_ifds = NULL;
 
-	if (!PyArg_ParseTuple(args, "sk:libploop_start_reciver", &param.file, &param.ifd)) {
+	if (!PyArg_ParseTuple(args, "si|iiiO:libploop_start_reciver", &param.file,
+				&param.ifd, &param.resume, &param.direct,
+				&param.compact, &py_ifds) ||
+			get_fds(py_ifds, &param.ifds, &param.nifds)) {
 		PyErr_SetString(PyExc_ValueError, "An incorrect parameter");
 		return NULL;
 	}
@@ -216,6 +328,7 @@ static PyObject *libploop_start_receiver(PyObject *self, PyObject *args)
 	Py_BEGIN_ALLOW_THREADS
 	ret = ploop_copy_receiver(&param);
 	Py_END_ALLOW_THREADS
+	free(param.ifds);
 	if (ret) {
 		PyErr_SetString(PyExc_RuntimeError, ploop_get_last_error());
 		return NULL;
@@ -256,6 +369,43 @@ static PyObject *libploop_create_snapshot(PyObject *self, PyObject *args)
 	return PyString_FromString(param.guid);
 }
 
+static PyObject *libploop_copy_image(PyObject *self, PyObject *args)
+{
+	int ret, flatten = 0;
+	struct ploop_disk_images_data *di = NULL;
+	char *ddxml, *guid = NULL;
+	struct ploop_copy_param param = {};
+	struct ploop_copy_stat stat = {};
+	PyObject *py_ofds = NULL;
+
+	if (!PyArg_ParseTuple(args, "si|ziiiiiiO:libploop_copy_image",
+				&ddxml, &param.ofd, &guid, &flatten,
+				&param.async, &param.compress,
+				&param.compress_level, &param.resume,
+				&param.zerocopy, &py_ofds) ||
+			get_fds(py_ofds, &param.ofds, &param.nofds))
+	{
+		PyErr_SetString(PyExc_ValueError, "An incorrect parameter");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = ploop_open_dd(&di, ddxml);
+	if (ret == 0) {
+		ret = ploop_copy_image(di, guid,
+				flatten ? PLOOP_COPY_FLATTEN : 0, &param, &stat);
+		ploop_close_dd(di);
+	}
+	Py_END_ALLOW_THREADS
+	free(param.ofds);
+	if (ret) {
+		PyErr_SetString(PyExc_RuntimeError, ploop_get_last_error());
+		return NULL;
+	}
+
+	return PyLong_FromLong((long)stat.xferred_total);
+}
+
 static PyObject *libploop_create_snapshot_offline(PyObject *self, PyObject *args)
 {
 	int ret;
@@ -349,8 +499,11 @@ static PyMethodDef PloopMethods[] = {
 	{ "copy_init", libploop_copy_init, METH_VARARGS, "Init ploop copy handle" },
 	{ "copy_start", libploop_copy_start, METH_VARARGS, "Make initial ploop copy" },
 	{ "copy_next_iteration", libploop_copy_next_iteration, METH_VARARGS, "Copy changed blocks" },
+	{ "copy_should_stop", libploop_copy_should_stop, METH_VARARGS, "Check if it is time for the final copy" },
 	{ "copy_stop", libploop_copy_stop, METH_VARARGS, "Final copy after CT freeze" },
+	{ "copy_get_stat", libploop_copy_get_stat, METH_VARARGS, "Get statistics of the last copy pass" },
 	{ "copy_deinit", libploop_copy_deinit, METH_VARARGS, "Free ploop copy handle" },
+	{ "copy_image", libploop_copy_image, METH_VARARGS, "Copy an unmounted image" },
 	{ "start_receiver", libploop_start_receiver, METH_VARARGS, "Start ploop copy receiver" },
 	{ "create_snapshot", libploop_create_snapshot, METH_VARARGS, "Creaet snapshot" },
 	{ "create_snapshot_offline", libploop_create_snapshot_offline, METH_VARARGS, "Create snapshot offline" },
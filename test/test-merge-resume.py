@@ -0,0 +1,143 @@
+#!/usr/bin/python
+#
+# Offline merge of a snapshot killed before it is complete, and resumed
+# by running the same merge again. No ploop device is used: the images
+# are filled and checked through their index tables.
+#
+import libploop
+import os
+import random
+import shutil
+import signal
+import struct
+import tempfile
+import time
+import subprocess as sp
+import unittest
+
+BLOCKSIZE = 128		# cluster size, sectors
+SIZE = '256M'
+# slow enough for the merge to be caught in progress
+IO_LIMIT = '4M'
+
+SIGNATURE_V2 = 'WithouFreSpacExt'
+PLOOP_MAP_OFFSET = 16
+
+class image():
+	def __init__(self, fname):
+		self.fname = fname
+		with open(fname, 'rb') as f:
+			hdr = f.read(64)
+		self.v2 = hdr[0:16] == SIGNATURE_V2
+		(self.blocksize, self.clusters) = struct.unpack_from('<II', hdr, 28)
+		(self.first_block,) = struct.unpack_from('<I', hdr, 48)
+		self.cluster = self.blocksize * 512
+
+	# file offset of the cluster, None if it is not allocated
+	def get_offset(self, f, clu):
+		f.seek((PLOOP_MAP_OFFSET + clu) * 4)
+		(e,) = struct.unpack('<I', f.read(4))
+		if e == 0:
+			return None
+		return (e * self.blocksize if self.v2 else e) * 512
+
+	def read(self, clu):
+		with open(self.fname, 'rb') as f:
+			off = self.get_offset(f, clu)
+			if off is None:
+				return None
+			f.seek(off)
+			return f.read(self.cluster).ljust(self.cluster, '\0')
+
+	def write(self, clu, data):
+		with open(self.fname, 'r+b') as f:
+			off = self.get_offset(f, clu)
+			if off is None:
+				f.seek(0, os.SEEK_END)
+				off = max(f.tell(), self.first_block * 512)
+				off = (off + self.cluster - 1) / self.cluster * self.cluster
+				e = off / self.cluster if self.v2 else off / 512
+				f.seek((PLOOP_MAP_OFFSET + clu) * 4)
+				f.write(struct.pack('<I', e))
+			f.seek(off)
+			f.write(data)
+
+	# the data of every cluster as it is read from the device
+	def logical(self, parent = None):
+		zero = '\0' * self.cluster
+		data = []
+		for clu in range(self.clusters):
+			d = self.read(clu)
+			if d is None:
+				d = parent[clu] if parent else zero
+			data.append(d)
+		return data
+
+def fill_image(img, seed, clusters):
+	rnd = random.Random(seed)
+	for clu in rnd.sample(range(img.clusters), clusters):
+		img.write(clu, os.urandom(img.cluster))
+
+class testMergeResume(unittest.TestCase):
+	def setUp(self):
+		self.dir = tempfile.mkdtemp()
+		self.base = os.path.join(self.dir, 'root.hds')
+		self.ddxml = os.path.join(self.dir, 'DiskDescriptor.xml')
+		self.journal = self.base + '.mjournal'
+
+		ret = sp.call(['ploop', 'init', '-t', 'none', '-b', str(BLOCKSIZE),
+				'-s', SIZE, self.base])
+		if ret != 0:
+			raise Exception('failed to create image')
+
+		base = image(self.base)
+		fill_image(base, 1, base.clusters / 4)
+
+		s = libploop.snapshot(self.ddxml)
+		s.create_offline()
+		self.top = s.get_top_delta_fname()
+		top = image(self.top)
+		fill_image(top, 2, top.clusters / 2)
+
+		self.expected = top.logical(base.logical())
+
+	def tearDown(self):
+		shutil.rmtree(self.dir)
+
+	def merge(self, io_limit = None):
+		cmd = ['ploop']
+		if io_limit:
+			cmd.append('--io-limit=' + io_limit)
+		return cmd + ['merge', self.top, self.base]
+
+	def kill_merge(self):
+		p = sp.Popen(self.merge(IO_LIMIT))
+		# wait for the merge to start writing the base image
+		while not os.path.exists(self.journal) and p.poll() is None:
+			time.sleep(0.01)
+		time.sleep(1)
+		if p.poll() is not None:
+			raise Exception('merge is complete before it is killed')
+		os.kill(p.pid, signal.SIGKILL)
+		p.wait()
+		self.assertTrue(os.path.exists(self.journal))
+
+	def check_merged(self):
+		self.assertFalse(os.path.exists(self.journal))
+		self.assertEqual(self.expected, image(self.base).logical())
+
+	def test_resume(self):
+		self.kill_merge()
+
+		self.assertEqual(sp.call(self.merge()), 0)
+		self.check_merged()
+
+	def test_resume_twice(self):
+		self.kill_merge()
+		self.kill_merge()
+
+		self.assertEqual(sp.call(self.merge()), 0)
+		self.check_merged()
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,249 @@
+#!/usr/bin/python
+#
+# Offline copy of an unmounted image to a receiver in the same process.
+# No ploop device is used: the images are filled and checked through
+# their index tables.
+#
+import libploop
+import os
+import random
+import shutil
+import socket
+import struct
+import tempfile
+import threading
+import hashlib
+import subprocess as sp
+import unittest
+
+BLOCKSIZE = 128		# cluster size, sectors
+SIZE = '64M'
+
+SIGNATURE_V2 = 'WithouFreSpacExt'
+PLOOP_MAP_OFFSET = 16
+
+def hashfile(fname):
+	h = hashlib.md5()
+	with open(fname, 'rb') as f:
+		for buf in iter(lambda: f.read(65536), ''):
+			h.update(buf)
+	return h.hexdigest()
+
+class image():
+	def __init__(self, fname):
+		self.fname = fname
+		with open(fname, 'rb') as f:
+			hdr = f.read(64)
+		self.v2 = hdr[0:16] == SIGNATURE_V2
+		(self.blocksize, self.clusters) = struct.unpack_from('<II', hdr, 28)
+		(self.first_block,) = struct.unpack_from('<I', hdr, 48)
+		self.cluster = self.blocksize * 512
+
+	# file offset of the cluster, None if it is not allocated
+	def get_offset(self, f, clu):
+		f.seek((PLOOP_MAP_OFFSET + clu) * 4)
+		(e,) = struct.unpack('<I', f.read(4))
+		if e == 0:
+			return None
+		return (e * self.blocksize if self.v2 else e) * 512
+
+	def get_offsets(self):
+		with open(self.fname, 'rb') as f:
+			return [self.get_offset(f, clu) for clu in range(self.clusters)]
+
+	def read(self, clu):
+		with open(self.fname, 'rb') as f:
+			off = self.get_offset(f, clu)
+			if off is None:
+				return None
+			f.seek(off)
+			return f.read(self.cluster).ljust(self.cluster, '\0')
+
+	def write(self, clu, data):
+		with open(self.fname, 'r+b') as f:
+			off = self.get_offset(f, clu)
+			if off is None:
+				f.seek(0, os.SEEK_END)
+				off = max(f.tell(), self.first_block * 512)
+				off = (off + self.cluster - 1) / self.cluster * self.cluster
+				e = off / self.cluster if self.v2 else off / 512
+				f.seek((PLOOP_MAP_OFFSET + clu) * 4)
+				f.write(struct.pack('<I', e))
+			f.seek(off)
+			f.write(data)
+
+	# the data of every cluster as it is read from the device
+	def logical(self, parent = None):
+		zero = '\0' * self.cluster
+		data = []
+		for clu in range(self.clusters):
+			d = self.read(clu)
+			if d is None:
+				d = parent[clu] if parent else zero
+			data.append(d)
+		return data
+
+def fill_image(img, seed, clusters):
+	rnd = random.Random(seed)
+	for clu in rnd.sample(range(img.clusters), clusters):
+		if rnd.randint(0, 9) == 0:
+			img.write(clu, '\0' * img.cluster)
+		elif rnd.randint(0, 1):
+			img.write(clu, os.urandom(img.cluster))
+		else:
+			# compressible
+			img.write(clu, str(clu) * (img.cluster / len(str(clu))) +
+					'x' * (img.cluster % len(str(clu))))
+
+class receiver(threading.Thread):
+	def __init__(self, fname, fd, resume, compact, ifds):
+		threading.Thread.__init__(self)
+		self.args = (fname, fd, resume, 0, compact, ifds)
+		self.error = None
+
+	def run(self):
+		try:
+			libploop.ploopcopy_receiver(*self.args)
+		except Exception as e:
+			self.error = e
+
+class testPcopyOffline(unittest.TestCase):
+	def setUp(self):
+		self.dir = tempfile.mkdtemp()
+		self.image = os.path.join(self.dir, 'root.hds')
+		self.ddxml = os.path.join(self.dir, 'DiskDescriptor.xml')
+		self.out = os.path.join(self.dir, 'out.hds')
+
+		ret = sp.call(['ploop', 'init', '-t', 'none', '-b', str(BLOCKSIZE),
+				'-s', SIZE, self.image])
+		if ret != 0:
+			raise Exception('failed to create image')
+
+		img = image(self.image)
+		fill_image(img, 1, img.clusters / 2)
+
+	def tearDown(self):
+		shutil.rmtree(self.dir)
+
+	def snapshot(self):
+		s = libploop.snapshot(self.ddxml)
+		s.create_offline()
+		top = image(s.get_top_delta_fname())
+		fill_image(top, 2, top.clusters / 4)
+		return top
+
+	def copy(self, flatten = 0, async = 0, compress = 0, resume = 0,
+			compact = 0, streams = 0):
+		socks = [socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+				for i in range(streams + 1)]
+		ofds = [s[0].fileno() for s in socks[1:]]
+		ifds = [s[1].fileno() for s in socks[1:]]
+
+		rcv = receiver(self.out, socks[0][1].fileno(), resume, compact, ifds)
+		rcv.start()
+		try:
+			libploop.ploopcopy_image(self.ddxml, socks[0][0].fileno(),
+					None, flatten, async, compress, 0, resume, 0, ofds)
+		finally:
+			# the receiver bails out if the sender has failed
+			for s in socks:
+				s[0].shutdown(socket.SHUT_WR)
+			rcv.join()
+			for s in socks:
+				s[0].close()
+				s[1].close()
+		if rcv.error:
+			raise rcv.error
+
+	def check_same(self):
+		self.assertEqual(hashfile(self.image), hashfile(self.out))
+
+	def check_logical(self, src):
+		self.assertEqual(src, image(self.out).logical())
+
+	def check_compact(self):
+		out = image(self.out)
+		offs = sorted(o for o in out.get_offsets() if o is not None)
+		first = out.first_block * 512
+		# data clusters go right after the index, with no holes
+		self.assertEqual(offs, range(first, first + len(offs) * out.cluster,
+				out.cluster))
+		self.assertEqual(os.path.getsize(self.out),
+				first + len(offs) * out.cluster)
+
+	def test_offline(self):
+		self.copy()
+		self.check_same()
+
+	def test_offline_async(self):
+		self.copy(async = 1)
+		self.check_same()
+
+	def test_compress(self):
+		self.copy(compress = 1)
+		self.check_same()
+
+	def test_compress_async(self):
+		self.copy(async = 1, compress = 1)
+		self.check_same()
+
+	def test_streams(self):
+		self.copy(streams = 3)
+		self.check_same()
+
+	def test_streams_compress_async(self):
+		self.copy(async = 1, compress = 1, streams = 3)
+		self.check_same()
+
+	def test_flatten(self):
+		base = image(self.image).logical()
+		src = self.snapshot().logical(base)
+
+		self.copy(flatten = 1)
+		self.check_logical(src)
+
+	def test_flatten_streams_compress(self):
+		base = image(self.image).logical()
+		src = self.snapshot().logical(base)
+
+		self.copy(flatten = 1, async = 1, compress = 1, streams = 2)
+		self.check_logical(src)
+
+	def test_compact(self):
+		src = image(self.image).logical()
+
+		self.copy(compact = 1)
+		self.check_logical(src)
+		self.check_compact()
+
+	def test_compact_flatten_streams(self):
+		base = image(self.image).logical()
+		src = self.snapshot().logical(base)
+
+		self.copy(flatten = 1, compact = 1, async = 1, streams = 3)
+		self.check_logical(src)
+		self.check_compact()
+
+	def test_resume(self):
+		self.copy()
+
+		# an interrupted copy of the changed image
+		img = image(self.image)
+		fill_image(img, 3, img.clusters / 8)
+		with open(self.out, 'r+b') as f:
+			f.truncate(os.path.getsize(self.out) / 2)
+
+		self.copy(resume = 1)
+		self.check_same()
+
+	def test_resume_streams(self):
+		self.copy(streams = 2)
+
+		img = image(self.image)
+		fill_image(img, 3, img.clusters / 8)
+
+		self.copy(resume = 1, async = 1, compress = 1, streams = 2)
+		self.check_same()
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,795 @@
+/*
+ *  Copyright (c) 2008-2017 Parallels International GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <linux/types.h>
+#include <string.h>
+#include <limits.h>
+
+#include "ploop.h"
+#include "common.h"
+
+#define BENCH_MAX_STREAMS	16
+#define BENCH_MAX_RUNS		1000
+#define BENCH_MAX_PASSES	100
+
+enum {
+	BENCH_SOCKET,
+	BENCH_TCP,
+	BENCH_FILE,
+};
+
+struct bench_mode {
+	const char *name;
+	int async;
+	int compress;
+};
+
+static struct bench_mode bench_modes[] = {
+	{ "sync",	0, PLOOP_COPY_COMPRESS_NONE },
+	{ "async",	1, PLOOP_COPY_COMPRESS_NONE },
+	{ "sync-z",	0, PLOOP_COPY_COMPRESS_ZLIB },
+	{ "async-z",	1, PLOOP_COPY_COMPRESS_ZLIB },
+	{},
+};
+
+struct bench_param {
+	off_t size;		/* sectors */
+	off_t blocksize;	/* sectors */
+	int fill;		/* % of clusters allocated */
+	int compressible;	/* % of each cluster that compresses */
+	int runs;
+	int streams;		/* additional streams */
+	int transport;
+	int live;		/* copy the mounted image by passes */
+	int passes;		/* iterations after the first pass */
+	int dirty;		/* % of clusters rewritten before each of them */
+	int keep;
+	const char *dir;
+	char image[PATH_MAX];
+	char ddxml[PATH_MAX];
+};
+
+/*
+ * One copy: wall and CPU time, data sent, read/write syscalls made.
+ * A live copy also gets the statistics of its passes.
+ */
+struct bench_run {
+	double wall;
+	double cpu;
+	__u64 bytes;
+	__u64 syscalls;
+	int passes;
+	__u64 acks;		/* packets acknowledged by the receiver */
+	__u64 ack_us;		/* total time from a packet sent to its ack */
+	__u64 ack_max_us;
+	__u64 freeze_us;
+};
+
+static void usage_summary(void)
+{
+	fprintf(stderr, "Usage: ploop-bench copy [options] DIR\n");
+}
+
+static void usage_copy(void)
+{
+	fprintf(stderr, "Usage: ploop-bench copy [-s SIZE] [-b BLOCKSIZE] [-f FILL] [-c COMPRESSIBLE]\n"
+			"	[-n RUNS] [-S STREAMS] [-t socket|tcp|file] [-m MODE[,MODE...]]\n"
+			"	[-l [-p PASSES] [-d DIRTY]] [-k] [-v] DIR\n"
+			"	SIZE         := image size (default 1G)\n"
+			"	BLOCKSIZE    := cluster size (default 1M)\n"
+			"	FILL         := %% of clusters allocated (default 50)\n"
+			"	COMPRESSIBLE := %% of each cluster that compresses (default 50)\n"
+			"	RUNS         := copies per mode (default 3)\n"
+			"	STREAMS      := additional streams (default 0)\n"
+			"	MODE         := sync | async | sync-z | async-z (default all)\n"
+			"	-l           := copy the mounted image as a live copy does\n"
+			"	PASSES       := iterations after the first pass (default 3)\n"
+			"	DIRTY        := %% of clusters rewritten before each (default 10)\n"
+			"	-k           := keep the image in DIR\n"
+			"Action: create a synthetic image in DIR, copy it to a local receiver\n"
+			"	and report MB/s, read/write syscalls and CPU time per GB of data.\n"
+			"	An offline copy reports the copy time, percentiles only if there\n"
+			"	are enough runs for them; a live copy reports the time from\n"
+			"	a packet sent to its acknowledgement and the freeze time\n");
+}
+
+static __u64 xorshift(__u64 *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+
+	return *s;
+}
+
+static void fill_cluster(void *buf, __u64 size, int compressible, __u64 *seed)
+{
+	__u64 i, n = size * compressible / 100 / sizeof(__u64);
+	__u64 *p = buf;
+
+	/* a short repeating pattern, then random data */
+	for (i = 0; i < n; i++)
+		p[i] = i % 64;
+	for (; i < size / sizeof(__u64); i++)
+		p[i] = xorshift(seed);
+}
+
+/*
+ * Create the image and fill it: the clusters are allocated at random,
+ * in the logical order, and the index is written at once at the end.
+ */
+static int create_bench_image(struct bench_param *b)
+{
+	struct ploop_create_param param = {
+		.size = b->size,
+		.mode = PLOOP_EXPANDED_MODE,
+		.blocksize = b->blocksize,
+		.fmt_version = PLOOP_FMT_UNDEFINED,
+	};
+	struct ploop_pvd_header *vh;
+	char *image = b->image;
+	__u64 cluster = S2B(b->blocksize), clu, nclu, off, seed = 0x5eed;
+	__u32 *idx = NULL;
+	void *buf = NULL;
+	int fd = -1, ret;
+
+	snprintf(b->image, sizeof(b->image), "%s/root.hds", b->dir);
+	snprintf(b->ddxml, sizeof(b->ddxml), "%s/" DISKDESCRIPTOR_XML, b->dir);
+	param.image = image;
+
+	ret = ploop_create_image(&param);
+	if (ret)
+		return ret;
+
+	ret = SYSEXIT_OPEN;
+	fd = open(image, O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "Can't open %s: %m\n", image);
+		goto err;
+	}
+
+	ret = SYSEXIT_MALLOC;
+	buf = malloc(cluster);
+	if (buf == NULL || posix_memalign((void **)&idx, 4096, cluster))
+		goto err;
+
+	ret = SYSEXIT_READ;
+	if (pread(fd, idx, cluster, 0) != cluster) {
+		fprintf(stderr, "Can't read %s: %m\n", image);
+		goto err;
+	}
+	vh = (struct ploop_pvd_header *)idx;
+	off = S2B(vh->m_FirstBlockOffset);
+	free(idx);
+	idx = NULL;
+
+	ret = SYSEXIT_MALLOC;
+	if (posix_memalign((void **)&idx, 4096, off))
+		goto err;
+	ret = SYSEXIT_READ;
+	if (pread(fd, idx, off, 0) != off) {
+		fprintf(stderr, "Can't read %s: %m\n", image);
+		goto err;
+	}
+	vh = (struct ploop_pvd_header *)idx;
+
+	nclu = S2B(b->size) / cluster;
+	for (clu = 0; clu < nclu; clu++) {
+		if (xorshift(&seed) % 100 >= b->fill)
+			continue;
+
+		fill_cluster(buf, cluster, b->compressible, &seed);
+		if (pwrite(fd, buf, cluster, off) != cluster) {
+			fprintf(stderr, "Can't write %s: %m\n", image);
+			ret = SYSEXIT_WRITE;
+			goto err;
+		}
+		idx[PLOOP_MAP_OFFSET + clu] = ploop_sec_to_ioff(off / SECTOR_SIZE,
+				b->blocksize, ploop1_version(vh));
+		off += cluster;
+	}
+
+	vh->m_Flags &= ~CIF_Empty;
+	if (pwrite(fd, idx, S2B(vh->m_FirstBlockOffset), 0) !=
+			S2B(vh->m_FirstBlockOffset) || fsync(fd)) {
+		fprintf(stderr, "Can't write %s: %m\n", image);
+		ret = SYSEXIT_WRITE;
+		goto err;
+	}
+
+	ret = 0;
+err:
+	if (fd != -1)
+		close(fd);
+	free(buf);
+	free(idx);
+
+	return ret;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Read and write class syscalls of all the threads, see proc(5) */
+static __u64 io_syscalls(void)
+{
+	char s[64];
+	unsigned long long n, total = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/io", "r");
+	if (fp == NULL)
+		return 0;
+
+	while (fscanf(fp, "%63s %llu", s, &n) == 2)
+		if (!strcmp(s, "syscr:") || !strcmp(s, "syscw:"))
+			total += n;
+	fclose(fp);
+
+	return total;
+}
+
+static int tcp_pair(int *fds)
+{
+	struct sockaddr_in a = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(a);
+	int ls, ret = -1;
+
+	fds[0] = fds[1] = -1;
+	ls = socket(AF_INET, SOCK_STREAM, 0);
+	if (ls == -1)
+		return -1;
+
+	if (bind(ls, (struct sockaddr *)&a, sizeof(a)) ||
+			listen(ls, 1) ||
+			getsockname(ls, (struct sockaddr *)&a, &len))
+		goto out;
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[0] == -1 ||
+			connect(fds[0], (struct sockaddr *)&a, sizeof(a)))
+		goto out;
+
+	fds[1] = accept(ls, NULL, NULL);
+	if (fds[1] != -1)
+		ret = 0;
+out:
+	if (ret && fds[0] != -1)
+		close(fds[0]);
+	close(ls);
+
+	return ret;
+}
+
+/* Rewrite the dirty share of the clusters through the device */
+static int dirty_device(struct bench_param *b, const char *device, __u64 *seed)
+{
+	__u64 cluster = S2B(b->blocksize), clu, nclu = S2B(b->size) / cluster;
+	void *buf;
+	int fd, ret = 0;
+
+	fd = open(device, O_WRONLY|O_DIRECT);
+	if (fd == -1) {
+		fprintf(stderr, "Can't open %s: %m\n", device);
+		return SYSEXIT_DEVICE;
+	}
+
+	if (posix_memalign(&buf, 4096, cluster)) {
+		close(fd);
+		return SYSEXIT_MALLOC;
+	}
+
+	for (clu = 0; clu < nclu; clu++) {
+		if (xorshift(seed) % 100 >= b->dirty)
+			continue;
+
+		fill_cluster(buf, cluster, b->compressible, seed);
+		if (pwrite(fd, buf, cluster, clu * cluster) != cluster) {
+			fprintf(stderr, "Can't write %s: %m\n", device);
+			ret = SYSEXIT_WRITE;
+			break;
+		}
+	}
+
+	if (ret == 0 && fsync(fd)) {
+		fprintf(stderr, "Can't fsync %s: %m\n", device);
+		ret = SYSEXIT_FSYNC;
+	}
+	close(fd);
+	free(buf);
+
+	return ret;
+}
+
+static void add_pass_stat(struct ploop_copy_handle *h, struct bench_run *res)
+{
+	struct ploop_copy_pass_stat ps = {
+		.version = PLOOP_COPY_PASS_STAT_V1,
+	};
+
+	if (ploop_copy_get_stat(h, &ps))
+		return;
+
+	res->passes++;
+	res->bytes += ps.xferred;
+	res->acks += ps.acks;
+	res->ack_us += ps.ack_avg_us * ps.acks;
+	if (ps.ack_max_us > res->ack_max_us)
+		res->ack_max_us = ps.ack_max_us;
+	res->freeze_us += ps.freeze_us;
+}
+
+/*
+ * Copy the mounted image the way a live migration does: the first pass,
+ * then the given number of iterations, each after some clusters are
+ * rewritten, and the last one with the device frozen.
+ */
+static int copy_live(struct bench_param *b, struct ploop_disk_images_data *di,
+		struct ploop_copy_param *p, struct bench_run *res)
+{
+	struct ploop_mount_param mp = {};
+	struct ploop_copy_handle *h = NULL;
+	struct ploop_copy_stat st = {};
+	__u64 seed = 0xd1e7;
+	int i, ret, ret2;
+
+	ret = ploop_mount_image(di, &mp);
+	if (ret)
+		return ret;
+
+	ret = ploop_copy_init(di, p, &h);
+	if (ret)
+		goto out;
+
+	ret = ploop_copy_start(h, &st);
+	add_pass_stat(h, res);
+	for (i = 0; ret == 0 && i < b->passes; i++) {
+		ret = dirty_device(b, mp.device, &seed);
+		if (ret)
+			break;
+		ret = ploop_copy_next_iteration(h, &st);
+		add_pass_stat(h, res);
+	}
+	if (ret == 0) {
+		ret = ploop_copy_stop(h, &st);
+		add_pass_stat(h, res);
+	}
+	ploop_copy_deinit(h);
+
+out:
+	ret2 = ploop_umount_image(di);
+
+	return ret ? ret : ret2;
+}
+
+static void *receiver_thread(void *data)
+{
+	struct ploop_copy_receive_param *r = data;
+
+	return (void *)(long)ploop_copy_receiver(r);
+}
+
+static int run_copy(struct bench_param *b, struct bench_mode *m, struct bench_run *res)
+{
+	struct ploop_disk_images_data *di = NULL;
+	struct ploop_copy_param p = {
+		.async = m->async,
+		.compress = m->compress,
+	};
+	struct ploop_copy_receive_param r = {
+		.feedback_fd = -1,
+	};
+	struct ploop_copy_stat st = {};
+	int ofd[BENCH_MAX_STREAMS + 1], ifd[BENCH_MAX_STREAMS + 1];
+	char dst[PATH_MAX];
+	pthread_t th;
+	double wall, cpu;
+	__u64 sys;
+	void *rret = NULL;
+	int i, ret, n = 0;
+
+	snprintf(dst, sizeof(dst), "%s/copy.hds", b->dir);
+	unlink(dst);
+
+	memset(res, 0, sizeof(*res));
+	ret = ploop_open_dd(&di, b->ddxml);
+	if (ret)
+		return ret;
+
+	if (b->transport == BENCH_FILE) {
+		p.ofd = open(dst, O_WRONLY|O_CREAT|O_EXCL, 0600);
+		if (p.ofd == -1) {
+			fprintf(stderr, "Can't create %s: %m\n", dst);
+			ret = SYSEXIT_CREAT;
+			goto out;
+		}
+	} else {
+		for (n = 0; n <= b->streams; n++) {
+			int fds[2];
+
+			if (b->transport == BENCH_TCP ? tcp_pair(fds) :
+					socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+				fprintf(stderr, "Can't create a socket: %m\n");
+				ret = SYSEXIT_SYS;
+				goto out;
+			}
+			ofd[n] = fds[0];
+			ifd[n] = fds[1];
+		}
+
+		p.ofd = ofd[0];
+		p.ofds = ofd + 1;
+		p.nofds = b->streams;
+		r.file = dst;
+		r.ifd = ifd[0];
+		r.ifds = ifd + 1;
+		r.nifds = b->streams;
+	}
+
+	wall = now();
+	cpu = cpu_time();
+	sys = io_syscalls();
+
+	if (b->transport != BENCH_FILE &&
+			pthread_create(&th, NULL, receiver_thread, &r)) {
+		fprintf(stderr, "Can't create receiver thread\n");
+		ret = SYSEXIT_SYS;
+		goto out;
+	}
+
+	if (b->live)
+		ret = copy_live(b, di, &p, res);
+	else {
+		ret = ploop_copy_image(di, NULL, 0, &p, &st);
+		res->bytes = st.xferred_total;
+	}
+
+	if (b->transport != BENCH_FILE) {
+		/* let the receiver go if the sender has failed */
+		if (ret)
+			for (i = 0; i < n; i++)
+				shutdown(ofd[i], SHUT_RDWR);
+		pthread_join(th, &rret);
+		if (ret == 0)
+			ret = (long)rret;
+	} else if (ret == 0 && fsync(p.ofd)) {
+		fprintf(stderr, "Can't fsync %s: %m\n", dst);
+		ret = SYSEXIT_FSYNC;
+	}
+
+	res->wall = now() - wall;
+	res->cpu = cpu_time() - cpu;
+	res->syscalls = io_syscalls() - sys;
+
+out:
+	for (i = 0; i < n; i++) {
+		close(ofd[i]);
+		close(ifd[i]);
+	}
+	if (b->transport == BENCH_FILE && p.ofd != -1)
+		close(p.ofd);
+	unlink(dst);
+	ploop_close_dd(di);
+
+	return ret;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *v, int n, int pct)
+{
+	int i = (n * pct + 99) / 100;
+
+	return v[i > 0 ? i - 1 : 0];
+}
+
+/* A percentile is printed only if there are samples above it */
+static void print_percentile(const double *v, int n, int pct)
+{
+	if (n * (100 - pct) < 100)
+		printf(" %9s", "-");
+	else
+		printf(" %9.1f", percentile(v, n, pct) * 1000);
+}
+
+static int bench_mode(struct bench_param *b, struct bench_mode *m)
+{
+	struct bench_run res;
+	double t[BENCH_MAX_RUNS], wall = 0, cpu = 0, gb;
+	__u64 bytes = 0, sys = 0, acks = 0, ack_us = 0, ack_max_us = 0;
+	__u64 freeze_us = 0;
+	int i, ret, passes = 0;
+
+	for (i = 0; i < b->runs; i++) {
+		ret = run_copy(b, m, &res);
+		if (ret) {
+			fprintf(stderr, "Copy %s failed: %d\n", m->name, ret);
+			return ret;
+		}
+		t[i] = res.wall;
+		wall += res.wall;
+		cpu += res.cpu;
+		bytes += res.bytes;
+		sys += res.syscalls;
+		passes += res.passes;
+		acks += res.acks;
+		ack_us += res.ack_us;
+		if (res.ack_max_us > ack_max_us)
+			ack_max_us = res.ack_max_us;
+		freeze_us += res.freeze_us;
+	}
+
+	gb = bytes / (1024.0 * 1024 * 1024);
+	printf("%-8s %9.1f %12.0f %10.2f", m->name,
+			bytes / (1024.0 * 1024) / wall,
+			gb ? sys / gb : 0, gb ? cpu / gb : 0);
+	if (b->live) {
+		/* asynchronous packets are not acknowledged */
+		if (acks)
+			printf(" %7d %10.2f %10.2f", passes / b->runs,
+					ack_us / 1000.0 / acks,
+					ack_max_us / 1000.0);
+		else
+			printf(" %7d %10s %10s", passes / b->runs, "-", "-");
+		printf(" %9.1f\n", freeze_us / 1000.0 / b->runs);
+	} else {
+		qsort(t, b->runs, sizeof(t[0]), cmp_double);
+		printf(" %9.1f", t[0] * 1000);
+		print_percentile(t, b->runs, 50);
+		print_percentile(t, b->runs, 90);
+		print_percentile(t, b->runs, 99);
+		printf(" %9.1f\n", t[b->runs - 1] * 1000);
+	}
+	fflush(stdout);
+
+	return 0;
+}
+
+static int select_modes(const char *opt, int *sel)
+{
+	char *s, *p, *tok;
+	int i;
+
+	s = strdup(opt);
+	if (s == NULL)
+		return -1;
+
+	for (tok = strtok_r(s, ",", &p); tok != NULL;
+			tok = strtok_r(NULL, ",", &p)) {
+		for (i = 0; bench_modes[i].name != NULL; i++)
+			if (!strcmp(tok, bench_modes[i].name))
+				break;
+		if (bench_modes[i].name == NULL) {
+			fprintf(stderr, "Unknown mode %s\n", tok);
+			free(s);
+			return -1;
+		}
+		sel[i] = 1;
+	}
+	free(s);
+
+	return 0;
+}
+
+static int copy(int argc, char **argv)
+{
+	struct bench_param b = {
+		.size = 1 << 21,	/* 1G */
+		.blocksize = 1 << 11,	/* 1M */
+		.fill = 50,
+		.compressible = 50,
+		.runs = 3,
+		.transport = BENCH_SOCKET,
+		.passes = 3,
+		.dirty = 10,
+	};
+	static const char *transports[] = { "socket", "tcp", "file" };
+	char lck[PATH_MAX + sizeof(".lck")];
+	int sel[sizeof(bench_modes) / sizeof(bench_modes[0])] = {};
+	int i, ret, all = 1;
+
+	while ((i = getopt(argc, argv, "s:b:f:c:n:S:t:m:lp:d:kv")) != EOF) {
+		switch (i) {
+		case 's':
+			if (parse_size(optarg, &b.size, "-s")) {
+				usage_copy();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		case 'b':
+			if (parse_size(optarg, &b.blocksize, "-b")) {
+				usage_copy();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		case 'f':
+			b.fill = atoi(optarg);
+			break;
+		case 'c':
+			b.compressible = atoi(optarg);
+			break;
+		case 'n':
+			b.runs = atoi(optarg);
+			break;
+		case 'S':
+			b.streams = atoi(optarg);
+			break;
+		case 't':
+			for (b.transport = 0; b.transport < 3; b.transport++)
+				if (!strcmp(optarg, transports[b.transport]))
+					break;
+			if (b.transport == 3) {
+				usage_copy();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		case 'm':
+			if (select_modes(optarg, sel)) {
+				usage_copy();
+				return SYSEXIT_PARAM;
+			}
+			all = 0;
+			break;
+		case 'l':
+			b.live = 1;
+			break;
+		case 'p':
+			b.passes = atoi(optarg);
+			break;
+		case 'd':
+			b.dirty = atoi(optarg);
+			break;
+		case 'k':
+			b.keep = 1;
+			break;
+		case 'v':
+			ploop_set_verbose_level(3);
+			break;
+		default:
+			usage_copy();
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || b.fill < 0 || b.fill > 100 ||
+			b.compressible < 0 || b.compressible > 100 ||
+			b.runs < 1 || b.runs > BENCH_MAX_RUNS ||
+			b.streams < 0 || b.streams > BENCH_MAX_STREAMS ||
+			b.passes < 0 || b.passes > BENCH_MAX_PASSES ||
+			b.dirty < 0 || b.dirty > 100) {
+		usage_copy();
+		return SYSEXIT_PARAM;
+	}
+	b.dir = argv[0];
+
+	if (mkdir(b.dir, 0700) && errno != EEXIST) {
+		fprintf(stderr, "Can't create %s: %m\n", b.dir);
+		return SYSEXIT_MKDIR;
+	}
+
+	ret = create_bench_image(&b);
+	if (ret)
+		return ret;
+
+	printf("Image %llu MB, cluster %llu KB, %d%% filled, %d%% compressible;"
+			" %d %s run(s) over %s, %d stream(s)\n",
+			(unsigned long long)S2B(b.size) >> 20,
+			(unsigned long long)S2B(b.blocksize) >> 10,
+			b.fill, b.compressible, b.runs,
+			b.live ? "live" : "offline",
+			transports[b.transport], b.streams + 1);
+	if (b.live) {
+		printf("Passes: %d after the first, %d%% of clusters rewritten"
+				" before each\n", b.passes, b.dirty);
+		printf("%-8s %9s %12s %10s %7s %10s %10s %9s\n", "mode",
+				"MB/s", "syscalls/GB", "CPU s/GB", "passes",
+				"ack avg ms", "ack max ms", "freeze ms");
+	} else
+		printf("%-8s %9s %12s %10s %9s %9s %9s %9s %9s\n", "mode",
+				"MB/s", "syscalls/GB", "CPU s/GB", "min ms",
+				"p50 ms", "p90 ms", "p99 ms", "max ms");
+
+	for (i = 0; bench_modes[i].name != NULL; i++) {
+		if (!all && !sel[i])
+			continue;
+		/* the local copy is never compressed */
+		if (b.transport == BENCH_FILE &&
+				bench_modes[i].compress != PLOOP_COPY_COMPRESS_NONE)
+			continue;
+
+		ret = bench_mode(&b, &bench_modes[i]);
+		if (ret)
+			break;
+	}
+
+	if (!b.keep) {
+		snprintf(lck, sizeof(lck), "%s.lck", b.ddxml);
+		unlink(lck);
+		unlink(b.ddxml);
+		unlink(b.image);
+		rmdir(b.dir);
+	}
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	char *cmd;
+
+	if (argc < 2) {
+		usage_summary();
+		return SYSEXIT_PARAM;
+	}
+
+	cmd = argv[1];
+	argc--;
+	argv++;
+
+	init_signals();
+	signal(SIGPIPE, SIG_IGN);
+	ploop_set_verbose_level(PLOOP_LOG_NOSTDOUT);
+
+	if (strcmp(cmd, "copy") == 0)
+		return copy(argc, argv);
+
+	usage_summary();
+	return SYSEXIT_PARAM;
+}
@@ -34,8 +34,8 @@
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: ploop merge -d DEVICE [-l LEVEL[..TOP_LEVEL]] [-n NEW_DELTA]\n"
-			"       ploop merge [-f raw] [-n NEW_DELTA] DELTAS_TO_MERGE BASE_DELTA\n"
+	fprintf(stderr, "Usage: ploop merge -d DEVICE [-l LEVEL[..TOP_LEVEL]] [-n NEW_DELTA] [-q DEPTH]\n"
+			"       ploop merge [-f raw] [-n NEW_DELTA] [-q DEPTH] DELTAS_TO_MERGE BASE_DELTA\n"
 	       );
 }
 
@@ -48,9 +48,10 @@ int plooptool_merge(int argc, char ** argv)
 	char *device = NULL;
 	char **names = NULL;
 	const char *new_delta = NULL;
+	struct ploop_merge_param param = {};
 	int i, f, ret;
 
-	while ((i = getopt(argc, argv, "f:d:l:n:u:A")) != EOF) {
+	while ((i = getopt(argc, argv, "f:d:l:n:u:Aq:")) != EOF) {
 		switch (i) {
 		case 'f':
 			f = parse_format_opt(optarg);
@@ -79,6 +80,13 @@ int plooptool_merge(int argc, char ** argv)
 		case 'n':
 			new_delta = optarg;
 			break;
+		case 'q':
+			param.queue_depth = atoi(optarg);
+			if (param.queue_depth <= 0) {
+				usage();
+				return SYSEXIT_PARAM;
+			}
+			break;
 		case 'u':
 		case 'A':
 			/* ignore */
@@ -122,7 +130,8 @@ int plooptool_merge(int argc, char ** argv)
 			merge_top = info.merge_top;
 		}
 
-		ret = merge_image(device, start_level, end_level, raw, merge_top, names, new_delta);
+		ret = merge_image(device, start_level, end_level, raw, merge_top,
+				names, new_delta, &param);
 	}
 
 	return ret;
@@ -47,7 +47,10 @@ extern int plooptool_copy(int argc, char ** argv);
 
 static void usage_summary(void)
 {
-	fprintf(stderr, "Usage: ploop init -s SIZE [-f FORMAT | -L LABEL] NEW_DELTA | DEVICE\n"
+	fprintf(stderr, "Usage: ploop [-v] [--io-limit=RATE] [--iops-limit=IOPS] <command> ...\n"
+			"       RATE := NUMBER[KMG] bytes per second\n"
+			"\n"
+			"       ploop init -s SIZE [-f FORMAT | -L LABEL] NEW_DELTA | DEVICE\n"
 			"       ploop mount [-r] [-m DIR] DiskDescriptor.xml\n"
 			"       ploop umount { -d DEVICE | -m DIR | DELTA | DiskDescriptor.xml }\n"
 			"       ploop check [-fFcrsdS] [-R -b BLOCKSIZE] { DELTA | DiskDescriptor.xml }\n"
@@ -841,17 +844,53 @@ static int plooptool_snapshot_delete(int argc, char **argv)
 
 static void usage_snapshot_merge(void)
 {
-	fprintf(stderr, "Usage: ploop snapshot-merge [-u UUID | -A] [-n DELTA] DiskDescriptor.xml\n"
+	fprintf(stderr, "Usage: ploop snapshot-merge [-u UUID | -A] [-n DELTA] [-q DEPTH] [--estimate]\n"
+			"                DiskDescriptor.xml\n"
 			"       -u UUID       snapshot to merge (top delta if not specified)\n"
-			"       -n DELTA      new delta file to merge to\n");
+			"       -n DELTA      new delta file to merge to\n"
+			"       -q DEPTH      number of clusters to copy in parallel\n"
+			"       --estimate    only estimate the amount of I/O and space\n");
+}
+
+static int print_merge_estimate(struct ploop_disk_images_data *di,
+		struct ploop_merge_param *param)
+{
+	struct ploop_merge_estimate est;
+	int i, ret;
+
+	ret = ploop_merge_estimate(di, param, &est);
+	if (ret)
+		return ret;
+
+	printf("%-48s %12s %12s\n", "DELTA", "COPY,MB", "ALLOC,MB");
+	for (i = 0; i < est.nlevels; i++)
+		printf("%-48s %12llu %12llu\n", est.levels[i].image,
+				est.levels[i].copy_clusters * est.cluster >> 20,
+				est.levels[i].new_clusters * est.cluster >> 20);
+	printf("Data to copy:    %llu MB\n", est.copy_bytes >> 20);
+	printf("Space to alloc:  %llu MB\n", est.alloc_bytes >> 20);
+	printf("Peak space used: %llu MB\n", est.peak_bytes >> 20);
+	if (est.throughput)
+		printf("Duration:        %llu s (at %llu MB/s)\n",
+				est.duration, est.throughput >> 20);
+
+	ploop_free_merge_estimate(&est);
+
+	return 0;
 }
 
 static int plooptool_snapshot_merge(int argc, char ** argv)
 {
 	int i, ret;
+	int estimate = 0;
 	struct ploop_merge_param param = {};
+	static struct option long_opts[] = {
+		{ "estimate", no_argument, 0, 'e' },
+		{},
+	};
 
-	while ((i = getopt(argc, argv, "u:n:A")) != EOF) {
+	while ((i = getopt_long(argc, argv, "u:n:Aq:",
+					long_opts, NULL)) != EOF) {
 		switch (i) {
 		case 'u':
 			param.guid = parse_uuid(optarg);
@@ -864,6 +903,16 @@ static int plooptool_snapshot_merge(int argc, char ** argv)
 		case 'n':
 			param.new_delta = strdup(optarg);
 			break;
+		case 'q':
+			param.queue_depth = atoi(optarg);
+			if (param.queue_depth <= 0) {
+				usage_snapshot_merge();
+				return SYSEXIT_PARAM;
+			}
+			break;
+		case 'e':
+			estimate = 1;
+			break;
 		default:
 			usage_snapshot_merge();
 			return SYSEXIT_PARAM;
@@ -885,7 +934,10 @@ static int plooptool_snapshot_merge(int argc, char ** argv)
 		if (ret)
 			return ret;
 
-		ret = ploop_merge_snapshot(di, &param);
+		if (estimate)
+			ret = print_merge_estimate(di, &param);
+		else
+			ret = ploop_merge_snapshot(di, &param);
 
 		ploop_close_dd(di);
 	} else {
@@ -1493,10 +1545,54 @@ static int plooptool_encrypt(int argc, char **argv)
 	return ret;
 }
 
+/* Parse NUMBER[KMG] */
+static int parse_rate(const char *arg, unsigned long long *val)
+{
+	char *endptr;
+
+	*val = strtoull(arg, &endptr, 0);
+	if (arg == endptr)
+		return -1;
+
+	switch (*endptr) {
+	case 'G': case 'g':
+		*val <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		*val <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		*val <<= 10;
+		endptr++;
+		break;
+	}
+
+	return *endptr == '\0' ? 0 : -1;
+}
+
+/* Parse --io-limit=RATE or --iops-limit=IOPS */
+static int parse_io_limit(const char *opt, unsigned long long *bps,
+		unsigned long long *iops)
+{
+	const char *arg;
+
+	if ((arg = strchr(opt, '=')) == NULL)
+		return -1;
+	arg++;
+
+	if (strncmp(opt, "--io-limit=", arg - opt) == 0)
+		return parse_rate(arg, bps);
+	if (strncmp(opt, "--iops-limit=", arg - opt) == 0)
+		return parse_rate(arg, iops) || *iops > UINT_MAX ? -1 : 0;
+
+	return -1;
+}
+
 int main(int argc, char **argv)
 {
 	char * cmd;
 	int v = 3;
+	unsigned long long bps = 0, iops = 0;
 
 	/* global options */
 	while (argc > 1 && argv[1][0] == '-') {
@@ -1514,6 +1610,8 @@ int main(int argc, char **argv)
 				}
 				break;
 			case '-': /* long option */
+				if (parse_io_limit(argv[1], &bps, &iops) == 0)
+					break;
 				/* fall through */
 			default:
 				fprintf(stderr, "Bad option %s\n", argv[1]);
@@ -1534,6 +1632,8 @@ int main(int argc, char **argv)
 	argv++;
 
 	ploop_set_verbose_level(v);
+	if (bps || iops)
+		ploop_set_io_limit(bps, iops);
 	init_signals();
 
 	if (strcmp(cmd, "init") == 0)